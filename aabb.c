@@ -108,6 +108,15 @@ AABB surrounding_box(AABB box0, AABB box1) {
     return surrounding_box;
 }
 
+//
+// Returns the surface area of a box, which the surface area heuristic takes as the
+// chance that a random ray hits it.
+//
+double aabb_surface_area(AABB box) {
+    vec3 d = v3_sub(box.max, box.min);
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
 //
 // Prints the lower and upper bound of the given AABB.
 //
@@ -18,4 +18,6 @@ bool aabb_hit(AABB aabb, ray r, double t_min, double t_max);
 
 AABB surrounding_box(AABB box0, AABB box1);
 
+double aabb_surface_area(AABB box);
+
 void aabb_print(AABB box);
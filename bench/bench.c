@@ -0,0 +1,201 @@
+//
+// Benchmark suite: renders a fixed set of canonical scenes at a fixed resolution,
+// sample count and seed, and reports BVH build time, render time, ray throughput
+// and peak memory for each. Every scene runs in its own child process so that the
+// peak RSS reported belongs to that scene alone.
+//
+// Usage: pathtrace-bench [-t threads] [-b builder] [-O] [results.json]
+//
+
+#include "bvh.h"
+#include "camera.h"
+#include "cpu.h"
+#include "framebuffer.h"
+#include "render.h"
+#include "scene.h"
+#include "util.h"
+#include "vec3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BENCH_WIDTH 320
+#define BENCH_HEIGHT 240
+#define BENCH_SPP 16
+#define BENCH_MAX_DEPTH 50
+#define BENCH_SEED 1
+#define BENCH_FIELD_SPHERES 20000
+#define BENCH_FOREST_TREES 500
+
+typedef struct {
+    const char *name;
+    Scene *(*create)(void);
+    vec3 look_from, look_at;
+    double vfov, aperture;
+} BenchScene;
+
+typedef struct {
+    uint32_t objects;
+    uint64_t rays;
+    double build_seconds, render_seconds;
+} BenchResult;
+
+static Scene *dense_field_scene(void) { return sphere_field_scene(BENCH_FIELD_SPHERES); }
+
+static Scene *forest_bench_scene(void) { return forest_scene(BENCH_FOREST_TREES); }
+
+static const BenchScene scenes[] = {
+    {"random", random_scene, {13, 2, 3}, {0, 0, 0}, 20, 0.1},
+    {"two_spheres", two_sphere_scene, {0, 0, 5}, {0, 0, 0}, 40, 0.05},
+    {"dense_field", dense_field_scene, {0, 6, 24}, {0, 0, 0}, 50, 0.0},
+    {"glass", glass_scene, {0, 3, 9}, {0, 0.4, 0}, 45, 0.0},
+    {"forest", forest_bench_scene, {0, 8, 26}, {0, 1, 0}, 50, 0.0},
+};
+
+//
+// Builds and renders one scene, timing the BVH build and the render.
+//
+static BenchResult run_scene(const BenchScene *bench, uint32_t threads,
+                             BVHBuilder builder, bool optimize) {
+    BenchResult result;
+
+    random_seed(BENCH_SEED);
+    Scene *scene = bench->create();
+    result.objects = scene->object_count;
+
+    double aspect_ratio = (double)BENCH_WIDTH / BENCH_HEIGHT;
+    double dist_to_focus = v3_length(v3_sub(bench->look_from, bench->look_at));
+    Camera *cam = cam_create(v3_init(0, 1, 0), bench->look_from, bench->look_at,
+                             aspect_ratio, bench->vfov, bench->aperture, dist_to_focus);
+
+    ThreadPool *pool = pool_create(threads - 1, NULL);
+
+    double start = now_seconds();
+    BVHNode *bvh = bvh_build_with(scene, builder, 1, pool);
+    if (optimize) {
+        bvh_optimize(scene, &bvh, pool);
+    }
+    result.build_seconds = now_seconds() - start;
+
+    Framebuffer *fb = fb_create(BENCH_WIDTH, BENCH_HEIGHT);
+    RenderArgs args = {.scene = scene,
+                       .cam = cam,
+                       .bvh = bvh,
+                       .image_width = BENCH_WIDTH,
+                       .image_height = BENCH_HEIGHT,
+                       .max_depth = BENCH_MAX_DEPTH,
+                       .fb = fb,
+                       .seed = BENCH_SEED,
+                       .pool = pool};
+
+    start = now_seconds();
+    render_progressive(&args, BENCH_SPP, 0, NULL, 0, false);
+    result.render_seconds = now_seconds() - start;
+    result.rays = args.rays;
+
+    fb_delete(&fb);
+    pool_delete(&pool);
+    bvh_delete(&bvh);
+    scene_delete(&scene);
+    cam_delete(&cam);
+
+    return result;
+}
+
+int main(int argc, char **argv) {
+    CpuTopology *topology = topology_create();
+    uint32_t threads = topology_thread_count(topology);
+    topology_delete(&topology);
+    const char *results_path = "bench_results.json";
+    BVHBuilder builder = BVH_BUILDER_MEDIAN;
+    bool optimize = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:b:O")) != -1) {
+        int b = 0;
+        while (opt == 'b' && b < BVH_BUILDER_COUNT &&
+               strcmp(optarg, bvh_builder_names[b]) != 0) {
+            b++;
+        }
+        if (opt == 't' && atoi(optarg) > 0) {
+            threads = (uint32_t)atoi(optarg);
+        } else if (opt == 'b' && b < BVH_BUILDER_COUNT) {
+            builder = (BVHBuilder)b;
+        } else if (opt == 'O') {
+            optimize = true;
+        } else {
+            fprintf(stderr, "Usage: %s [-t threads] [-b median|lbvh] [-O] [results.json]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        results_path = argv[optind];
+    }
+
+    FILE *json = fopen(results_path, "w");
+    if (json == NULL) {
+        fprintf(stderr, "ERROR: Failed to open %s!\n", results_path);
+        return 1;
+    }
+    fprintf(json,
+            "{\n  \"width\": %d,\n  \"height\": %d,\n  \"spp\": %d,\n"
+            "  \"max_depth\": %d,\n  \"seed\": %d,\n  \"threads\": %u,\n"
+            "  \"builder\": \"%s\",\n  \"optimized\": %s,\n  \"scenes\": [",
+            BENCH_WIDTH, BENCH_HEIGHT, BENCH_SPP, BENCH_MAX_DEPTH, BENCH_SEED, threads,
+            bvh_builder_names[builder], optimize ? "true" : "false");
+
+    printf("%-12s %8s %10s %10s %10s %12s\n", "scene", "objects", "build_s", "render_s",
+           "Mrays/s", "peak_rss_kb");
+
+    size_t scene_count = sizeof(scenes) / sizeof(scenes[0]);
+    for (size_t i = 0; i < scene_count; i++) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            perror("pipe");
+            return 1;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            BenchResult result = run_scene(&scenes[i], threads, builder, optimize);
+            ssize_t written = write(fds[1], &result, sizeof(result));
+            _exit(written == (ssize_t)sizeof(result) ? 0 : 1);
+        }
+        close(fds[1]);
+
+        BenchResult result;
+        ssize_t got = read(fds[0], &result, sizeof(result));
+        close(fds[0]);
+
+        int status;
+        struct rusage usage;
+        if (pid < 0 || wait4(pid, &status, 0, &usage) < 0 || got != sizeof(result) ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "ERROR: Benchmark of scene %s failed!\n", scenes[i].name);
+            return 1;
+        }
+
+        double mrays = (double)result.rays / result.render_seconds * 1e-6;
+        printf("%-12s %8u %10.4f %10.3f %10.3f %12ld\n", scenes[i].name, result.objects,
+               result.build_seconds, result.render_seconds, mrays, usage.ru_maxrss);
+        fprintf(json,
+                "%s\n    {\"name\": \"%s\", \"objects\": %u, \"rays\": %llu, "
+                "\"build_seconds\": %.6f, \"render_seconds\": %.6f, "
+                "\"mrays_per_second\": %.4f, \"peak_rss_kb\": %ld}",
+                i ? "," : "", scenes[i].name, result.objects,
+                (unsigned long long)result.rays, result.build_seconds,
+                result.render_seconds, mrays, usage.ru_maxrss);
+    }
+
+    fprintf(json, "\n  ]\n}\n");
+    fclose(json);
+    printf("Results written to %s\n", results_path);
+
+    return 0;
+}
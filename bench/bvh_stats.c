@@ -0,0 +1,161 @@
+//
+// BVH quality report: builds the BVH of one scene with every builder and prints, side
+// by side, what makes a tree fast or slow to trace: its node counts, the depths of its
+// leaves, its leaf sizes, its SAH cost, how much the boxes of siblings overlap, and
+// the memory its nodes take. The "serial" column is bvh_create() on one thread, which
+// for scenes of BVH_TASK_SPAN objects or more builds a different tree from the
+// parallel median builder. With -O, every tree is reported a second time after
+// bvh_optimize(). Every build starts from the scene's original object order and the
+// same random seed, so the trees only differ by how they were built. Parallel builds
+// run on one thread per available CPU, or -t threads. Leaves deeper than 255 or
+// larger than 64 objects are counted with those. The statistics come from
+// bvh_report.h, which takes a tree from any builder.
+//
+// With -d, the box of every node of every tree is written to a CSV file, one row per
+// node, level by level, for plotting the trees one level at a time.
+//
+// Usage: pathtrace-bvh [-t threads] [-l leaf size] [-n objects] [-O] [-d boxes.csv]
+//                      [scene]
+//        scene is random, glass, field or forest (default field), or a scene file
+//
+
+#include "bvh.h"
+#include "bvh_report.h"
+#include "cpu.h"
+#include "pool.h"
+#include "scene.h"
+#include "scene_file.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BVH_STATS_SEED 1
+#define DEFAULT_FIELD_SPHERES 20000
+#define DEFAULT_FOREST_TREES 500
+#define MAX_TREES (2 * (BVH_BUILDER_COUNT + 1))
+
+static Scene *load_scene(const char *name, uint32_t count) {
+    random_seed(BVH_STATS_SEED);
+    if (strcmp(name, "random") == 0) {
+        return random_scene();
+    } else if (strcmp(name, "glass") == 0) {
+        return glass_scene();
+    } else if (strcmp(name, "field") == 0) {
+        return sphere_field_scene(count ? count : DEFAULT_FIELD_SPHERES);
+    } else if (strcmp(name, "forest") == 0) {
+        return forest_scene(count ? count : DEFAULT_FOREST_TREES);
+    }
+    SceneDesc desc;
+    return scene_load(name, &desc, false);
+}
+
+int main(int argc, char **argv) {
+    CpuTopology *topology = topology_create();
+    uint32_t threads = topology_thread_count(topology);
+    topology_delete(&topology);
+    uint32_t leaf_size = 1, count = 0;
+    bool optimize = false;
+    const char *dump_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:l:n:Od:")) != -1) {
+        if (opt == 't' && atoi(optarg) > 0) {
+            threads = (uint32_t)atoi(optarg);
+        } else if (opt == 'l' && atoi(optarg) > 0) {
+            leaf_size = (uint32_t)atoi(optarg);
+        } else if (opt == 'n' && atoi(optarg) > 0) {
+            count = (uint32_t)atoi(optarg);
+        } else if (opt == 'O') {
+            optimize = true;
+        } else if (opt == 'd') {
+            dump_path = optarg;
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [-t threads] [-l leaf size] [-n objects] [-O] "
+                    "[-d boxes.csv] [scene]\n"
+                    "       scene is random, glass, field or forest, or a scene file\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    const char *scene_name = optind < argc ? argv[optind] : "field";
+
+    Scene *scene = load_scene(scene_name, count);
+    if (scene == NULL) {
+        return 1;
+    }
+    if (scene->object_count == 0) {
+        fprintf(stderr, "ERROR: %s has no bounded objects to build a BVH over!\n",
+                scene_name);
+        scene_delete(&scene);
+        return 1;
+    }
+    printf("Scene %s: %u objects in the BVH, %u unbounded, leaf size %u, %u threads\n",
+           scene_name, scene->object_count, scene->unbounded_count, leaf_size, threads);
+
+    FILE *csv = NULL;
+    if (dump_path) {
+        csv = fopen(dump_path, "w");
+        if (csv == NULL) {
+            fprintf(stderr, "ERROR: Failed to open %s!\n", dump_path);
+            scene_delete(&scene);
+            return 1;
+        }
+        fprintf(csv, BVH_REPORT_CSV_HEADER);
+    }
+
+    // Every tree is built from this order, as building sorts the scene's objects
+    Hittable **order = (Hittable **)malloc(scene->object_count * sizeof(Hittable *));
+    assert(order != NULL);
+    memcpy(order, scene->objects, scene->object_count * sizeof(Hittable *));
+
+    ThreadPool *pool = pool_create(threads - 1, NULL);
+    BVHTreeStats *trees = (BVHTreeStats *)calloc(MAX_TREES, sizeof(BVHTreeStats));
+    assert(trees != NULL);
+    uint32_t tree_count = 0;
+    for (uint32_t optimized = 0; optimized <= (optimize ? 1 : 0); optimized++) {
+        // The builders, followed by bvh_create() on this thread alone
+        for (uint32_t b = 0; b <= BVH_BUILDER_COUNT; b++) {
+            char name[32];
+            snprintf(name, sizeof(name), "%s%s",
+                     b < BVH_BUILDER_COUNT ? bvh_builder_names[b] : "serial",
+                     optimized ? "+opt" : "");
+
+            memcpy(scene->objects, order, scene->object_count * sizeof(Hittable *));
+            random_seed(BVH_STATS_SEED);
+            double start = now_seconds();
+            BVHNode *bvh =
+                b < BVH_BUILDER_COUNT
+                    ? bvh_build_with(scene, (BVHBuilder)b, leaf_size, pool)
+                    : bvh_create(scene, 0, (int64_t)scene->object_count - 1, leaf_size);
+            if (optimized) {
+                bvh_optimize(scene, &bvh, pool);
+            }
+            double build_seconds = now_seconds() - start;
+
+            bvh_tree_stats(bvh, name, build_seconds, &trees[tree_count++]);
+            if (csv) {
+                bvh_report_boxes(csv, name, bvh);
+            }
+            bvh_delete(&bvh);
+        }
+    }
+    memcpy(scene->objects, order, scene->object_count * sizeof(Hittable *));
+
+    printf("\n");
+    bvh_report_print(trees, tree_count);
+
+    if (csv) {
+        fclose(csv);
+        printf("\nNode boxes written to %s\n", dump_path);
+    }
+    free(trees);
+    free(order);
+    pool_delete(&pool);
+    scene_delete(&scene);
+    return 0;
+}
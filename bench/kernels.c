@@ -0,0 +1,845 @@
+//
+// Micro-benchmarks for the intersection and shading kernels. Each kernel is timed
+// in isolation on pre-generated, reproducible workloads:
+//      - coherent:     camera-like rays from one origin, in raster order
+//      - incoherent:   random origins and random directions
+//      - mostly_hit:   rays aimed at the primitive they are tested against
+//      - mostly_miss:  rays aimed away from the primitive they are tested against
+// Every measurement does a warm-up run followed by a number of timed repetitions
+// over the whole workload, and reports the mean, standard deviation and minimum
+// time per operation, along with the fraction of operations that hit.
+//
+// With -v, the kernels are checked instead of timed: random rays are fired at random
+// scenes, before and after moving their objects and updating the BVH, which each of
+// the builders takes turns at, optimized or not, and every accelerated traversal
+// must find the same closest hit as the brute-force scene_intersect(), on a copy of
+// the scene whose meshes are tested triangle by triangle and whose instances test
+// their groups object by object. Hits must agree on the distance, the material,
+// which instances may replace, and the normal and side of the surface. Scenes large
+// enough for the parallel builders are built and updated on a pool, and also checked
+// on their per NUMA node replicas. Any mismatch is printed and fails the run.
+// Environment sampling is checked too, on a small generated image: the density of
+// envmap_sample() must integrate to 1 over the sphere, agree with envmap_pdf() for
+// the directions it picks, never pick black texels, and give an unbiased estimate
+// of the light coming from the whole environment.
+//
+// Usage: pathtrace-kernels [-n rays] [-r repetitions]
+//        pathtrace-kernels -v [-n rays per scene] [-s scenes] [-l large scenes]
+//
+
+#include "aabb.h"
+#include "bvh.h"
+#include "camera.h"
+#include "cpu.h"
+#include "envmap.h"
+#include "hit.h"
+#include "hittable.h"
+#include "instance.h"
+#include "material.h"
+#include "mesh.h"
+#include "placement.h"
+#include "plane.h"
+#include "pool.h"
+#include "ray.h"
+#include "scene.h"
+#include "sphere.h"
+#include "util.h"
+#include "vec3.h"
+
+#include "include/stb_image/stb_image_write.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define KERNEL_SEED 1
+#define DEFAULT_RAYS (1 << 16)
+#define DEFAULT_REPETITIONS 10
+#define COHERENT_BLOCK 64 // Consecutive coherent rays tested against one primitive
+#define DEFAULT_VERIFY_RAYS 10000
+#define DEFAULT_VERIFY_SCENES 200
+#define VERIFY_MAX_OBJECTS 500
+#define DEFAULT_VERIFY_LARGE_SCENES (2 * BVH_BUILDER_COUNT) // Each builder, plain and opt
+#define VERIFY_LARGE_OBJECTS (4 * BVH_TASK_SPAN) // Most objects of a large scene
+#define VERIFY_LARGE_RAY_SHARE 4 // Large scenes get this fraction of the rays per scene
+#define VERIFY_WORKERS 3 // Pool workers that build the large scenes, whatever the CPUs
+#define VERIFY_MAX_MESHES 8 // Per scene, and as many instances, as references test
+                            // every triangle and every object of every group
+#define VERIFY_MAX_TRIANGLES 2000
+#define VERIFY_MAX_NESTING 2 // Instances of groups that hold instances of groups
+#define VERIFY_TOLERANCE 1e-9 // Relative difference allowed between hit distances
+#define VERIFY_NORMAL_TOLERANCE 1e-6 // Distance allowed between hit normals
+#define VERIFY_MATERIALS 4     // Objects and instances pick theirs from this many
+#define ENVMAP_WIDTH 64
+#define ENVMAP_HEIGHT 32
+#define ENVMAP_SAMPLES (1 << 18)
+#define ENVMAP_STRATA 8     // Quadrature points per texel along each axis
+#define ENVMAP_TOLERANCE 0.02 // Relative error allowed in the sampled estimate
+
+typedef enum { COHERENT, INCOHERENT, MOSTLY_HIT, MOSTLY_MISS, WORKLOAD_COUNT } Workload;
+
+static const char *workload_names[WORKLOAD_COUNT] = {"coherent", "incoherent",
+                                                     "mostly_hit", "mostly_miss"};
+
+typedef struct {
+    uint32_t count;
+    ray *rays;
+    uint32_t *prims;  // Primitive each ray is paired with for single primitive kernels
+    double *u, *v;    // Viewport coordinates the rays were generated from, if any
+    ray *hit_rays;    // Rays that hit the scene and their hit records, for shading
+    HitRecord *hits;
+    uint32_t hit_count;
+} RaySet;
+
+// Everything a kernel needs. Kernels return the number of operations that hit (or
+// scattered), which also keeps the compiler from optimizing the work away.
+typedef struct {
+    Scene *scene;
+    BVHNode *bvh;
+    Camera *cam;
+    AABB *boxes;
+    RaySet *set;
+} KernelContext;
+
+typedef uint64_t (*Kernel)(KernelContext *ctx);
+
+//
+// Generates the rays of a workload, paired with spheres of the scene. The ground of
+// random_scene() is a plane, which is not among the scene's bounded objects.
+//
+static RaySet make_ray_set(Workload workload, Scene *scene, Camera *cam, uint32_t count) {
+    RaySet set = {0};
+    set.count = count;
+    set.rays = (ray *)malloc(count * sizeof(ray));
+    set.prims = (uint32_t *)malloc(count * sizeof(uint32_t));
+    set.u = (double *)malloc(count * sizeof(double));
+    set.v = (double *)malloc(count * sizeof(double));
+    set.hit_rays = (ray *)malloc(count * sizeof(ray));
+    set.hits = (HitRecord *)malloc(count * sizeof(HitRecord));
+
+    uint32_t prim_count = scene->object_count;
+    uint32_t side = (uint32_t)sqrt((double)count);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t prim = (uint32_t)(random_uniform() * prim_count);
+        Sphere *s = (Sphere *)scene->objects[prim]->object;
+        vec3 origin = v3_init(random_double(-15, 15), random_double(0.5, 5),
+                              random_double(-15, 15));
+
+        switch (workload) {
+        case COHERENT:
+            set.u[i] = (double)(i % side) / side;
+            set.v[i] = (double)(i / side % side) / side;
+            set.rays[i] = get_view_ray(cam, set.u[i], set.v[i]);
+            prim = (i / COHERENT_BLOCK) % prim_count;
+            break;
+        case INCOHERENT:
+            set.u[i] = random_uniform();
+            set.v[i] = random_uniform();
+            set.rays[i] = (ray){origin, random_unit_vector()};
+            break;
+        case MOSTLY_HIT: {
+            vec3 target = v3_add(s->center, v3_scale(random_in_unit_sphere(), s->radius * 0.5));
+            set.rays[i] = (ray){origin, v3_unit_vector(v3_sub(target, origin))};
+            break;
+        }
+        case MOSTLY_MISS: {
+            vec3 away = v3_sub(origin, s->center);
+            set.rays[i] = (ray){origin, v3_unit_vector(away)};
+            break;
+        }
+        default:
+            break;
+        }
+        set.prims[i] = prim;
+    }
+
+    return set;
+}
+
+static void free_ray_set(RaySet *set) {
+    free(set->rays);
+    free(set->prims);
+    free(set->u);
+    free(set->v);
+    free(set->hit_rays);
+    free(set->hits);
+}
+
+static uint64_t kernel_aabb_hit(KernelContext *ctx) {
+    uint64_t hits = 0;
+    for (uint32_t i = 0; i < ctx->set->count; i++) {
+        hits += aabb_hit(ctx->boxes[ctx->set->prims[i]], ctx->set->rays[i], 0.001,
+                         INFINITY);
+    }
+    return hits;
+}
+
+static uint64_t kernel_sphere_intersect(KernelContext *ctx) {
+    uint64_t hits = 0;
+    HitRecord rec;
+    for (uint32_t i = 0; i < ctx->set->count; i++) {
+        Sphere *s = (Sphere *)ctx->scene->objects[ctx->set->prims[i]]->object;
+        hits += sphere_intersect(*s, ctx->set->rays[i], 0.001, INFINITY, &rec);
+    }
+    return hits;
+}
+
+static uint64_t kernel_bvh_hit(KernelContext *ctx) {
+    uint64_t hits = 0;
+    for (uint32_t i = 0; i < ctx->set->count; i++) {
+        HitRecord rec;
+        rec.t = INFINITY;
+        hits += bvh_hit(ctx->bvh, ctx->set->rays[i], 0.001, INFINITY, &rec);
+    }
+    return hits;
+}
+
+static uint64_t kernel_scatter(KernelContext *ctx) {
+    uint64_t scattered_count = 0;
+    for (uint32_t i = 0; i < ctx->set->hit_count; i++) {
+        HitRecord *rec = &ctx->set->hits[i];
+        color attenuation;
+        ray scattered;
+        scattered_count += scatter(rec->material, ctx->set->hit_rays[i], rec,
+                                   &attenuation, &scattered);
+    }
+    return scattered_count;
+}
+
+static uint64_t kernel_get_view_ray(KernelContext *ctx) {
+    uint64_t sink = 0;
+    for (uint32_t i = 0; i < ctx->set->count; i++) {
+        ray r = get_view_ray(ctx->cam, ctx->set->u[i], ctx->set->v[i]);
+        sink += r.dir.z < 0;
+    }
+    return sink;
+}
+
+//
+// Times a kernel on the current workload and prints one line of results.
+//
+static void measure(const char *name, Workload workload, Kernel kernel,
+                    KernelContext *ctx, uint32_t ops, uint32_t repetitions,
+                    bool counts_hits) {
+    if (ops == 0) {
+        return;
+    }
+
+    // Warm up caches and branch predictors; every run draws the same random numbers.
+    random_seed(KERNEL_SEED);
+    uint64_t hits = kernel(ctx);
+
+    double sum = 0, sum_sq = 0, min = INFINITY;
+    for (uint32_t r = 0; r < repetitions; r++) {
+        random_seed(KERNEL_SEED);
+        double start = now_seconds();
+        kernel(ctx);
+        double ns = (now_seconds() - start) * 1e9 / ops;
+        sum += ns;
+        sum_sq += ns * ns;
+        min = ns < min ? ns : min;
+    }
+
+    double mean = sum / repetitions;
+    double stddev = sqrt(fmax(sum_sq / repetitions - mean * mean, 0.0));
+    printf("%-18s %-12s %10.2f %10.2f %10.2f", name, workload_names[workload], mean,
+           stddev, min);
+    if (counts_hits) {
+        printf(" %8.1f%%\n", 100.0 * hits / ops);
+    } else {
+        printf(" %9s\n", "-");
+    }
+}
+
+// The accelerated structures built over one verification scene
+typedef struct {
+    Scene *scene;
+    BVHNode *bvh;
+} Accelerators;
+
+typedef bool (*Traversal)(Accelerators *accel, ray r, double t_min, double t_max,
+                          HitRecord *rec);
+
+static bool traverse_bvh(Accelerators *accel, ray r, double t_min, double t_max,
+                         HitRecord *rec) {
+    rec->t = INFINITY;
+    bool hit = bvh_hit(accel->bvh, r, t_min, t_max, rec);
+    return scene_intersect_unbounded(accel->scene, r, t_min, hit ? rec->t : t_max, rec) ||
+           hit;
+}
+
+// Every traversal checked against scene_intersect()
+static const struct {
+    const char *name;
+    Traversal traverse;
+} traversals[] = {
+    {"bvh_hit", traverse_bvh},
+};
+#define TRAVERSAL_COUNT (sizeof(traversals) / sizeof(traversals[0]))
+
+//
+// Builds a random mesh around center. Its vertices follow a random walk, so most
+// triangles are small, but some join vertices from anywhere and span the whole mesh,
+// and some repeat a vertex and have no area.
+//
+static Mesh *verify_mesh(vec3 center, double size, Material *material) {
+    uint32_t triangle_count = (uint32_t)random_int(1, VERIFY_MAX_TRIANGLES);
+    uint32_t vertex_count = (uint32_t)random_int(3, 2 * triangle_count + 3);
+    Mesh *mesh = mesh_create(vertex_count, triangle_count, false, false);
+    vec3 p = center;
+    for (uint32_t i = 0; i < vertex_count; i++) {
+        p = v3_add(p, v3_scale(random_in_unit_sphere(), size * 0.1));
+        mesh->positions[3 * i] = (float)p.x;
+        mesh->positions[3 * i + 1] = (float)p.y;
+        mesh->positions[3 * i + 2] = (float)p.z;
+    }
+    for (uint32_t i = 0; i < triangle_count; i++) {
+        uint32_t first = (uint32_t)random_int(0, vertex_count - 1);
+        for (int k = 0; k < 3; k++) {
+            uint32_t v = random_uniform() < 0.05
+                             ? (uint32_t)random_int(0, vertex_count - 1)
+                             : first + (uint32_t)random_int(0, 3);
+            mesh->triangles[i].v[k] = v < vertex_count ? v : first;
+        }
+    }
+    mesh->material = material;
+    mesh_build(mesh);
+    return mesh;
+}
+
+//
+// Gives every object of a scene the given material, instances included, so that
+// reference hits do not depend on instances replacing the materials of their groups.
+//
+static void replace_materials(Scene *scene, Material *material) {
+    for (uint32_t i = 0; i < scene->object_count; i++) {
+        void *object = scene->objects[i]->object;
+        switch (scene->objects[i]->type) {
+        case SPHERE:
+            ((Sphere *)object)->material = material;
+            break;
+        case PLANE:
+            ((Plane *)object)->material = material;
+            break;
+        case RECT:
+            ((Rect *)object)->material = material;
+            break;
+        case DISK:
+            ((Disk *)object)->material = material;
+            break;
+        case MESH:
+            ((Mesh *)object)->material = material;
+            break;
+        case INSTANCE:
+            replace_materials(((Instance *)object)->group->scene, material);
+            ((Instance *)object)->material = NULL;
+            break;
+        }
+    }
+}
+
+//
+// Copies a scene for brute-force reference hits. Every mesh of the copy becomes a
+// single leaf, so its triangles are tested one by one, and every instance gets a
+// brute-force copy of its group without a BVH, whose objects take on the instance's
+// material if it replaces theirs.
+//
+static Scene *brute_force_scene(Scene *scene) {
+    Scene *copy = scene_clone(scene);
+    for (uint32_t i = 0; i < copy->object_count; i++) {
+        if (copy->objects[i]->type == MESH) {
+            Mesh *mesh = (Mesh *)copy->objects[i]->object;
+            mesh->node_count = 1;
+            mesh->nodes[0].index = 0;
+            mesh->nodes[0].count = mesh->triangle_count;
+        } else if (copy->objects[i]->type == INSTANCE) {
+            Instance *instance = (Instance *)copy->objects[i]->object;
+            Group *group = group_create(brute_force_scene(instance->group->scene), NULL);
+            if (instance->material) {
+                replace_materials(group->scene, instance->material);
+                instance->material = NULL;
+            }
+            group_release(&instance->group);
+            instance->group = group;
+        }
+    }
+    return copy;
+}
+
+static Scene *verify_scene(Material **materials, uint32_t depth, uint32_t count);
+
+static Material *verify_material(Material **materials) {
+    return materials[random_int(0, VERIFY_MATERIALS - 1)];
+}
+
+//
+// Places a group of random objects somewhere in the scene, scaled unevenly and
+// rotated. Half the time, the group is the one placed last, which instances share,
+// and half the time the instance replaces the materials of the group's objects.
+//
+static Instance *verify_instance(Material **materials, uint32_t depth, Group **last) {
+    if (*last == NULL || random_uniform() < 0.5) {
+        group_release(last);
+        uint32_t count = (uint32_t)random_int(1, VERIFY_MAX_OBJECTS / (10 + 9 * depth));
+        Scene *scene = verify_scene(materials, depth + 1, count);
+        BVHBuilder builder = (BVHBuilder)random_int(0, BVH_BUILDER_COUNT - 1);
+        BVHNode *bvh = bvh_build_with(scene, builder, (uint32_t)random_int(1, 4), NULL);
+        if (random_uniform() < 0.5) {
+            bvh_optimize(scene, &bvh, NULL);
+        }
+        *last = group_create(scene, bvh);
+    }
+    Transform to_world = transform_scale(v3_init(
+        random_double(0.05, 0.5), random_double(0.05, 0.5), random_double(0.05, 0.5)));
+    for (int i = 0; i < 2; i++) {
+        Transform rotation = transform_rotate((uint32_t)random_int(0, 2),
+                                              random_double(0, 360));
+        to_world = transform_compose(rotation, to_world);
+    }
+    to_world = transform_compose(transform_translate(v3_random_range(-10, 10)), to_world);
+    return instance_create(*last, to_world,
+                           random_uniform() < 0.5 ? verify_material(materials) : NULL);
+}
+
+//
+// Builds a random scene: clusters of small spheres, scattered spheres of any size,
+// spheres nested inside others, the occasional huge ground-like sphere, and a few
+// rectangles, disks, planes, meshes and instances, so that boxes overlap in every way
+// the builders have to cope with. Scenes at a depth above 0 are the smaller groups of
+// instances, which hold no planes.
+//
+static Scene *verify_scene(Material **materials, uint32_t depth, uint32_t count) {
+    Scene *scene = scene_create();
+    Sphere *last = NULL; // Most recently added sphere
+    Group *group = NULL; // Most recently instanced group
+    uint32_t meshes = 0, instances = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        double p = random_uniform();
+        vec3 center = v3_random_range(-10, 10);
+        double radius = exp(random_double(log(0.01), log(5.0)));
+        uint32_t axis = (uint32_t)random_int(0, 2);
+        Material *material = verify_material(materials);
+        if (p < 0.01 && depth == 0) {
+            scene_add_plane(scene, center, random_unit_vector(), material);
+            continue;
+        } else if (p < 0.04) {
+            double u = random_double(-10, 10), v = random_double(-10, 10);
+            scene_add_rect(scene, axis, center.x, u, u + radius * 2, v, v + radius,
+                           material);
+            continue;
+        } else if (p < 0.07) {
+            scene_add_disk(scene, center, radius, axis, material);
+            continue;
+        } else if (p < 0.08 && meshes < VERIFY_MAX_MESHES) {
+            scene_add_mesh(scene, verify_mesh(center, radius * 2, material));
+            meshes++;
+            continue;
+        } else if (p < 0.09 && depth < VERIFY_MAX_NESTING &&
+                   instances < VERIFY_MAX_MESHES) {
+            scene_add_instance(scene, verify_instance(materials, depth, &group));
+            instances++;
+            continue;
+        } else if (p < 0.1) {
+            center = v3_init(0, -1000 - random_double(0, 5), 0);
+            radius = 1000;
+        } else if (p < 0.3 && last) {
+            // Next to or inside an earlier sphere
+            center = v3_add(last->center, v3_scale(random_in_unit_sphere(),
+                                                   last->radius * 1.5));
+            radius = last->radius * random_double(0.05, 0.5);
+        }
+        scene_add_sphere(scene, center.x, center.y, center.z, radius, material);
+        last = (Sphere *)scene->objects[scene->object_count - 1]->object;
+    }
+    group_release(&group);
+    return scene;
+}
+
+//
+// Returns a random ray at the scene. Rays aimed at a mesh vertex hit every triangle
+// around it at the same distance, where any of them is the right one to report, so
+// their surfaces are not compared. at_vertex is set for those.
+//
+static ray verify_ray(Scene *scene, bool *at_vertex) {
+    *at_vertex = false;
+    vec3 origin = v3_random_range(-15, 15);
+    Hittable *h = scene->object_count
+                      ? scene->objects[random_int(0, scene->object_count - 1)]
+                      : NULL;
+    if (random_uniform() < 0.3 && h && h->type == SPHERE) {
+        // Aim at an object, which for nested spheres may start the ray inside one
+        Sphere *s = (Sphere *)h->object;
+        if (random_uniform() < 0.2) {
+            origin = v3_add(s->center, v3_scale(random_in_unit_sphere(), s->radius));
+        }
+        vec3 target = v3_add(s->center, v3_scale(random_in_unit_sphere(), s->radius));
+        vec3 dir = v3_sub(target, origin);
+        if (v3_length_squared(dir) > 0) {
+            return (ray){origin, v3_unit_vector(dir)};
+        }
+    } else if (random_uniform() < 0.5 && h && h->type == MESH) {
+        // Aim at a vertex of a mesh, which hits its edges and corners
+        Mesh *mesh = (Mesh *)h->object;
+        uint32_t v = (uint32_t)random_int(0, mesh->vertex_count - 1);
+        const float *p = mesh->positions + 3 * (size_t)v;
+        vec3 dir = v3_sub(v3_init(p[0], p[1], p[2]), origin);
+        if (v3_length_squared(dir) > 0) {
+            *at_vertex = true;
+            return (ray){origin, v3_unit_vector(dir)};
+        }
+    } else if (random_uniform() < 0.5 && h && h->type == INSTANCE) {
+        // Aim into the box of an instance
+        AABB box = ((Instance *)h->object)->box;
+        vec3 target = v3_add(box.min, v3_hadamard(v3_sub(box.max, box.min),
+                                                  v3_random_uniform()));
+        vec3 dir = v3_sub(target, origin);
+        if (v3_length_squared(dir) > 0) {
+            return (ray){origin, v3_unit_vector(dir)};
+        }
+    }
+    return (ray){origin, random_unit_vector()};
+}
+
+//
+// Moves the objects of a scene like an animation would: either all of them a little,
+// like the particles of a simulation, or a few of them, or just one, a long way.
+//
+static void verify_animate(Scene *scene) {
+    double p = random_uniform();
+    bool few = p < 0.6;
+    uint32_t one = p < 0.3 && scene->object_count > 0
+                       ? (uint32_t)random_int(0, scene->object_count - 1)
+                       : UINT32_MAX;
+    for (uint32_t i = 0; i < scene->object_count; i++) {
+        if (few && (one != UINT32_MAX ? i != one : random_uniform() > 0.02)) {
+            continue;
+        }
+        vec3 offset = v3_scale(random_in_unit_sphere(), few ? 10 : 0.5);
+        Hittable *h = scene->objects[i];
+        if (h->type == SPHERE && random_uniform() < 0.5) {
+            Sphere *s = (Sphere *)h->object;
+            scene_update_sphere(scene, i, v3_add(s->center, offset),
+                                s->radius * random_double(0.5, 1.5));
+        } else {
+            scene_move_object(scene, i, offset);
+        }
+    }
+}
+
+// Whether two hits are at the same distance with the same material and, unless the
+// surface hit is ambiguous, the same normal and side
+static bool same_hit(const HitRecord *a, const HitRecord *b, bool ambiguous) {
+    return fabs(a->t - b->t) <= VERIFY_TOLERANCE * fmax(1.0, fabs(b->t)) &&
+           a->material == b->material &&
+           (ambiguous ||
+            (v3_length(v3_sub(a->normal, b->normal)) <= VERIFY_NORMAL_TOLERANCE &&
+             a->front_face == b->front_face));
+}
+
+//
+// Fires ray_count random rays at a scene and compares every traversal with
+// scene_intersect() on the reference copy. Returns the number of mismatches, and
+// adds to the counts of rays and hits.
+//
+static uint64_t verify_rays(Accelerators *accel, Scene *reference, uint32_t n,
+                            uint32_t ray_count, uint64_t *rays, uint64_t *hits,
+                            uint64_t mismatches) {
+    uint64_t found = 0;
+    for (uint32_t i = 0; i < ray_count; i++) {
+        bool at_vertex;
+        ray r = verify_ray(accel->scene, &at_vertex);
+        double t_min = random_uniform() < 0.5 ? 0.001 : random_double(0, 5);
+        double t_max = random_uniform() < 0.5 ? INFINITY : t_min + random_double(0, 30);
+
+        HitRecord expected;
+        bool expect_hit = scene_intersect(reference, r, t_min, t_max, &expected);
+        *hits += expect_hit;
+        (*rays)++;
+
+        for (uint32_t k = 0; k < TRAVERSAL_COUNT; k++) {
+            HitRecord rec;
+            bool hit = traversals[k].traverse(accel, r, t_min, t_max, &rec);
+            if (hit == expect_hit && (!hit || same_hit(&rec, &expected, at_vertex))) {
+                continue;
+            }
+            if (mismatches + found++ < 20) {
+                printf("MISMATCH %s, scene %u ray %u: orig (%g, %g, %g) dir (%g, %g, %g) "
+                       "t [%g, %g]: expected %s t = %.17g, got %s t = %.17g\n",
+                       traversals[k].name, n, i, r.orig.x, r.orig.y, r.orig.z, r.dir.x,
+                       r.dir.y, r.dir.z, t_min, t_max, expect_hit ? "hit" : "miss",
+                       expect_hit ? expected.t : 0, hit ? "hit" : "miss",
+                       hit ? rec.t : 0);
+                if (hit && expect_hit) {
+                    printf("    normal (%g, %g, %g) front %d, got (%g, %g, %g) front %d, "
+                           "%s material\n",
+                           expected.normal.x, expected.normal.y, expected.normal.z,
+                           expected.front_face, rec.normal.x, rec.normal.y, rec.normal.z,
+                           rec.front_face,
+                           rec.material == expected.material ? "same" : "different");
+                }
+            }
+        }
+    }
+    return found;
+}
+
+//
+// Fires ray_count random rays at each of scene_count random scenes and compares
+// every traversal with scene_intersect(). The scenes take turns at each BVH builder,
+// with and without bvh_optimize(). Half the rays are fired after the scene was
+// animated and its BVH brought up to date by bvh_update(), which refits, rebuilds
+// parts of or rebuilds the tree depending on the rebuild ratio drawn for the scene.
+//
+// Then come large_count scenes of more than BVH_TASK_SPAN objects, which are built,
+// optimized and updated on a pool, so that the parallel median split, LBVH chunks and
+// treelet restructuring all run, and which are also checked on their replicas from
+// placement_create(), for every NUMA node, before they are animated. They get a
+// fraction of the rays, as the reference tests every object for each.
+// Returns the number of mismatches.
+//
+static uint64_t verify(uint32_t ray_count, uint32_t scene_count, uint32_t large_count) {
+    Material *materials[VERIFY_MATERIALS];
+    for (uint32_t i = 0; i < VERIFY_MATERIALS; i++) {
+        materials[i] = create_lambertian(v3_init(0.2 * (i + 1), 0.5, 0.5));
+    }
+    ThreadPool *pool = pool_create(VERIFY_WORKERS, NULL);
+    CpuTopology *topology = topology_create();
+    uint64_t mismatches = 0, rays = 0, hits = 0;
+    uint32_t updates[3] = {0}; // Scenes by what bvh_update() did
+    uint32_t replicas = 0;
+
+    for (uint32_t n = 0; n < scene_count + large_count; n++) {
+        bool large = n >= scene_count;
+        uint32_t k = large ? n - scene_count : n; // Which builder and whether optimized
+        ThreadPool *build_pool = large ? pool : NULL;
+        uint32_t scene_rays = large ? ray_count / VERIFY_LARGE_RAY_SHARE : ray_count;
+
+        random_seed(KERNEL_SEED + n);
+        uint32_t count =
+            (uint32_t)(large ? random_int(BVH_TASK_SPAN + 1, VERIFY_LARGE_OBJECTS)
+                             : random_int(1, VERIFY_MAX_OBJECTS));
+        Scene *scene = verify_scene(materials, 0, count);
+        Scene *reference = brute_force_scene(scene);
+        Accelerators accel = {scene, NULL};
+        uint32_t leaf_size = (uint32_t)random_int(1, 4);
+        if (scene->object_count > 0) {
+            BVHBuilder builder = (BVHBuilder)(k % BVH_BUILDER_COUNT);
+            accel.bvh = bvh_build_with(scene, builder, leaf_size, build_pool);
+            if (k / BVH_BUILDER_COUNT % 2) {
+                bvh_optimize(scene, &accel.bvh, build_pool);
+            }
+        }
+        mismatches += verify_rays(&accel, reference, n, scene_rays / 2, &rays, &hits,
+                                  mismatches);
+
+        if (large && accel.bvh) {
+            // The copies the renderer traverses with --numa
+            Placement *placement = placement_create(topology, scene, accel.bvh);
+            for (uint32_t node = 0; node < topology->node_count; node++) {
+                Accelerators replica = {placement->scenes[node], placement->bvhs[node]};
+                mismatches += verify_rays(&replica, reference, n, scene_rays / 2, &rays,
+                                          &hits, mismatches);
+                replicas++;
+            }
+            placement_delete(&placement);
+        }
+
+        verify_animate(scene);
+        // Ratios below 1 rebuild subtrees that did not get any better, to cover rebuilds
+        double ratio = random_uniform() < 0.2 ? INFINITY : random_double(0.95, 1.5);
+        updates[bvh_update(scene, accel.bvh, leaf_size, ratio, build_pool)]++;
+        scene_delete(&reference);
+        reference = brute_force_scene(scene);
+        mismatches += verify_rays(&accel, reference, n, scene_rays - scene_rays / 2,
+                                  &rays, &hits, mismatches);
+
+        bvh_delete(&accel.bvh);
+        scene_delete(&scene);
+        scene_delete(&reference);
+    }
+
+    printf("Animated scenes: %u refitted, %u partially rebuilt, %u rebuilt\n",
+           updates[BVH_REFIT], updates[BVH_PARTIAL_REBUILD], updates[BVH_FULL_REBUILD]);
+    printf("Large scenes: %u, built on %u threads, %u NUMA replicas checked\n",
+           large_count, VERIFY_WORKERS + 1, replicas);
+    printf("%llu rays over %u scenes (%.1f%% hit), %zu traversals: %llu mismatches\n",
+           (unsigned long long)rays, scene_count + large_count, 100.0 * hits / rays,
+           TRAVERSAL_COUNT, (unsigned long long)mismatches);
+    topology_delete(&topology);
+    pool_delete(&pool);
+    for (uint32_t i = 0; i < VERIFY_MATERIALS; i++) {
+        mat_delete(&materials[i]);
+    }
+    return mismatches;
+}
+
+static double luminance(color c) { return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z; }
+
+// The unit direction at (u, v) of an equirectangular image, as envmap_lookup() maps it
+static vec3 envmap_direction(double u, double v) {
+    double phi = (u - 0.5) * 2 * M_PI, latitude = (v - 0.5) * M_PI;
+    return v3_init(cos(latitude) * sin(phi), sin(latitude), cos(latitude) * cos(phi));
+}
+
+//
+// Checks envmap_sample() and envmap_pdf() on a generated environment: a dim sky with
+// black bands and a small bright sun. Returns the number of failed checks.
+//
+static uint64_t verify_envmap(void) {
+    random_seed(KERNEL_SEED);
+    uint8_t pixels[ENVMAP_WIDTH * ENVMAP_HEIGHT * 3];
+    for (uint32_t y = 0; y < ENVMAP_HEIGHT; y++) {
+        for (uint32_t x = 0; x < ENVMAP_WIDTH; x++) {
+            uint8_t *p = &pixels[(y * ENVMAP_WIDTH + x) * 3];
+            bool sun = x >= 40 && x < 43 && y >= 8 && y < 10;
+            bool black = y == 0 || y == 15 || x % 16 == 5;
+            for (int c = 0; c < 3; c++) {
+                p[c] = sun ? 255 : (black ? 0 : (uint8_t)random_int(1, 80));
+            }
+        }
+    }
+    char path[] = "/tmp/pathtrace-envmap-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("MISMATCH envmap: failed to create %s\n", path);
+        return 1;
+    }
+    close(fd);
+    EnvMap *env = stbi_write_png(path, ENVMAP_WIDTH, ENVMAP_HEIGHT, 3, pixels,
+                                 ENVMAP_WIDTH * 3)
+                      ? envmap_load(path, NULL)
+                      : NULL;
+    remove(path);
+    if (env == NULL) {
+        printf("MISMATCH envmap: failed to load the generated environment\n");
+        return 1;
+    }
+
+    // Midpoint quadrature over the image, dω = cos(latitude) * 2π du * π dv
+    double total_pdf = 0, total_light = 0;
+    uint32_t columns = ENVMAP_WIDTH * ENVMAP_STRATA, rows = ENVMAP_HEIGHT * ENVMAP_STRATA;
+    for (uint32_t j = 0; j < rows; j++) {
+        for (uint32_t i = 0; i < columns; i++) {
+            double v = (j + 0.5) / rows;
+            vec3 dir = envmap_direction((i + 0.5) / columns, v);
+            double area =
+                cos((v - 0.5) * M_PI) * 2 * M_PI * M_PI / ((double)columns * rows);
+            total_pdf += envmap_pdf(env, dir) * area;
+            total_light += luminance(envmap_lookup(env, dir)) * area;
+        }
+    }
+
+    // A pick may land on the edge of its texel and be looked up in the next one, so
+    // allow for a few of those
+    uint32_t disagree = 0, black = 0;
+    double estimate = 0;
+    for (uint32_t k = 0; k < ENVMAP_SAMPLES; k++) {
+        double pdf;
+        vec3 dir = envmap_sample(env, random_uniform(), random_uniform(), &pdf);
+        double light = luminance(envmap_lookup(env, dir));
+        disagree += !(fabs(envmap_pdf(env, dir) - pdf) <= 1e-6 * pdf);
+        black += light == 0;
+        estimate += pdf > 0 ? light / pdf / ENVMAP_SAMPLES : 0;
+    }
+    envmap_delete(&env);
+
+    uint64_t failures = (fabs(total_pdf - 1) > 1e-3) + (disagree > ENVMAP_SAMPLES / 1000) +
+                        (black > ENVMAP_SAMPLES / 1000) +
+                        (fabs(estimate - total_light) > ENVMAP_TOLERANCE * total_light);
+    printf("Environment sampling: pdf integrates to %.4f, %u of %u picks disagree with "
+           "envmap_pdf() and %u are black, light %.4f estimated as %.4f: %llu mismatches\n",
+           total_pdf, disagree, ENVMAP_SAMPLES, black, total_light, estimate,
+           (unsigned long long)failures);
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    uint32_t ray_count = 0;
+    uint32_t repetitions = DEFAULT_REPETITIONS;
+    uint32_t scene_count = DEFAULT_VERIFY_SCENES;
+    uint32_t large_count = DEFAULT_VERIFY_LARGE_SCENES;
+    bool verify_mode = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:s:l:v")) != -1) {
+        if (opt == 'n' && atoi(optarg) > 0) {
+            ray_count = (uint32_t)atoi(optarg);
+        } else if (opt == 'r' && atoi(optarg) > 0) {
+            repetitions = (uint32_t)atoi(optarg);
+        } else if (opt == 's' && atoi(optarg) > 0) {
+            scene_count = (uint32_t)atoi(optarg);
+        } else if (opt == 'l' && atoi(optarg) >= 0) {
+            large_count = (uint32_t)atoi(optarg);
+        } else if (opt == 'v') {
+            verify_mode = true;
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [-n rays] [-r repetitions]\n"
+                    "       %s -v [-n rays per scene] [-s scenes] [-l large scenes]\n",
+                    argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    if (verify_mode) {
+        uint64_t mismatches =
+            verify(ray_count ? ray_count : DEFAULT_VERIFY_RAYS, scene_count, large_count);
+        return mismatches + verify_envmap() ? 1 : 0;
+    }
+    if (ray_count == 0) {
+        ray_count = DEFAULT_RAYS;
+    }
+
+    random_seed(KERNEL_SEED);
+    Scene *scene = random_scene();
+    Camera *cam = cam_create(v3_init(0, 1, 0), v3_init(13, 2, 3), v3_init(0, 0, 0),
+                             4.0 / 3.0, 20, 0.1, 10);
+
+    // Building the BVH reorders the scene objects, so the boxes are computed after it
+    BVHNode *bvh = bvh_create(scene, 0, scene->object_count - 1, 1);
+    AABB *boxes = (AABB *)malloc(scene->object_count * sizeof(AABB));
+    for (uint32_t i = 0; i < scene->object_count; i++) {
+        hittable_bounding_box(*scene->objects[i], &boxes[i]);
+    }
+
+    printf("%u rays per workload, %u repetitions, %u objects\n", ray_count, repetitions,
+           scene->object_count);
+    printf("%-18s %-12s %10s %10s %10s %9s\n", "kernel", "workload", "ns/op", "stddev",
+           "min", "hit");
+
+    for (int w = 0; w < WORKLOAD_COUNT; w++) {
+        random_seed(KERNEL_SEED + w);
+        RaySet set = make_ray_set((Workload)w, scene, cam, ray_count);
+
+        // Collect the scene hits of the workload for the shading kernels
+        for (uint32_t i = 0; i < set.count; i++) {
+            HitRecord rec;
+            rec.t = INFINITY;
+            if (bvh_hit(bvh, set.rays[i], 0.001, INFINITY, &rec)) {
+                set.hit_rays[set.hit_count] = set.rays[i];
+                set.hits[set.hit_count++] = rec;
+            }
+        }
+
+        KernelContext ctx = {scene, bvh, cam, boxes, &set};
+        measure("aabb_hit", w, kernel_aabb_hit, &ctx, set.count, repetitions, true);
+        measure("sphere_intersect", w, kernel_sphere_intersect, &ctx, set.count,
+                repetitions, true);
+        measure("bvh_hit", w, kernel_bvh_hit, &ctx, set.count, repetitions, true);
+        measure("scatter", w, kernel_scatter, &ctx, set.hit_count, repetitions, true);
+        if (w == COHERENT || w == INCOHERENT) {
+            measure("get_view_ray", w, kernel_get_view_ray, &ctx, set.count, repetitions,
+                    false);
+        }
+
+        free_ray_set(&set);
+    }
+
+    free(boxes);
+    bvh_delete(&bvh);
+    scene_delete(&scene);
+    cam_delete(&cam);
+
+    return 0;
+}
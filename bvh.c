@@ -1,18 +1,87 @@
 #include "bvh.h"
+#include "stats.h"
 #include "util.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static BVHNode *build_node(Scene *s, int64_t start, int64_t end, uint32_t leaf_size,
+                           ThreadPool *pool);
+
+const char *bvh_builder_names[BVH_BUILDER_COUNT] = {"median", "lbvh"};
+
+// A subtree handed to the pool by build_node()
+typedef struct {
+    Scene *s;
+    int64_t start, end;
+    uint32_t leaf_size;
+    ThreadPool *pool;
+    uint64_t seed;
+    BVHNode *node;
+} BuildTask;
+
+//
+// Sets the SAH cost of a node from its box and, for an interior node, the costs of its
+// children. Costs are not normalized: the cost of a subtree sums the surface area of
+// each of its nodes times the cost of visiting the node or of testing its objects, so
+// it only becomes the expected cost of a ray once divided by the area of the root.
+//
+static void set_cost(BVHNode *node) {
+    double area = aabb_surface_area(node->box);
+    if (node->is_leaf) {
+        node->cost = (float)(area * node->object_count * BVH_INTERSECT_COST);
+    } else {
+        node->cost = (float)(area * BVH_TRAVERSAL_COST + node->left->cost +
+                             node->right->cost);
+    }
+}
+
+// Sets the box of a leaf to the union of its objects' boxes
+static void fit_leaf(BVHNode *node) {
+    hittable_bounding_box(*node->objects[0], &node->box);
+    for (uint32_t i = 1; i < node->object_count; i++) {
+        AABB box;
+        hittable_bounding_box(*node->objects[i], &box);
+        node->box = surrounding_box(node->box, box);
+    }
+}
+
+static void build_task(void *build, uint32_t worker) {
+    (void)worker;
+    BuildTask *task = (BuildTask *)build;
+    random_seed(task->seed);
+    task->node = build_node(task->s, task->start, task->end, task->leaf_size, task->pool);
+}
 
 //
 // Constructs the BVH for a given scene.
 // Construction uses a top down approach, where each recursive call partitions
 // the scene objects into two sorted subsets.
 // The start and end arguments represent start and end indices of a sub-array of the
-// scene objects that we wish to partition and sort.
+// scene objects that we wish to partition and sort. Sub-arrays of at most leaf_size
+// objects become leaves.
+//
+BVHNode *bvh_create(Scene *s, int64_t start, int64_t end, uint32_t leaf_size) {
+    return build_node(s, start, end, leaf_size, NULL);
+}
+
+//
+// Constructs the BVH for a whole scene like bvh_create(), building subtrees of at
+// least BVH_TASK_SPAN objects in parallel on the pool. Each of the two halves of such
+// a subtree continues from a random stream of its own, seeded from the calling
+// thread's stream, so the tree only depends on that and not on the number of
+// workers or the order they run in. It does differ from what bvh_create() builds for
+// scenes that large.
 //
-BVHNode *bvh_create(Scene *s, int64_t start, int64_t end) {
+BVHNode *bvh_build(Scene *s, uint32_t leaf_size, ThreadPool *pool) {
+    return build_node(s, 0, (int64_t)s->object_count - 1, leaf_size, pool);
+}
+
+static BVHNode *build_node(Scene *s, int64_t start, int64_t end, uint32_t leaf_size,
+                           ThreadPool *pool) {
     // Set root of BVH to NULL if scene contains no objects
     if (s->object_count == 0) {
         printf("Scene contains no objects!\n");
@@ -28,15 +97,13 @@ BVHNode *bvh_create(Scene *s, int64_t start, int64_t end) {
     int axis = random_int(0, 2);
     int64_t span = end + 1 - start; // Size of the sub-array
 
-    if (span == 1) {
-        // Sub-array is one element long, so we at a leaf node.
+    if (span <= leaf_size || span == 1) {
+        // Sub-array is small enough, so we are at a leaf node.
         node->is_leaf = true;
-        // AABB's of leaf nodes surround a single hittable object.
-        // Get bounding box of object
-        AABB box;
-        hittable_bounding_box(*(s->objects[start]), &box);
-        node->box = box;
-        node->hittable = s->objects[start];
+        // AABB's of leaf nodes surround the leaf's hittable objects.
+        node->objects = &s->objects[start];
+        node->object_count = (uint32_t)span;
+        fit_leaf(node);
     } else if (span == 2) {
         // More than one object in sub-array, so we are at an interior node.
         node->is_leaf = false;
@@ -44,8 +111,8 @@ BVHNode *bvh_create(Scene *s, int64_t start, int64_t end) {
         scene_sort(s, start, end, axis);
 
         // Partition into two sub-arrays of length 1 and recurse
-        node->left = bvh_create(s, start, start);
-        node->right = bvh_create(s, end, end);
+        node->left = build_node(s, start, start, leaf_size, pool);
+        node->right = build_node(s, end, end, leaf_size, pool);
 
         // Node bounding box is the union of the children boxes
         node->box = surrounding_box(node->left->box, node->right->box);
@@ -57,16 +124,825 @@ BVHNode *bvh_create(Scene *s, int64_t start, int64_t end) {
 
         // Partition into two sub-arrays and recurse.
         int64_t mid = start + (int64_t)((span - 1) / 2);
-        node->left = bvh_create(s, start, mid);
-        node->right = bvh_create(s, mid + 1, end);
+        if (pool && span >= BVH_TASK_SPAN) {
+            // Build the left half on the pool while this thread does the right half
+            BuildTask left = {s, start, mid, leaf_size, pool, random_u64(), NULL};
+            uint64_t right_seed = random_u64();
+            TaskGroup group = {0};
+            pool_submit(pool, &group, build_task, &left);
+            random_seed(right_seed);
+            node->right = build_node(s, mid + 1, end, leaf_size, pool);
+            pool_wait(pool, &group);
+            node->left = left.node;
+        } else {
+            node->left = build_node(s, start, mid, leaf_size, pool);
+            node->right = build_node(s, mid + 1, end, leaf_size, pool);
+        }
 
         // Node bounding box is the union of the children boxes
         node->box = surrounding_box(node->left->box, node->right->box);
     }
 
+    set_cost(node);
+    node->build_cost = node->cost;
     return node;
 }
 
+//
+// Linear BVH (LBVH) construction. The objects are sorted along a Morton curve through
+// their centroids, which keeps objects that are close in space close in the sorted
+// order, and the tree then follows from the sorted codes alone: each node splits its
+// run of objects where the highest bit that differs between their codes changes
+// (Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d
+// Trees", 2012). Every step is a pass over the objects in chunks run on the pool.
+//
+
+// An object's Morton code, with its index in the scene's object array
+typedef struct {
+    uint64_t code;
+    uint32_t index;
+} MortonPrimitive;
+
+// An interior node of the LBVH over the sorted objects first to last, whose left
+// child ends with the object split
+typedef struct {
+    uint32_t first, last, split;
+} LBVHNode;
+
+typedef struct LBVHBuild LBVHBuild;
+
+// One chunk's share of a pass over the objects
+typedef void (*LBVHPass)(LBVHBuild *build, uint32_t chunk);
+
+struct LBVHBuild {
+    Scene *s;
+    uint32_t count, leaf_size;
+    ThreadPool *pool;
+    uint32_t chunk_count;
+    vec3 *centroids;
+    AABB *chunk_bounds; // Bounds of the centroids of each chunk
+    AABB bounds;        // Bounds of all centroids
+    MortonPrimitive *primitives, *sorted;
+    uint32_t *histograms; // Count, then offset, of each digit in each chunk
+    uint32_t shift;       // Of the digit the current radix sort pass sorts by
+    LBVHNode *nodes;
+};
+
+typedef struct {
+    LBVHBuild *build;
+    LBVHPass pass;
+    uint32_t chunk;
+} LBVHTask;
+
+// A subtree handed to the pool by lbvh_emit()
+typedef struct {
+    LBVHBuild *build;
+    uint32_t first, last, index;
+    BVHNode *node;
+} LBVHEmitTask;
+
+#define LBVH_RADIX (1u << LBVH_RADIX_BITS)
+
+static void chunk_range(uint32_t count, uint32_t chunk_count, uint32_t chunk,
+                        uint32_t *begin, uint32_t *end) {
+    *begin = (uint32_t)((uint64_t)count * chunk / chunk_count);
+    *end = (uint32_t)((uint64_t)count * (chunk + 1) / chunk_count);
+}
+
+static void lbvh_task(void *arg, uint32_t worker) {
+    (void)worker;
+    LBVHTask *task = (LBVHTask *)arg;
+    task->pass(task->build, task->chunk);
+}
+
+// Runs a pass over every chunk, on the pool if there is one
+static void lbvh_run(LBVHBuild *b, LBVHPass pass) {
+    if (b->pool == NULL || b->chunk_count == 1) {
+        for (uint32_t c = 0; c < b->chunk_count; c++) {
+            pass(b, c);
+        }
+        return;
+    }
+    LBVHTask *tasks = (LBVHTask *)malloc(b->chunk_count * sizeof(LBVHTask));
+    assert(tasks != NULL);
+    TaskGroup group = {0};
+    for (uint32_t c = 0; c < b->chunk_count; c++) {
+        tasks[c] = (LBVHTask){b, pass, c};
+        pool_submit(b->pool, &group, lbvh_task, &tasks[c]);
+    }
+    pool_wait(b->pool, &group);
+    free(tasks);
+}
+
+static void centroid_pass(LBVHBuild *b, uint32_t chunk) {
+    uint32_t begin, end;
+    chunk_range(b->count, b->chunk_count, chunk, &begin, &end);
+    for (uint32_t i = begin; i < end; i++) {
+        AABB box;
+        hittable_bounding_box(*b->s->objects[i], &box);
+        b->centroids[i] = v3_scale(v3_add(box.min, box.max), 0.5);
+        AABB point = aabb_init(b->centroids[i], b->centroids[i]);
+        b->chunk_bounds[chunk] =
+            i == begin ? point : surrounding_box(b->chunk_bounds[chunk], point);
+    }
+}
+
+// Spreads the low LBVH_MORTON_BITS bits of x out to every third bit
+static uint64_t spread_bits(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+// Quantizes a centroid coordinate to LBVH_MORTON_BITS bits within the bounds
+static uint64_t quantize(double x, double min, double max) {
+    double scale = (double)((1u << LBVH_MORTON_BITS) - 1);
+    return max > min ? (uint64_t)((x - min) / (max - min) * scale) : 0;
+}
+
+static void morton_pass(LBVHBuild *b, uint32_t chunk) {
+    uint32_t begin, end;
+    chunk_range(b->count, b->chunk_count, chunk, &begin, &end);
+    vec3 min = b->bounds.min, max = b->bounds.max;
+    for (uint32_t i = begin; i < end; i++) {
+        vec3 c = b->centroids[i];
+        uint64_t code = spread_bits(quantize(c.x, min.x, max.x)) << 2 |
+                        spread_bits(quantize(c.y, min.y, max.y)) << 1 |
+                        spread_bits(quantize(c.z, min.z, max.z));
+        b->primitives[i] = (MortonPrimitive){code, i};
+    }
+}
+
+static void histogram_pass(LBVHBuild *b, uint32_t chunk) {
+    uint32_t begin, end;
+    chunk_range(b->count, b->chunk_count, chunk, &begin, &end);
+    uint32_t *counts = b->histograms + (size_t)chunk * LBVH_RADIX;
+    memset(counts, 0, LBVH_RADIX * sizeof(uint32_t));
+    for (uint32_t i = begin; i < end; i++) {
+        counts[(b->primitives[i].code >> b->shift) & (LBVH_RADIX - 1)]++;
+    }
+}
+
+static void scatter_pass(LBVHBuild *b, uint32_t chunk) {
+    uint32_t begin, end;
+    chunk_range(b->count, b->chunk_count, chunk, &begin, &end);
+    uint32_t *offsets = b->histograms + (size_t)chunk * LBVH_RADIX;
+    for (uint32_t i = begin; i < end; i++) {
+        MortonPrimitive p = b->primitives[i];
+        b->sorted[offsets[(p.code >> b->shift) & (LBVH_RADIX - 1)]++] = p;
+    }
+}
+
+//
+// Sorts the primitives by their codes, least significant digit first. Each pass counts
+// the digits of every chunk, turns the counts into where each chunk's run of each
+// digit starts, and scatters the chunks there, which keeps the sort stable. Passes
+// over digits all codes share are skipped.
+//
+static void radix_sort(LBVHBuild *b) {
+    for (b->shift = 0; b->shift < 3 * LBVH_MORTON_BITS; b->shift += LBVH_RADIX_BITS) {
+        lbvh_run(b, histogram_pass);
+        uint32_t offset = 0;
+        bool shared = false;
+        for (uint32_t d = 0; d < LBVH_RADIX; d++) {
+            uint32_t start = offset;
+            for (uint32_t c = 0; c < b->chunk_count; c++) {
+                uint32_t *count = &b->histograms[(size_t)c * LBVH_RADIX + d];
+                uint32_t next = offset + *count;
+                *count = offset;
+                offset = next;
+            }
+            shared |= offset - start == b->count;
+        }
+        if (!shared) {
+            lbvh_run(b, scatter_pass);
+            MortonPrimitive *swap = b->primitives;
+            b->primitives = b->sorted;
+            b->sorted = swap;
+        }
+    }
+}
+
+//
+// Returns the length of the common prefix of the codes of the sorted objects i and j,
+// or -1 if j is out of range. Equal codes are told apart by their indices, as if
+// those were appended to the codes.
+//
+static int common_prefix(const LBVHBuild *b, int64_t i, int64_t j) {
+    if (j < 0 || j >= b->count) {
+        return -1;
+    }
+    uint64_t x = b->primitives[i].code ^ b->primitives[j].code;
+    if (x == 0) {
+        return 64 + __builtin_clz((uint32_t)i ^ (uint32_t)j);
+    }
+    return __builtin_clzll(x);
+}
+
+//
+// Finds the objects covered by each interior node i, which starts or ends at object
+// i, and where it splits. The run extends from i in the direction of the neighbor
+// with the longer common prefix, as far as codes share more than i's prefix with the
+// other neighbor, and splits where the prefix the whole run shares ends.
+//
+static void node_pass(LBVHBuild *b, uint32_t chunk) {
+    uint32_t begin, end;
+    chunk_range(b->count - 1, b->chunk_count, chunk, &begin, &end);
+    for (int64_t i = begin; i < end; i++) {
+        int64_t d = common_prefix(b, i, i + 1) > common_prefix(b, i, i - 1) ? 1 : -1;
+        int min_prefix = common_prefix(b, i, i - d);
+
+        // Bound the length of the run by doubling, then find it by binary search
+        int64_t max_length = 2;
+        while (common_prefix(b, i, i + max_length * d) > min_prefix) {
+            max_length *= 2;
+        }
+        int64_t length = 0;
+        for (int64_t t = max_length / 2; t >= 1; t /= 2) {
+            if (common_prefix(b, i, i + (length + t) * d) > min_prefix) {
+                length += t;
+            }
+        }
+        int64_t j = i + length * d;
+
+        // The split is the last object that shares more than the run's prefix with i
+        int node_prefix = common_prefix(b, i, j);
+        int64_t split = 0;
+        for (int64_t t = length;;) {
+            t = (t + 1) / 2;
+            if (common_prefix(b, i, i + (split + t) * d) > node_prefix) {
+                split += t;
+            }
+            if (t == 1) {
+                break;
+            }
+        }
+        split = i + split * d + (d < 0 ? -1 : 0);
+
+        b->nodes[i] = (LBVHNode){(uint32_t)(d > 0 ? i : j), (uint32_t)(d > 0 ? j : i),
+                                 (uint32_t)split};
+    }
+}
+
+static BVHNode *lbvh_emit(LBVHBuild *b, uint32_t first, uint32_t last, uint32_t index);
+
+static void lbvh_emit_task(void *arg, uint32_t worker) {
+    (void)worker;
+    LBVHEmitTask *task = (LBVHEmitTask *)arg;
+    task->node = lbvh_emit(task->build, task->first, task->last, task->index);
+}
+
+//
+// Turns the interior node index, over the sorted objects first to last, into a
+// BVHNode subtree, with the boxes and costs set bottom-up. Runs of at most leaf_size
+// objects become leaves; a single object is always one, and index is unused then.
+//
+static BVHNode *lbvh_emit(LBVHBuild *b, uint32_t first, uint32_t last, uint32_t index) {
+    BVHNode *node = (BVHNode *)calloc(1, sizeof(BVHNode));
+    assert(node != NULL);
+    uint32_t span = last - first + 1;
+    if (span <= b->leaf_size || span == 1) {
+        node->is_leaf = true;
+        node->objects = &b->s->objects[first];
+        node->object_count = span;
+        fit_leaf(node);
+    } else {
+        uint32_t split = b->nodes[index].split;
+        if (b->pool && span >= BVH_TASK_SPAN) {
+            LBVHEmitTask left = {b, first, split, split, NULL};
+            TaskGroup group = {0};
+            pool_submit(b->pool, &group, lbvh_emit_task, &left);
+            node->right = lbvh_emit(b, split + 1, last, split + 1);
+            pool_wait(b->pool, &group);
+            node->left = left.node;
+        } else {
+            node->left = lbvh_emit(b, first, split, split);
+            node->right = lbvh_emit(b, split + 1, last, split + 1);
+        }
+        node->box = surrounding_box(node->left->box, node->right->box);
+    }
+    set_cost(node);
+    node->build_cost = node->cost;
+    return node;
+}
+
+//
+// Constructs a linear BVH over a whole scene: Morton codes of the object centroids, a
+// radix sort of them, and the tree read off the sorted codes, each in parallel on the
+// pool, which may be NULL. Reorders the scene's objects along the curve. This builds
+// several times faster than bvh_build(), and more so the larger the scene, which
+// suits scenes rebuilt every frame. Splits follow the grid of the Morton curve rather
+// than the objects, so the tree is no match for one built to minimize its SAH cost.
+// Uses no random numbers, so the tree only depends on the scene. bvh_update()
+// rebuilds degraded subtrees of it with the median split.
+//
+BVHNode *bvh_build_lbvh(Scene *s, uint32_t leaf_size, ThreadPool *pool) {
+    if (s->object_count == 0) {
+        printf("Scene contains no objects!\n");
+        return NULL;
+    }
+
+    LBVHBuild b = {.s = s, .count = s->object_count, .leaf_size = leaf_size, .pool = pool};
+    uint32_t chunks = pool ? pool_worker_count(pool) + 1 : 1;
+    uint32_t most = (b.count + LBVH_CHUNK_MIN - 1) / LBVH_CHUNK_MIN;
+    b.chunk_count = chunks < most ? chunks : most;
+    b.centroids = (vec3 *)malloc(b.count * sizeof(vec3));
+    b.chunk_bounds = (AABB *)malloc(b.chunk_count * sizeof(AABB));
+    b.primitives = (MortonPrimitive *)malloc(b.count * sizeof(MortonPrimitive));
+    b.sorted = (MortonPrimitive *)malloc(b.count * sizeof(MortonPrimitive));
+    b.histograms = (uint32_t *)malloc((size_t)b.chunk_count * LBVH_RADIX * sizeof(uint32_t));
+    assert(b.centroids && b.chunk_bounds && b.primitives && b.sorted && b.histograms);
+
+    lbvh_run(&b, centroid_pass);
+    b.bounds = b.chunk_bounds[0];
+    for (uint32_t c = 1; c < b.chunk_count; c++) {
+        b.bounds = surrounding_box(b.bounds, b.chunk_bounds[c]);
+    }
+    lbvh_run(&b, morton_pass);
+    radix_sort(&b);
+
+    // Put the objects into the sorted order, so that leaves are runs of them. The
+    // sort's spare buffer is done with, and large enough to stage them in.
+    Hittable **order = (Hittable **)b.sorted;
+    for (uint32_t i = 0; i < b.count; i++) {
+        order[i] = s->objects[b.primitives[i].index];
+    }
+    memcpy(s->objects, order, b.count * sizeof(Hittable *));
+
+    b.nodes = (LBVHNode *)malloc((b.count > 1 ? b.count - 1 : 1) * sizeof(LBVHNode));
+    assert(b.nodes != NULL);
+    if (b.count > 1) {
+        lbvh_run(&b, node_pass);
+    }
+    BVHNode *root = lbvh_emit(&b, 0, b.count - 1, 0);
+
+    free(b.centroids);
+    free(b.chunk_bounds);
+    free(b.primitives);
+    free(b.sorted);
+    free(b.histograms);
+    free(b.nodes);
+    return root;
+}
+
+//
+// Constructs the BVH for a whole scene with the given builder, see bvh_build() and
+// bvh_build_lbvh().
+//
+BVHNode *bvh_build_with(Scene *s, BVHBuilder builder, uint32_t leaf_size,
+                        ThreadPool *pool) {
+    switch (builder) {
+    case BVH_BUILDER_LBVH:
+        return bvh_build_lbvh(s, leaf_size, pool);
+    case BVH_BUILDER_MEDIAN:
+    default:
+        return bvh_build(s, leaf_size, pool);
+    }
+}
+
+//
+// Deep copies a BVH built over the scene from so that it refers to the objects of
+// to, a clone of from.
+//
+BVHNode *bvh_clone(BVHNode *node, Scene *from, Scene *to) {
+    if (node == NULL) {
+        return NULL;
+    }
+
+    BVHNode *copy = (BVHNode *)malloc(sizeof(BVHNode));
+    assert(copy != NULL);
+    *copy = *node;
+    copy->storage = BVH_NODE_ALONE;
+    if (node->is_leaf) {
+        copy->objects = to->objects + (node->objects - from->objects);
+    } else {
+        copy->left = bvh_clone(node->left, from, to);
+        copy->right = bvh_clone(node->right, from, to);
+    }
+
+    return copy;
+}
+
+//
+// Frees a BVH. The hittables its leaves point to belong to the scene and are left alone.
+// Nodes inside a block from bvh_pack() go with the block, once its first node is freed.
+//
+void bvh_delete(BVHNode **node) {
+    if (*node == NULL) {
+        return;
+    }
+    bvh_delete(&(*node)->left);
+    bvh_delete(&(*node)->right);
+    if ((*node)->storage != BVH_NODE_IN_BLOCK) {
+        free(*node);
+    }
+    *node = NULL;
+}
+
+//
+// Recomputes the boxes of a BVH bottom-up after its objects moved, keeping the tree's
+// structure, along with the SAH cost of every node. This is far cheaper than a
+// rebuild, but the tree gets worse as objects move away from where it was built for;
+// bvh_update() watches for that. Nodes without a build cost, like those loaded from a
+// scene cache, take the cost they have now as theirs.
+//
+void bvh_refit(BVHNode *node) {
+    if (node == NULL) {
+        return;
+    }
+    if (node->is_leaf) {
+        fit_leaf(node);
+    } else {
+        bvh_refit(node->left);
+        bvh_refit(node->right);
+        node->box = surrounding_box(node->left->box, node->right->box);
+    }
+    set_cost(node);
+    if (node->build_cost == 0) {
+        node->build_cost = node->cost;
+    }
+}
+
+static bool degraded(const BVHNode *node, double ratio) {
+    return node->cost > node->build_cost * ratio;
+}
+
+//
+// Rebuilds a subtree in place, over the same run of the scene's objects, so that its
+// parent keeps pointing at it. The node keeps its storage, which may be in a block.
+//
+static void rebuild(Scene *s, BVHNode *node, uint32_t leaf_size, ThreadPool *pool) {
+    BVHNode *first = node, *last = node;
+    while (!first->is_leaf) {
+        first = first->left;
+    }
+    while (!last->is_leaf) {
+        last = last->right;
+    }
+    int64_t start = first->objects - s->objects;
+    int64_t end = last->objects + last->object_count - 1 - s->objects;
+
+    BVHNode *fresh = build_node(s, start, end, leaf_size, pool);
+    bvh_delete(&node->left);
+    bvh_delete(&node->right);
+    uint8_t storage = node->storage;
+    *node = *fresh;
+    node->storage = storage;
+    free(fresh);
+}
+
+//
+// Rebuilds the degraded parts of a refitted subtree. When only one child degraded, the
+// damage is local and is repaired there, and the node itself only rebuilt if it is
+// still degraded afterwards, i.e. its own split went bad. When both did, or neither
+// did but the node did, the whole subtree is rebuilt. Leaves are left alone, as
+// rebuilding them would give the same leaves. Returns BVH_FULL_REBUILD if the node
+// itself was rebuilt, BVH_PARTIAL_REBUILD if only some of its descendants were.
+//
+static BVHUpdate rebuild_degraded(Scene *s, BVHNode *node, uint32_t leaf_size,
+                                  double ratio, ThreadPool *pool) {
+    if (node->is_leaf || !degraded(node, ratio)) {
+        return BVH_REFIT;
+    }
+    bool left = degraded(node->left, ratio), right = degraded(node->right, ratio);
+    if (left != right) {
+        BVHNode *child = left ? node->left : node->right;
+        BVHUpdate update = rebuild_degraded(s, child, leaf_size, ratio, pool);
+        set_cost(node);
+        if (!degraded(node, ratio)) {
+            return update == BVH_REFIT ? BVH_REFIT : BVH_PARTIAL_REBUILD;
+        }
+    }
+    rebuild(s, node, leaf_size, pool);
+    return BVH_FULL_REBUILD;
+}
+
+//
+// Brings a BVH up to date after its objects moved, in place. The tree is refitted,
+// and then every subtree whose SAH cost grew past ratio times its cost when it was
+// built is rebuilt, see rebuild_degraded(); for the root that is a full rebuild.
+// Subtrees of at least BVH_TASK_SPAN objects are rebuilt on the pool, which may be
+// NULL. Returns what had to be done.
+//
+BVHUpdate bvh_update(Scene *s, BVHNode *root, uint32_t leaf_size, double ratio,
+                     ThreadPool *pool) {
+    if (root == NULL) {
+        return BVH_REFIT;
+    }
+    bvh_refit(root);
+    return rebuild_degraded(s, root, leaf_size, ratio, pool);
+}
+
+static double subtree_cost(const BVHNode *node) {
+    double area = aabb_surface_area(node->box);
+    if (node->is_leaf) {
+        return area * node->object_count * BVH_INTERSECT_COST;
+    }
+    return area * BVH_TRAVERSAL_COST + subtree_cost(node->left) +
+           subtree_cost(node->right);
+}
+
+//
+// Returns the SAH cost of a BVH: the expected cost of the node visits and object
+// tests of a random ray that hits the root's box, in units of BVH_TRAVERSAL_COST and
+// BVH_INTERSECT_COST. Computed from the boxes alone, so it works on any tree.
+//
+double bvh_sah_cost(BVHNode *root) {
+    if (root == NULL) {
+        return 0;
+    }
+    double area = aabb_surface_area(root->box);
+    return area > 0 ? subtree_cost(root) / area : 0;
+}
+
+//
+// Post-build optimization. Treelet restructuring (Karras and Aila, "Fast Parallel
+// Construction of High-Quality Bounding Volume Hierarchies", 2013) takes each node
+// with the descendants below it, up to BVH_TREELET_LEAVES subtrees, and finds the
+// arrangement of those subtrees under the treelet's interior nodes of the lowest SAH
+// cost, trying every one by dynamic programming over the subsets of subtrees. Nodes
+// are handled bottom-up, so each treelet builds on its improved subtrees, and whole
+// passes over the tree repeat while they pay off.
+//
+
+// A node and the descendants that make up its treelet
+typedef struct {
+    BVHNode *interior[BVH_TREELET_LEAVES - 1]; // The treelet's root first
+    BVHNode *leaves[BVH_TREELET_LEAVES];       // The subtrees below it
+    uint32_t interior_count, leaf_count;
+} Treelet;
+
+// A subtree handed to the pool by restructure()
+typedef struct {
+    BVHNode *node;
+    uint32_t depth;
+    ThreadPool *pool;
+    uint32_t restructured;
+} RestructureTask;
+
+#define TREELET_SUBSETS (1u << BVH_TREELET_LEAVES)
+
+//
+// Grows the treelet of root by opening up its largest subtree, which has the most to
+// gain, until it has BVH_TREELET_LEAVES subtrees or only leaves are left.
+//
+static void form_treelet(BVHNode *root, Treelet *t) {
+    t->interior[0] = root;
+    t->interior_count = 1;
+    t->leaves[0] = root->left;
+    t->leaves[1] = root->right;
+    t->leaf_count = 2;
+    while (t->leaf_count < BVH_TREELET_LEAVES) {
+        int64_t largest = -1;
+        double largest_area = -1;
+        for (uint32_t i = 0; i < t->leaf_count; i++) {
+            double area = aabb_surface_area(t->leaves[i]->box);
+            if (!t->leaves[i]->is_leaf && area > largest_area) {
+                largest = i;
+                largest_area = area;
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        BVHNode *node = t->leaves[largest];
+        t->interior[t->interior_count++] = node;
+        t->leaves[largest] = node->left;
+        t->leaves[t->leaf_count++] = node->right;
+    }
+}
+
+// Returns the SAH cost of a node of a treelet as it is now
+static double treelet_cost(const Treelet *t, const BVHNode *node) {
+    for (uint32_t i = 0; i < t->leaf_count; i++) {
+        if (t->leaves[i] == node) {
+            return node->cost;
+        }
+    }
+    return aabb_surface_area(node->box) * BVH_TRAVERSAL_COST +
+           treelet_cost(t, node->left) + treelet_cost(t, node->right);
+}
+
+//
+// Rebuilds the subset of a treelet's subtrees into the next of its interior nodes,
+// following the best splits found, and returns the node.
+//
+static BVHNode *emit_treelet(Treelet *t, const uint32_t *split, uint32_t subset,
+                             uint32_t *next) {
+    if ((subset & (subset - 1)) == 0) {
+        return t->leaves[__builtin_ctz(subset)];
+    }
+    BVHNode *node = t->interior[(*next)++];
+    node->left = emit_treelet(t, split, split[subset], next);
+    node->right = emit_treelet(t, split, subset ^ split[subset], next);
+    node->box = surrounding_box(node->left->box, node->right->box);
+    set_cost(node);
+    return node;
+}
+
+//
+// Restructures the treelet of root if some arrangement of it costs less. The best
+// cost of each subset of the subtrees is the cost of its box plus the lowest sum of
+// the best costs of two subsets it splits into. Returns whether root changed.
+//
+static bool restructure_treelet(BVHNode *root) {
+    Treelet t;
+    form_treelet(root, &t);
+    if (t.leaf_count < 3) {
+        return false; // Two subtrees only go together one way
+    }
+
+    AABB box[TREELET_SUBSETS];
+    double cost[TREELET_SUBSETS];
+    uint32_t split[TREELET_SUBSETS];
+    uint32_t all = (1u << t.leaf_count) - 1;
+    for (uint32_t subset = 1; subset <= all; subset++) {
+        uint32_t lowest = subset & (~subset + 1);
+        if (subset == lowest) {
+            BVHNode *leaf = t.leaves[__builtin_ctz(subset)];
+            box[subset] = leaf->box;
+            cost[subset] = leaf->cost;
+            continue;
+        }
+        box[subset] = surrounding_box(box[subset ^ lowest], box[lowest]);
+        // Each split once, with the lowest subtree on the left
+        double best = INFINITY;
+        for (uint32_t left = (subset - 1) & subset; left; left = (left - 1) & subset) {
+            if ((left & lowest) && cost[left] + cost[subset ^ left] < best) {
+                best = cost[left] + cost[subset ^ left];
+                split[subset] = left;
+            }
+        }
+        cost[subset] = aabb_surface_area(box[subset]) * BVH_TRAVERSAL_COST + best;
+    }
+
+    // Rounding makes equal arrangements differ a little
+    if (cost[all] >= treelet_cost(&t, root) * (1 - 1e-9)) {
+        return false;
+    }
+    uint32_t next = 0;
+    emit_treelet(&t, split, all, &next);
+    return true;
+}
+
+static uint32_t restructure(BVHNode *node, uint32_t depth, ThreadPool *pool);
+
+static void restructure_task(void *arg, uint32_t worker) {
+    (void)worker;
+    RestructureTask *task = (RestructureTask *)arg;
+    task->restructured = restructure(task->node, task->depth, task->pool);
+}
+
+//
+// Makes one pass of treelet restructuring over a subtree, bottom-up, with subtrees
+// near the root on the pool. Every node takes its cost as its build cost. Returns
+// the number of treelets restructured.
+//
+static uint32_t restructure(BVHNode *node, uint32_t depth, ThreadPool *pool) {
+    if (node->is_leaf) {
+        return 0;
+    }
+    uint32_t restructured;
+    if (pool && depth < BVH_TASK_DEPTH) {
+        RestructureTask left = {node->left, depth + 1, pool, 0};
+        TaskGroup group = {0};
+        pool_submit(pool, &group, restructure_task, &left);
+        restructured = restructure(node->right, depth + 1, pool);
+        pool_wait(pool, &group);
+        restructured += left.restructured;
+    } else {
+        restructured = restructure(node->left, depth + 1, pool) +
+                       restructure(node->right, depth + 1, pool);
+    }
+    if (restructure_treelet(node)) {
+        restructured++;
+    } else {
+        set_cost(node);
+    }
+    node->build_cost = node->cost;
+    return restructured;
+}
+
+//
+// Improves a built BVH for tracing, for renders long enough to make up for the time
+// this takes: restructures its treelets in passes until a pass gains less than
+// BVH_OPTIMIZE_GAIN of the SAH cost, at most BVH_OPTIMIZE_ROUNDS of them, and then
+// lays it out with bvh_pack(), which replaces *root. The leaves and what they hold
+// stay the same. Returns the number of passes made.
+//
+uint32_t bvh_optimize(Scene *s, BVHNode **root, ThreadPool *pool) {
+    if (*root == NULL) {
+        return 0;
+    }
+    double cost = bvh_sah_cost(*root);
+    uint32_t rounds = 0;
+    while (rounds < BVH_OPTIMIZE_ROUNDS) {
+        rounds++;
+        uint32_t restructured = restructure(*root, 0, pool);
+        double improved = bvh_sah_cost(*root);
+        if (restructured == 0 || improved > cost * (1 - BVH_OPTIMIZE_GAIN)) {
+            break;
+        }
+        cost = improved;
+    }
+    bvh_pack(s, root);
+    return rounds;
+}
+
+static uint32_t count_nodes(const BVHNode *node) {
+    return node->is_leaf ? 1 : 1 + count_nodes(node->left) + count_nodes(node->right);
+}
+
+// Copies the children of block[at] next to each other at next, returning what follows
+static uint32_t place_children(BVHNode *block, uint32_t at, uint32_t next) {
+    BVHNode *node = &block[at];
+    if (node->is_leaf) {
+        return next;
+    }
+    block[next] = *node->left;
+    block[next + 1] = *node->right;
+    node->left = &block[next];
+    node->right = &block[next + 1];
+    return next + 2;
+}
+
+// Copies the descendants of block[at] depth first, children side by side
+static uint32_t place_subtree(BVHNode *block, uint32_t at, uint32_t next) {
+    if (block[at].is_leaf) {
+        return next;
+    }
+    uint32_t left = next;
+    next = place_children(block, at, next);
+    next = place_subtree(block, left, next);
+    return place_subtree(block, left + 1, next);
+}
+
+// Moves the objects of the leaves below node to objects in tree order
+static uint32_t gather_objects(BVHNode *node, Hittable **objects, uint32_t next) {
+    if (node->is_leaf) {
+        memcpy(objects + next, node->objects, node->object_count * sizeof(Hittable *));
+        return next + node->object_count;
+    }
+    next = gather_objects(node->left, objects, next);
+    return gather_objects(node->right, objects, next);
+}
+
+// Points the leaves below node at their objects' new place in the scene
+static uint32_t point_leaves(BVHNode *node, Scene *s, uint32_t next) {
+    if (node->is_leaf) {
+        node->objects = &s->objects[next];
+        return next + node->object_count;
+    }
+    next = point_leaves(node->left, s, next);
+    return point_leaves(node->right, s, next);
+}
+
+//
+// Copies a BVH into a single block laid out for traversal and frees the old one,
+// replacing *root. The BVH_TREETOP_NODES nodes at the top, which every ray visits,
+// come first, level by level, so they share as few cache lines and pages as they
+// can; every subtree below follows depth first. Siblings always sit side by side,
+// as a ray that reaches one tests the other. The scene's objects are put in the
+// leaves' order, so that every subtree covers a run of them, as bvh_update() needs
+// after restructuring.
+//
+void bvh_pack(Scene *s, BVHNode **root) {
+    if (*root == NULL) {
+        return;
+    }
+    uint32_t count = count_nodes(*root);
+    BVHNode *block = (BVHNode *)malloc(count * sizeof(BVHNode));
+    assert(block != NULL);
+
+    block[0] = **root;
+    uint32_t next = 1, top = 0;
+    for (; top < next && top < BVH_TREETOP_NODES; top++) {
+        next = place_children(block, top, next);
+    }
+    for (uint32_t i = top, frontier = next; i < frontier; i++) {
+        next = place_subtree(block, i, next);
+    }
+    assert(next == count);
+    for (uint32_t i = 0; i < count; i++) {
+        block[i].storage = i == 0 ? BVH_NODE_BLOCK : BVH_NODE_IN_BLOCK;
+    }
+
+    Hittable **objects = (Hittable **)malloc(s->object_count * sizeof(Hittable *));
+    assert(objects != NULL);
+    uint32_t object_count = gather_objects(block, objects, 0);
+    assert(object_count == s->object_count);
+    memcpy(s->objects, objects, object_count * sizeof(Hittable *));
+    point_leaves(block, s, 0);
+    free(objects);
+
+    bvh_delete(root);
+    *root = block;
+}
+
 // 
 // Intersects a ray with our BVH tree. Returns true if a hit occurred, false otherwise.
 // Hit information is stored in the HitRecord struct.
@@ -85,17 +961,24 @@ bool bvh_hit(BVHNode *node, ray r, double t_min, double t_max, HitRecord *rec) {
     if (node == NULL) {
         return false;
     }
+    STAT_INC(bvh_nodes_visited);
+    STAT_INC(box_tests);
     if (!aabb_hit(node->box, r, t_min, t_max)) {
         return false;
     } else if (node->is_leaf) {
         HitRecord temp_rec;
-        if (hittable_intersect(*(node->hittable), r, t_min, t_max, &temp_rec)) {
-            if (temp_rec.t < rec->t) {
-                *rec = temp_rec;
+        bool hit = false;
+        for (uint32_t i = 0; i < node->object_count; i++) {
+            STAT_INC(primitive_tests);
+            if (hittable_intersect(*(node->objects[i]), r, t_min, t_max, &temp_rec)) {
+                STAT_INC(primitive_hits);
+                if (temp_rec.t < rec->t) {
+                    *rec = temp_rec;
+                }
+                hit = true;
             }
-            return true;
         }
-        return false;
+        return hit;
     } else {
         bool left_hit = bvh_hit(node->left, r, t_min, t_max, rec);
         bool right_hit = bvh_hit(node->right, r, t_min, t_max, rec);
@@ -110,18 +993,20 @@ void bvh_node_print(BVHNode *node) {
     if (node) {
         if (node->is_leaf) {
             printf("Node is leaf!\n");
-            hittable_print(node->hittable);
+            for (uint32_t i = 0; i < node->object_count; i++) {
+                hittable_print(node->objects[i]);
+            }
         } else {
             printf("Interior node\n");
             printf("Left: \n");
             if (node->left->is_leaf) {
-                hittable_print(node->hittable);
+                printf("Leaf of %u objects\n", node->left->object_count);
             } else {
                 printf("Interior node\n");
             }
             printf("Right: \n");
             if (node->right->is_leaf) {
-                hittable_print(node->hittable);
+                printf("Leaf of %u objects\n", node->right->object_count);
             } else {
                 printf("Interior node\n");
             }
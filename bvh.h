@@ -3,20 +3,75 @@
 #include "aabb.h"
 #include "hit.h"
 #include "hittable.h"
+#include "pool.h"
 #include "ray.h"
 #include "scene.h"
 
 typedef struct BVHNode BVHNode;
 
+// How a node was allocated, which bvh_delete() follows. bvh_pack() allocates a whole
+// tree as one block, which is freed along with the node at its start. The nodes of a
+// tree read from a scene cache are all in the scene's mapping of it, which the scene
+// frees.
+typedef enum { BVH_NODE_ALONE, BVH_NODE_BLOCK, BVH_NODE_IN_BLOCK } BVHNodeStorage;
+
+// The two costs are single precision so that they fit into the node's padding.
 struct BVHNode {
     bool is_leaf;
+    uint8_t storage; // A BVHNodeStorage, BVH_NODE_ALONE when allocated by calloc()
+    float cost;      // SAH cost of the subtree, see bvh_refit()
     AABB box;
     BVHNode *left;
     BVHNode *right;
-    Hittable *hittable;
+    Hittable **objects; // Leaf objects, a run of the scene's object array
+    uint32_t object_count;
+    float build_cost; // cost when the subtree was built, 0 if unknown
 };
 
-BVHNode *bvh_create(Scene *s, int64_t start, int64_t end);
+// What bvh_update() had to do to the tree
+typedef enum { BVH_REFIT, BVH_PARTIAL_REBUILD, BVH_FULL_REBUILD } BVHUpdate;
+
+// The ways a BVH can be built over a whole scene, see bvh_build_with()
+typedef enum { BVH_BUILDER_MEDIAN, BVH_BUILDER_LBVH, BVH_BUILDER_COUNT } BVHBuilder;
+
+#define BVH_TASK_SPAN 4096 // Subtrees at least this large are built as separate tasks
+#define BVH_TRAVERSAL_COST 1.0 // Relative cost of a node visit in the SAH cost
+#define BVH_INTERSECT_COST 1.0 // Relative cost of an object test in the SAH cost
+#define BVH_REBUILD_RATIO 1.5 // bvh_update() rebuilds subtrees whose cost grew this much
+#define BVH_TREELET_LEAVES 7 // Subtrees under a treelet bvh_optimize() restructures
+#define BVH_OPTIMIZE_ROUNDS 16 // Most restructuring passes bvh_optimize() makes
+#define BVH_OPTIMIZE_GAIN 0.001 // Least relative gain in SAH cost worth another pass
+#define BVH_TASK_DEPTH 6 // Subtrees this close to the root are restructured as tasks
+#define BVH_TREETOP_NODES 63 // Nodes bvh_pack() lays out level by level
+#define LBVH_MORTON_BITS 21 // Bits of each coordinate in a Morton code
+#define LBVH_RADIX_BITS 11 // Bits sorted by each pass of the radix sort
+#define LBVH_CHUNK_MIN 1024 // Fewest objects worth a parallel chunk of their own
+
+extern const char *bvh_builder_names[BVH_BUILDER_COUNT];
+
+BVHNode *bvh_create(Scene *s, int64_t start, int64_t end, uint32_t leaf_size);
+
+BVHNode *bvh_build(Scene *s, uint32_t leaf_size, ThreadPool *pool);
+
+BVHNode *bvh_build_lbvh(Scene *s, uint32_t leaf_size, ThreadPool *pool);
+
+BVHNode *bvh_build_with(Scene *s, BVHBuilder builder, uint32_t leaf_size,
+                        ThreadPool *pool);
+
+BVHNode *bvh_clone(BVHNode *node, Scene *from, Scene *to);
+
+void bvh_delete(BVHNode **node);
+
+void bvh_refit(BVHNode *node);
+
+BVHUpdate bvh_update(Scene *s, BVHNode *root, uint32_t leaf_size, double ratio,
+                     ThreadPool *pool);
+
+double bvh_sah_cost(BVHNode *root);
+
+uint32_t bvh_optimize(Scene *s, BVHNode **root, ThreadPool *pool);
+
+void bvh_pack(Scene *s, BVHNode **root);
 
 bool bvh_hit(BVHNode *node, ray r, double t_min, double t_max, HitRecord *rec);
 
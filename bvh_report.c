@@ -0,0 +1,184 @@
+#include "bvh_report.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The overlap of two siblings is the surface area of the intersection of their boxes.
+// "sibling overlap %" averages it relative to the area of their parent, and "overlaps
+// per ray" sums it relative to the area of the root: the expected number of overlaps
+// a random ray through the root's box passes through, where it has to visit both
+// siblings even though its closest hit can only be in one.
+//
+// Returns the surface area of the intersection of two boxes, 0 if they are disjoint
+static double overlap_area(AABB a, AABB b) {
+    vec3 min = v3_init(fmax(a.min.x, b.min.x), fmax(a.min.y, b.min.y),
+                       fmax(a.min.z, b.min.z));
+    vec3 max = v3_init(fmin(a.max.x, b.max.x), fmin(a.max.y, b.max.y),
+                       fmin(a.max.z, b.max.z));
+    if (min.x > max.x || min.y > max.y || min.z > max.z) {
+        return 0;
+    }
+    return aabb_surface_area(aabb_init(min, max));
+}
+
+static void gather_stats(const BVHNode *node, uint32_t depth, BVHTreeStats *stats) {
+    stats->allocations += node->storage != BVH_NODE_IN_BLOCK;
+    stats->max_depth = depth > stats->max_depth ? depth : stats->max_depth;
+    if (node->is_leaf) {
+        stats->leaves++;
+        stats->depth_sum += depth;
+        uint32_t bucket = depth < BVH_REPORT_DEPTHS ? depth : BVH_REPORT_DEPTHS - 1;
+        stats->leaves_at_depth[bucket]++;
+        uint32_t size = node->object_count;
+        stats->leaves_of_size[size < BVH_REPORT_SIZES ? size : BVH_REPORT_SIZES]++;
+        return;
+    }
+    stats->interior++;
+    double area = aabb_surface_area(node->box);
+    double overlap = overlap_area(node->left->box, node->right->box);
+    stats->overlap_sum += area > 0 ? overlap / area : 0;
+    stats->overlap_area += overlap;
+    stats->overlapping += overlap > 0;
+    gather_stats(node->left, depth + 1, stats);
+    gather_stats(node->right, depth + 1, stats);
+}
+
+//
+// Measures a tree, however it was built, for bvh_report_print(). The name labels its
+// column and build_seconds is what building it took.
+//
+void bvh_tree_stats(BVHNode *bvh, const char *name, double build_seconds,
+                    BVHTreeStats *stats) {
+    memset(stats, 0, sizeof(BVHTreeStats));
+    snprintf(stats->name, sizeof(stats->name), "%s", name);
+    stats->build_seconds = build_seconds;
+    gather_stats(bvh, 0, stats);
+    stats->sah_cost = bvh_sah_cost(bvh);
+    double root_area = aabb_surface_area(bvh->box);
+    stats->overlap_area = root_area > 0 ? stats->overlap_area / root_area : 0;
+}
+
+// Prints one row of the table, a value per tree
+static void print_row(const char *label, const BVHTreeStats *trees, uint32_t tree_count,
+                      const char *format, double (*value)(const BVHTreeStats *)) {
+    printf("%-24s", label);
+    for (uint32_t t = 0; t < tree_count; t++) {
+        printf(format, value(&trees[t]));
+    }
+    printf("\n");
+}
+
+static double build_ms(const BVHTreeStats *s) { return s->build_seconds * 1e3; }
+static double nodes(const BVHTreeStats *s) { return s->interior + s->leaves; }
+static double leaves(const BVHTreeStats *s) { return s->leaves; }
+static double memory_kb(const BVHTreeStats *s) {
+    return nodes(s) * sizeof(BVHNode) / 1024.0;
+}
+static double allocations(const BVHTreeStats *s) { return s->allocations; }
+static double sah_cost(const BVHTreeStats *s) { return s->sah_cost; }
+static double max_depth(const BVHTreeStats *s) { return s->max_depth; }
+static double mean_depth(const BVHTreeStats *s) {
+    return (double)s->depth_sum / s->leaves;
+}
+
+static double mean_overlap(const BVHTreeStats *s) {
+    return s->interior ? 100.0 * s->overlap_sum / s->interior : 0;
+}
+
+static double overlapping(const BVHTreeStats *s) {
+    return s->interior ? 100.0 * s->overlapping / s->interior : 0;
+}
+
+static double overlap_per_ray(const BVHTreeStats *s) { return s->overlap_area; }
+
+//
+// Prints the trees side by side, a column each: their node counts, the depths of
+// their leaves, their leaf sizes, their SAH cost, how much the boxes of siblings
+// overlap, and the memory their nodes take, followed by histograms of their leaves
+// by depth and by size.
+//
+void bvh_report_print(const BVHTreeStats *trees, uint32_t tree_count) {
+    printf("%-24s", "");
+    for (uint32_t t = 0; t < tree_count; t++) {
+        printf("%12s", trees[t].name);
+    }
+    printf("\n");
+    print_row("build ms", trees, tree_count, "%12.2f", build_ms);
+    print_row("nodes", trees, tree_count, "%12.0f", nodes);
+    print_row("leaves", trees, tree_count, "%12.0f", leaves);
+    print_row("node memory KB", trees, tree_count, "%12.1f", memory_kb);
+    print_row("allocations", trees, tree_count, "%12.0f", allocations);
+    print_row("SAH cost", trees, tree_count, "%12.2f", sah_cost);
+    print_row("max depth", trees, tree_count, "%12.0f", max_depth);
+    print_row("mean leaf depth", trees, tree_count, "%12.2f", mean_depth);
+    print_row("sibling overlap %", trees, tree_count, "%12.2f", mean_overlap);
+    print_row("overlapping siblings %", trees, tree_count, "%12.2f", overlapping);
+    print_row("overlaps per ray", trees, tree_count, "%12.3f", overlap_per_ray);
+
+    printf("\nLeaves by depth\n");
+    for (uint32_t d = 0; d < BVH_REPORT_DEPTHS; d++) {
+        bool any = false;
+        for (uint32_t t = 0; t < tree_count; t++) {
+            any |= trees[t].leaves_at_depth[d] > 0;
+        }
+        if (any) {
+            printf("%-24u", d);
+            for (uint32_t t = 0; t < tree_count; t++) {
+                printf("%12u", trees[t].leaves_at_depth[d]);
+            }
+            printf("\n");
+        }
+    }
+
+    printf("\nLeaves by object count\n");
+    for (uint32_t size = 1; size <= BVH_REPORT_SIZES; size++) {
+        bool any = false;
+        for (uint32_t t = 0; t < tree_count; t++) {
+            any |= trees[t].leaves_of_size[size] > 0;
+        }
+        if (any) {
+            printf("%-24u", size);
+            for (uint32_t t = 0; t < tree_count; t++) {
+                printf("%12u", trees[t].leaves_of_size[size]);
+            }
+            printf("\n");
+        }
+    }
+}
+
+static uint32_t count_nodes(const BVHNode *node) {
+    return node->is_leaf ? 1 : 1 + count_nodes(node->left) + count_nodes(node->right);
+}
+
+//
+// Writes the box of every node to csv, one row per node with the columns of
+// BVH_REPORT_CSV_HEADER, in breadth-first order, so that the rows of each level
+// follow one another.
+//
+void bvh_report_boxes(FILE *csv, const char *name, const BVHNode *bvh) {
+    uint32_t node_count = count_nodes(bvh);
+    const BVHNode **queue = (const BVHNode **)malloc(node_count * sizeof(BVHNode *));
+    uint32_t *depths = (uint32_t *)malloc(node_count * sizeof(uint32_t));
+    assert(queue != NULL && depths != NULL);
+    uint32_t head = 0, tail = 0;
+    queue[tail] = bvh;
+    depths[tail++] = 0;
+    while (head < tail) {
+        const BVHNode *node = queue[head];
+        uint32_t depth = depths[head++];
+        fprintf(csv, "%s,%u,%d,%u,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n", name, depth,
+                node->is_leaf, node->is_leaf ? node->object_count : 0, node->box.min.x,
+                node->box.min.y, node->box.min.z, node->box.max.x, node->box.max.y,
+                node->box.max.z);
+        if (!node->is_leaf) {
+            queue[tail] = node->left;
+            depths[tail++] = depth + 1;
+            queue[tail] = node->right;
+            depths[tail++] = depth + 1;
+        }
+    }
+    free(queue);
+    free(depths);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "bvh.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define BVH_REPORT_DEPTHS 256 // Leaves deeper than this are counted in the last bucket
+#define BVH_REPORT_SIZES 64   // Leaves larger than this are counted in the last bucket
+
+// The columns of the rows bvh_report_boxes() writes
+#define BVH_REPORT_CSV_HEADER                                                         \
+    "builder,depth,leaf,objects,min_x,min_y,min_z,max_x,max_y,max_z\n"
+
+// What one tree is like, from any builder
+typedef struct {
+    char name[32];
+    double build_seconds; // As timed by the caller
+    uint32_t interior, leaves, allocations, max_depth;
+    uint64_t depth_sum; // Over the leaves
+    uint32_t leaves_at_depth[BVH_REPORT_DEPTHS];
+    uint32_t leaves_of_size[BVH_REPORT_SIZES + 1];
+    double sah_cost;
+    double overlap_sum;   // Of the overlap ratios of every interior node
+    double overlap_area;  // Of the overlaps of siblings, relative to the root
+    uint32_t overlapping; // Interior nodes whose children overlap
+} BVHTreeStats;
+
+void bvh_tree_stats(BVHNode *bvh, const char *name, double build_seconds,
+                    BVHTreeStats *stats);
+
+void bvh_report_print(const BVHTreeStats *trees, uint32_t tree_count);
+
+void bvh_report_boxes(FILE *csv, const char *name, const BVHNode *bvh);
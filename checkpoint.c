@@ -0,0 +1,111 @@
+#include "checkpoint.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// A checkpoint holds everything needed to pick a render back up: the accumulation
+// buffer and the per-pixel sample counts. Since every sample is seeded from (seed,
+// pixel, sample index), the sample counts are also the position of each pixel's
+// sampler, so resuming continues the exact same sequence of samples.
+//
+// Layout (native endianness):
+//      CheckpointHeader
+//      float    accum[width * height * 3]
+//      uint32_t samples[width * height]
+
+#define CHECKPOINT_MAGIC "PTCKPT"
+#define CHECKPOINT_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t reserved;
+    uint64_t seed; // Render seed the samples were drawn with
+    uint64_t key;  // Hash of the scene, camera and settings being rendered
+} CheckpointHeader;
+
+//
+// Writes the framebuffer out to a checkpoint file. The data is written to a temporary
+// file first and then renamed over the old checkpoint, so an interrupted write never
+// leaves a corrupt checkpoint behind. Returns true on success.
+//
+bool checkpoint_write(const char *path, const Framebuffer *fb, uint64_t seed,
+                      uint64_t key) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Failed to open checkpoint file %s!\n", tmp_path);
+        return false;
+    }
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header.version = CHECKPOINT_VERSION;
+    header.width = fb->width;
+    header.height = fb->height;
+    header.seed = seed;
+    header.key = key;
+
+    size_t pixel_count = (size_t)fb->width * fb->height;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(fb->accum, sizeof(float) * 3, pixel_count, file) == pixel_count &&
+              fwrite(fb->samples, sizeof(uint32_t), pixel_count, file) == pixel_count;
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "ERROR: Failed to write checkpoint file %s!\n", path);
+        remove(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
+//
+// Loads a checkpoint into the framebuffer. Returns false, leaving the framebuffer
+// untouched, if there is no checkpoint or it was written for a different image,
+// seed or scene.
+//
+bool checkpoint_read(const char *path, Framebuffer *fb, uint64_t seed, uint64_t key) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    CheckpointHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+        header.version != CHECKPOINT_VERSION) {
+        fprintf(stderr, "WARNING: %s is not a valid checkpoint, ignoring it.\n", path);
+        fclose(file);
+        return false;
+    }
+
+    if (header.width != fb->width || header.height != fb->height || header.seed != seed ||
+        header.key != key) {
+        fprintf(stderr,
+                "WARNING: Checkpoint %s belongs to a different render, ignoring it.\n",
+                path);
+        fclose(file);
+        return false;
+    }
+
+    size_t pixel_count = (size_t)fb->width * fb->height;
+    bool ok = fread(fb->accum, sizeof(float) * 3, pixel_count, file) == pixel_count &&
+              fread(fb->samples, sizeof(uint32_t), pixel_count, file) == pixel_count;
+    fclose(file);
+
+    if (!ok) {
+        // A short read leaves the buffers half overwritten, so start from scratch.
+        fprintf(stderr, "WARNING: Checkpoint %s is truncated, ignoring it.\n", path);
+        memset(fb->accum, 0, pixel_count * 3 * sizeof(float));
+        memset(fb->samples, 0, pixel_count * sizeof(uint32_t));
+        return false;
+    }
+
+    return true;
+}
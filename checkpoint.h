@@ -0,0 +1,11 @@
+#pragma once
+
+#include "framebuffer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool checkpoint_write(const char *path, const Framebuffer *fb, uint64_t seed,
+                      uint64_t key);
+
+bool checkpoint_read(const char *path, Framebuffer *fb, uint64_t seed, uint64_t key);
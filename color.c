@@ -3,17 +3,20 @@
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 
-//
-// Returns the gamma corrected version of the color
-//
-color gamma_correct(color col, double gamma) {
-    col.x = pow(col.x, 1.0 / gamma);
-    col.y = pow(col.y, 1.0 / gamma);
-    col.z = pow(col.z, 1.0 / gamma);
+// Coefficients of the ACES filmic curve fit
+#define ACES_A 2.51
+#define ACES_B 0.03
+#define ACES_C 2.43
+#define ACES_D 0.59
+#define ACES_E 0.14
 
-    return col;
-}
+// Resolution of the sRGB encoding table used by tonemap_block()
+#define SRGB_LUT_SIZE 4096
+
+static uint8_t srgb_lut[SRGB_LUT_SIZE];
+static pthread_once_t srgb_lut_once = PTHREAD_ONCE_INIT;
 
 //
 // Transforms color from linear to SRGB.
@@ -65,11 +68,11 @@ color SRGB_to_linear(color rgb) {
 // https://knarkowicz.wordpress.com/2016/01/06/aces-filmic-tone-mapping-curve/
 //
 color ACES_film(color rgb) {
-    double const a = 2.51;
-    double const b = 0.03;
-    double const c = 2.43;
-    double const d = 0.59;
-    double const e = 0.14;
+    double const a = ACES_A;
+    double const b = ACES_B;
+    double const c = ACES_C;
+    double const d = ACES_D;
+    double const e = ACES_E;
 
     rgb.x = clamp((rgb.x * (a * rgb.x + b)) / (rgb.x * (c * rgb.x + d) + e), 0.0, 1.0);
     rgb.y = clamp((rgb.y * (a * rgb.y + b)) / (rgb.y * (c * rgb.y + d) + e), 0.0, 1.0);
@@ -79,30 +82,39 @@ color ACES_film(color rgb) {
 }
 
 //
-// Writes out the color of the pixel given an index into the image buffer. Applies
-// appropriate transformations from linear to non-linear color space.
+// Fills the table mapping display-referred linear values in [0, 1] to 8-bit sRGB.
 //
-void write_color(uint8_t *image, color pixel_color, uint32_t i,
-                 uint32_t samples_per_pixel) {
-
-    // Scale color based on the number of samples taken per pixel and then
-    // gamma-correct.
-    double scale = 1.0 / (double)samples_per_pixel;
-    pixel_color = v3_scale(pixel_color, scale);
-    pixel_color = gamma_correct(pixel_color,  2.2);
+static void srgb_lut_init(void) {
+    for (uint32_t i = 0; i < SRGB_LUT_SIZE; i++) {
+        double x = (double)i / (SRGB_LUT_SIZE - 1);
+        color c = linear_to_SRGB(v3_init(x, x, x));
+        srgb_lut[i] = (uint8_t)(255 * clamp(c.x, 0.0, 1.0) + 0.5);
+    }
+}
 
-    // apply exposure
-    double const exposure = 1.0;
-    pixel_color = v3_scale(pixel_color, exposure);
+//
+// Tone maps n linear HDR channel values w/ the ACES curve and encodes them to 8-bit
+// sRGB. The curve is evaluated in a branch-free loop so it can be vectorized, and the
+// sRGB transfer function is replaced by a table lookup, so no pow() calls are made.
+//
+void tonemap_block(const float *in, uint8_t *out, size_t n) {
+    pthread_once(&srgb_lut_once, srgb_lut_init);
 
-    // convert unbounded HDR color range to SDR color range
-    /*pixel_color = ACES_film(pixel_color);*/
+    int32_t idx[256];
+    for (size_t start = 0; start < n; start += 256) {
+        size_t count = n - start < 256 ? n - start : 256;
+        const float *x = &in[start];
 
-    // Convert from linear to sRGB for display
-    /*pixel_color = linear_to_SRGB(pixel_color);*/
+        for (size_t i = 0; i < count; i++) {
+            float v = fmaxf(x[i], 0.0f);
+            float mapped = (v * ((float)ACES_A * v + (float)ACES_B)) /
+                           (v * ((float)ACES_C * v + (float)ACES_D) + (float)ACES_E);
+            mapped = fminf(fmaxf(mapped, 0.0f), 1.0f);
+            idx[i] = (int32_t)(mapped * (SRGB_LUT_SIZE - 1) + 0.5f);
+        }
 
-    // Set value of color channels at the pixel
-    image[i] = (uint8_t)(255 * clamp(pixel_color.x, 0.0, 1.0));
-    image[i + 1] = (uint8_t)(255 * clamp(pixel_color.y, 0.0, 1.0));
-    image[i + 2] = (uint8_t)(255 * clamp(pixel_color.z, 0.0, 1.0));
+        for (size_t i = 0; i < count; i++) {
+            out[start + i] = srgb_lut[idx[i]];
+        }
+    }
 }
@@ -2,6 +2,7 @@
 
 #include "vec3.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
 color linear_to_SRGB(color);
@@ -10,5 +11,4 @@ color SRGB_to_linear(color);
 
 color ACES_film(color);
 
-void write_color(uint8_t *image, color pixel_color, uint32_t i,
-                 uint32_t samples_per_pixel);
+void tonemap_block(const float *in, uint8_t *out, size_t n);
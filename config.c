@@ -0,0 +1,409 @@
+#include "config.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_WIDTH 400
+#define DEFAULT_SPP 100
+#define DEFAULT_MAX_DEPTH 50
+#define DEFAULT_LEAF_SIZE 1
+#define DEFAULT_SKYBOX "assets/parched_canal_4k.hdr"
+#define DEFAULT_OUTPUT "out.png"
+#define DEFAULT_CHECKPOINT "out.ckpt"
+#define DEFAULT_COST_OUTPUT "out_cost.png"
+
+const char *sweep_param_names[SWEEP_PARAM_COUNT] = {
+    "threads", "spp", "depth", "leaf", "width", "bvh", "builder", "optimize"};
+
+static const char *background_names[] = {"gradient", "skybox", "black"};
+static const char *cost_names[] = {"none", "time", "work"};
+
+// Options without a short form
+enum {
+    OPT_HEIGHT = 256,
+    OPT_SINGLE_THREAD,
+    OPT_PIN,
+    OPT_NUMA,
+    OPT_NO_BVH,
+    OPT_LEAF_SIZE,
+    OPT_BUILDER,
+    OPT_OPTIMIZE_BVH,
+    OPT_SKYBOX,
+    OPT_SKYBOX_CACHE,
+    OPT_CHECKPOINT,
+    OPT_COST,
+    OPT_COST_OUTPUT,
+    OPT_SEED,
+    OPT_TIME_BUDGET,
+    OPT_BAND_HEIGHT,
+    OPT_EXPOSURE,
+    OPT_SWEEP,
+    OPT_SCENE,
+    OPT_SCENE_CACHE,
+};
+
+static const struct option long_options[] = {
+    {"width", required_argument, NULL, 'w'},
+    {"height", required_argument, NULL, OPT_HEIGHT},
+    {"spp", required_argument, NULL, 's'},
+    {"max-depth", required_argument, NULL, 'd'},
+    {"threads", required_argument, NULL, 't'},
+    {"single-thread", no_argument, NULL, OPT_SINGLE_THREAD},
+    {"pin", no_argument, NULL, OPT_PIN},
+    {"numa", no_argument, NULL, OPT_NUMA},
+    {"no-bvh", no_argument, NULL, OPT_NO_BVH},
+    {"leaf-size", required_argument, NULL, OPT_LEAF_SIZE},
+    {"builder", required_argument, NULL, OPT_BUILDER},
+    {"optimize-bvh", no_argument, NULL, OPT_OPTIMIZE_BVH},
+    {"background", required_argument, NULL, 'b'},
+    {"skybox", required_argument, NULL, OPT_SKYBOX},
+    {"skybox-cache", required_argument, NULL, OPT_SKYBOX_CACHE},
+    {"output", required_argument, NULL, 'o'},
+    {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+    {"cost", required_argument, NULL, OPT_COST},
+    {"cost-output", required_argument, NULL, OPT_COST_OUTPUT},
+    {"seed", required_argument, NULL, OPT_SEED},
+    {"time-budget", required_argument, NULL, OPT_TIME_BUDGET},
+    {"band-height", required_argument, NULL, OPT_BAND_HEIGHT},
+    {"exposure", required_argument, NULL, OPT_EXPOSURE},
+    {"sweep", required_argument, NULL, OPT_SWEEP},
+    {"scene", required_argument, NULL, OPT_SCENE},
+    {"scene-cache", required_argument, NULL, OPT_SCENE_CACHE},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+//
+// Fills in the settings used when nothing else is given.
+//
+void config_defaults(Config *config) {
+    memset(config, 0, sizeof(Config));
+    config->image_width = DEFAULT_WIDTH;
+    config->samples_per_pixel = DEFAULT_SPP;
+    config->max_depth = DEFAULT_MAX_DEPTH;
+    config->exposure = 1.0;
+    config->thread_count = 0;
+    config->use_bvh = true;
+    config->leaf_size = DEFAULT_LEAF_SIZE;
+    config->background = BACKGROUND_GRADIENT;
+    config->skybox_path = DEFAULT_SKYBOX;
+    config->output_path = DEFAULT_OUTPUT;
+    config->checkpoint_path = DEFAULT_CHECKPOINT;
+    config->cost_path = DEFAULT_COST_OUTPUT;
+    config->cost_metric = COST_NONE;
+}
+
+//
+// Takes the settings a scene file gives, leaving the rest as they are. The
+// environment path is borrowed from desc.
+//
+void config_apply_scene(Config *config, const SceneDesc *desc) {
+    config->image_width = desc->width ? desc->width : config->image_width;
+    config->image_height = desc->height ? desc->height : config->image_height;
+    config->samples_per_pixel =
+        desc->samples_per_pixel ? desc->samples_per_pixel : config->samples_per_pixel;
+    config->max_depth = desc->max_depth ? desc->max_depth : config->max_depth;
+    config->exposure = desc->exposure > 0 ? desc->exposure : config->exposure;
+    if (desc->background >= 0) {
+        config->background = (BackgroundType)desc->background;
+    }
+    if (desc->environment[0]) {
+        config->skybox_path = desc->environment;
+    }
+}
+
+//
+// Prints the command line options.
+//
+void config_usage(const char *program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  -w, --width N          image width (default %d)\n", DEFAULT_WIDTH);
+    printf("      --height N         image height (default 3/4 of the width)\n");
+    printf("  -s, --spp N            samples per pixel (default %d)\n", DEFAULT_SPP);
+    printf("  -d, --max-depth N      maximum ray bounces (default %d)\n", DEFAULT_MAX_DEPTH);
+    printf("  -t, --threads N        render threads (default: one per available CPU,\n");
+    printf("                         within the cgroup CPU quota)\n");
+    printf("      --single-thread    render on the main thread, same as --threads 1\n");
+    printf("      --pin              pin each render thread to its own CPU\n");
+    printf("      --numa             copy the scene and BVH into each NUMA node's memory\n");
+    printf("                         and pin the threads to match\n");
+    printf("      --no-bvh           test every ray against every object\n");
+    printf("      --leaf-size N      maximum objects per BVH leaf (default %d)\n",
+           DEFAULT_LEAF_SIZE);
+    printf("      --builder NAME     BVH builder: median, or lbvh for a faster build from\n");
+    printf("                         Morton codes (default median)\n");
+    printf("      --optimize-bvh     restructure the built BVH for a lower SAH cost and\n");
+    printf("                         lay it out for traversal, for long renders\n");
+    printf("  -b, --background TYPE  gradient, skybox or black (default gradient)\n");
+    printf("      --skybox PATH      skybox image (default %s)\n", DEFAULT_SKYBOX);
+    printf("      --skybox-cache PATH decoded skybox cache, empty to disable (default:\n");
+    printf("                         the skybox path + .cache)\n");
+    printf("  -o, --output PATH      output image, .png, .pfm or .exr (default %s)\n",
+           DEFAULT_OUTPUT);
+    printf("      --checkpoint PATH  checkpoint file, empty to disable (default %s)\n",
+           DEFAULT_CHECKPOINT);
+    printf("      --cost METRIC      per-pixel cost heatmap: none, time or work\n");
+    printf("      --cost-output PATH cost heatmap image (default %s)\n",
+           DEFAULT_COST_OUTPUT);
+    printf("      --seed N           random seed (default 0)\n");
+    printf("      --time-budget S    render for S seconds instead of to a sample count\n");
+    printf("      --band-height N    render and stream out N rows at a time, without a\n");
+    printf("                         time budget or checkpoints\n");
+    printf("      --exposure X       exposure multiplier (default 1.0)\n");
+    printf("      --sweep P=A,B,...  render every combination of the swept values and\n");
+    printf("                         print a timing table instead of an image. P is one\n");
+    printf("                         of threads, spp, depth, leaf, width, bvh (0/1),\n");
+    printf("                         builder (by name) or optimize (0/1).\n");
+    printf("                         Repeat for a cross product of several settings.\n");
+    printf("      --scene PATH       load the scene, camera and settings from a scene\n");
+    printf("                         file; options given here override its settings\n");
+    printf("      --scene-cache PATH cache of the loaded scene and its BVH, empty to\n");
+    printf("                         disable (default: the scene path + .cache)\n");
+    printf("  -h, --help             show this help\n");
+}
+
+static bool parse_uint(const char *arg, const char *name, uint64_t min, uint64_t max,
+                       uint64_t *value) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (errno || end == arg || *end != '\0' || arg[0] == '-' || v < min || v > max) {
+        fprintf(stderr, "ERROR: Invalid %s '%s', expected %llu to %llu\n", name, arg,
+                (unsigned long long)min, (unsigned long long)max);
+        return false;
+    }
+    *value = v;
+    return true;
+}
+
+static bool parse_u32(const char *arg, const char *name, uint32_t min, uint32_t *value) {
+    uint64_t v;
+    if (!parse_uint(arg, name, min, UINT32_MAX, &v)) {
+        return false;
+    }
+    *value = (uint32_t)v;
+    return true;
+}
+
+static bool parse_double(const char *arg, const char *name, double *value) {
+    char *end;
+    errno = 0;
+    double v = strtod(arg, &end);
+    if (errno || end == arg || *end != '\0' || v < 0) {
+        fprintf(stderr, "ERROR: Invalid %s '%s'\n", name, arg);
+        return false;
+    }
+    *value = v;
+    return true;
+}
+
+static bool parse_name(const char *arg, const char *option, const char **names,
+                       int count, int *value) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(arg, names[i]) == 0) {
+            *value = i;
+            return true;
+        }
+    }
+    fprintf(stderr, "ERROR: Unknown %s '%s'\n", option, arg);
+    return false;
+}
+
+//
+// Parses a sweep specification of the form "param=value,value,...".
+//
+static bool parse_sweep(Config *config, const char *spec) {
+    if (config->sweep_count == SWEEP_MAX_PARAMS) {
+        fprintf(stderr, "ERROR: At most %d settings can be swept\n", SWEEP_MAX_PARAMS);
+        return false;
+    }
+    const char *equals = strchr(spec, '=');
+    if (equals == NULL) {
+        fprintf(stderr, "ERROR: Invalid sweep '%s', expected param=value,value,...\n",
+                spec);
+        return false;
+    }
+
+    SweepAxis *axis = &config->sweep[config->sweep_count];
+    memset(axis, 0, sizeof(SweepAxis));
+    size_t name_length = (size_t)(equals - spec);
+    int param = -1;
+    for (int i = 0; i < SWEEP_PARAM_COUNT; i++) {
+        if (strlen(sweep_param_names[i]) == name_length &&
+            strncmp(spec, sweep_param_names[i], name_length) == 0) {
+            param = i;
+        }
+    }
+    if (param < 0) {
+        fprintf(stderr, "ERROR: Unknown sweep parameter in '%s'\n", spec);
+        return false;
+    }
+    for (uint32_t i = 0; i < config->sweep_count; i++) {
+        if (config->sweep[i].param == (SweepParam)param) {
+            fprintf(stderr, "ERROR: %s is swept more than once\n", sweep_param_names[param]);
+            return false;
+        }
+    }
+    axis->param = (SweepParam)param;
+
+    char values[256];
+    snprintf(values, sizeof(values), "%s", equals + 1);
+    for (char *save = NULL, *value = strtok_r(values, ",", &save); value;
+         value = strtok_r(NULL, ",", &save)) {
+        if (axis->value_count == SWEEP_MAX_VALUES) {
+            fprintf(stderr, "ERROR: At most %d values can be swept\n", SWEEP_MAX_VALUES);
+            return false;
+        }
+        uint32_t min = axis->param == SWEEP_BVH || axis->param == SWEEP_DEPTH ||
+                               axis->param == SWEEP_OPTIMIZE
+                           ? 0
+                           : 1;
+        int builder;
+        if (axis->param == SWEEP_BUILDER) {
+            if (!parse_name(value, "BVH builder", bvh_builder_names, BVH_BUILDER_COUNT,
+                            &builder)) {
+                return false;
+            }
+            axis->values[axis->value_count++] = (uint32_t)builder;
+        } else if (!parse_u32(value, sweep_param_names[param], min,
+                              &axis->values[axis->value_count++])) {
+            return false;
+        }
+    }
+    if (axis->value_count == 0) {
+        fprintf(stderr, "ERROR: No values to sweep in '%s'\n", spec);
+        return false;
+    }
+
+    config->sweep_count++;
+    return true;
+}
+
+//
+// Parses the command line into config, on top of whatever it already holds.
+// Prints the usage and exits on --help. Returns false if an option is invalid.
+//
+bool config_parse(Config *config, int argc, char **argv) {
+    int value = 0;
+    uint64_t seed;
+    bool checkpoint_given = false; // Unlike the default checkpoint, which bands skip
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "w:s:d:t:b:o:h", long_options, NULL)) != -1) {
+        bool ok = true;
+        switch (opt) {
+        case 'w':
+            ok = parse_u32(optarg, "width", 2, &config->image_width);
+            break;
+        case OPT_HEIGHT:
+            ok = parse_u32(optarg, "height", 2, &config->image_height);
+            break;
+        case 's':
+            ok = parse_u32(optarg, "sample count", 1, &config->samples_per_pixel);
+            break;
+        case 'd':
+            ok = parse_u32(optarg, "depth", 0, &config->max_depth);
+            break;
+        case 't':
+            ok = parse_u32(optarg, "thread count", 1, &config->thread_count);
+            break;
+        case OPT_SINGLE_THREAD:
+            config->thread_count = 1;
+            break;
+        case OPT_PIN:
+            config->pin_threads = true;
+            break;
+        case OPT_NUMA:
+            config->numa_replicas = true;
+            break;
+        case OPT_NO_BVH:
+            config->use_bvh = false;
+            break;
+        case OPT_LEAF_SIZE:
+            ok = parse_u32(optarg, "leaf size", 1, &config->leaf_size);
+            break;
+        case OPT_BUILDER:
+            ok = parse_name(optarg, "BVH builder", bvh_builder_names, BVH_BUILDER_COUNT,
+                            &value);
+            config->builder = (BVHBuilder)value;
+            break;
+        case OPT_OPTIMIZE_BVH:
+            config->optimize_bvh = true;
+            break;
+        case 'b':
+            ok = parse_name(optarg, "background", background_names, 3, &value);
+            config->background = (BackgroundType)value;
+            break;
+        case OPT_SKYBOX:
+            config->skybox_path = optarg;
+            break;
+        case OPT_SKYBOX_CACHE:
+            config->skybox_cache_path = optarg;
+            break;
+        case 'o':
+            config->output_path = optarg;
+            break;
+        case OPT_CHECKPOINT:
+            config->checkpoint_path = optarg[0] ? optarg : NULL;
+            checkpoint_given = optarg[0] != '\0';
+            break;
+        case OPT_COST:
+            ok = parse_name(optarg, "cost metric", cost_names, 3, &value);
+            config->cost_metric = (CostMetric)value;
+            break;
+        case OPT_COST_OUTPUT:
+            config->cost_path = optarg;
+            break;
+        case OPT_SEED:
+            ok = parse_uint(optarg, "seed", 0, UINT64_MAX, &seed);
+            config->seed = seed;
+            break;
+        case OPT_TIME_BUDGET:
+            ok = parse_double(optarg, "time budget", &config->time_budget);
+            break;
+        case OPT_BAND_HEIGHT:
+            ok = parse_u32(optarg, "band height", 0, &config->band_height);
+            break;
+        case OPT_EXPOSURE:
+            ok = parse_double(optarg, "exposure", &config->exposure);
+            break;
+        case OPT_SWEEP:
+            ok = parse_sweep(config, optarg);
+            break;
+        case OPT_SCENE:
+            config->scene_path = optarg;
+            break;
+        case OPT_SCENE_CACHE:
+            config->scene_cache_path = optarg;
+            break;
+        case 'h':
+            config_usage(argv[0]);
+            exit(0);
+        default:
+            ok = false;
+            break;
+        }
+        if (!ok) {
+            fprintf(stderr, "Run %s --help for the list of options\n", argv[0]);
+            return false;
+        }
+    }
+    if (optind < argc) {
+        fprintf(stderr, "ERROR: Unexpected argument '%s'\n", argv[optind]);
+        return false;
+    }
+    // Bands are rendered to the sample count one after another and not kept around
+    if (config->band_height > 0 && (config->time_budget > 0 || checkpoint_given)) {
+        fprintf(stderr, "ERROR: --band-height cannot be combined with %s\n",
+                config->time_budget > 0 ? "--time-budget" : "--checkpoint");
+        return false;
+    }
+
+    if (config->image_height == 0) {
+        config->image_height = (uint32_t)(config->image_width / (4.0 / 3.0));
+    }
+    return true;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "cost.h"
+#include "render.h"
+#include "scene_file.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SWEEP_MAX_PARAMS 8
+#define SWEEP_MAX_VALUES 16
+
+// Settings that can be swept over
+typedef enum {
+    SWEEP_THREADS,
+    SWEEP_SPP,
+    SWEEP_DEPTH,
+    SWEEP_LEAF_SIZE,
+    SWEEP_WIDTH,
+    SWEEP_BVH,
+    SWEEP_BUILDER,
+    SWEEP_OPTIMIZE,
+    SWEEP_PARAM_COUNT
+} SweepParam;
+
+typedef struct {
+    SweepParam param;
+    uint32_t values[SWEEP_MAX_VALUES];
+    uint32_t value_count;
+} SweepAxis;
+
+// Everything about a run that can be set from the command line
+typedef struct {
+    uint32_t image_width, image_height; // A height of 0 follows from the width
+    uint32_t samples_per_pixel, max_depth;
+    double exposure;
+    uint32_t thread_count; // 1 renders on the main thread, 0 uses every available CPU
+    bool pin_threads;      // Pin each render thread to its own CPU
+    bool numa_replicas;    // Give each NUMA node its own copy of the scene and BVH
+    bool use_bvh;          // Otherwise every ray is tested against every object
+    uint32_t leaf_size;    // Maximum number of objects in a BVH leaf
+    BVHBuilder builder;
+    bool optimize_bvh;     // Restructure and pack the BVH once built, see bvh_optimize()
+    BackgroundType background;
+    const char *skybox_path;
+    const char *skybox_cache_path; // NULL for the skybox path + .cache, "" for no cache
+    const char *output_path;     // Format follows from the extension
+    const char *checkpoint_path; // NULL for no checkpointing
+    const char *cost_path;
+    CostMetric cost_metric;
+    uint64_t seed;
+    double time_budget;   // Seconds of rendering, 0 renders samples_per_pixel instead
+    uint32_t band_height; // Rows rendered and streamed out at a time, 0 for whole frame
+    SweepAxis sweep[SWEEP_MAX_PARAMS]; // Rendered as a cross product when non-empty
+    uint32_t sweep_count;
+    const char *scene_path;       // NULL for the built-in scene
+    const char *scene_cache_path; // NULL for the scene path + .cache, "" for no cache
+} Config;
+
+extern const char *sweep_param_names[SWEEP_PARAM_COUNT];
+
+void config_defaults(Config *config);
+
+bool config_parse(Config *config, int argc, char **argv);
+
+void config_apply_scene(Config *config, const SceneDesc *desc);
+
+void config_usage(const char *program);
@@ -0,0 +1,102 @@
+#include "cost.h"
+#include "stats.h"
+#include "util.h"
+
+#include "include/stb_image/stb_image_write.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+//
+// Returns the current value of the counter behind metric. The cost of a piece of work
+// is the difference between the values read before and after it, on the same thread.
+//
+uint64_t cost_now(CostMetric metric) {
+    switch (metric) {
+    case COST_TIME: {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+    }
+    case COST_WORK: {
+#if RENDER_STATS
+        RenderStats *stats = stats_thread_local();
+        return stats->bvh_nodes_visited + stats->primitive_tests;
+#else
+        return 0;
+#endif
+    }
+    default:
+        return 0;
+    }
+}
+
+// False color ramp from cheap to expensive: black, blue, cyan, green, yellow, red, white
+static const float ramp[][3] = {{0, 0, 0}, {0, 0, 1}, {0, 1, 1}, {0, 1, 0},
+                                {1, 1, 0}, {1, 0, 0}, {1, 1, 1}};
+#define RAMP_STOPS (sizeof(ramp) / sizeof(ramp[0]))
+
+static int compare_floats(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+//
+// Writes the per-pixel cost out as a false color PNG. Cost is mapped on a log scale
+// between the 1st and 99th percentile, so that a region costing 50x more than the
+// rest still shows its own structure and a few pixels whose thread was preempted do
+// not wash out the rest of the image.
+//
+bool cost_write_heatmap(const char *path, const float *cost, uint32_t width,
+                        uint32_t height) {
+    size_t pixel_count = (size_t)width * height;
+
+    float *sorted = (float *)malloc(pixel_count * sizeof(float));
+    assert(sorted != NULL);
+    double total = 0;
+    for (size_t i = 0; i < pixel_count; i++) {
+        sorted[i] = cost[i];
+        total += cost[i];
+    }
+    qsort(sorted, pixel_count, sizeof(float), compare_floats);
+    double low = sorted[pixel_count / 100];
+    double high = sorted[pixel_count - 1 - pixel_count / 100];
+    double mean = total / pixel_count;
+    printf("Pixel cost: mean %.0f, 1st percentile %.0f (%.2fx mean), 99th percentile "
+           "%.0f (%.2fx mean), max %.0f\n",
+           mean, low, low / mean, high, high / mean, sorted[pixel_count - 1]);
+    free(sorted);
+
+    uint8_t *image = (uint8_t *)malloc(pixel_count * 3);
+    assert(image != NULL);
+
+    double range = log1p(high) - log1p(low);
+    double scale = range > 0 ? 1.0 / range : 0;
+    for (size_t i = 0; i < pixel_count; i++) {
+        double t = clamp((log1p(cost[i]) - log1p(low)) * scale, 0, 1) * (RAMP_STOPS - 1);
+        uint32_t stop = (uint32_t)clamp(floor(t), 0, RAMP_STOPS - 2);
+        double f = t - stop;
+        for (int c = 0; c < 3; c++) {
+            double v = ramp[stop][c] + f * (ramp[stop + 1][c] - ramp[stop][c]);
+            image[i * 3 + c] = (uint8_t)(255.0 * v + 0.5);
+        }
+    }
+
+    bool ok = stbi_write_png(path, width, height, 3, image, width * 3) != 0;
+    if (!ok) {
+        fprintf(stderr, "ERROR: Failed to write %s!\n", path);
+    }
+    free(image);
+    return ok;
+}
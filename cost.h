@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// What the per-pixel cost image measures.
+typedef enum {
+    COST_NONE, // No cost image
+    COST_TIME, // CPU cycles (rdtsc), or nanoseconds where there is no cycle counter
+    COST_WORK, // BVH nodes visited plus primitive tests, requires a `make STATS=1` build
+} CostMetric;
+
+uint64_t cost_now(CostMetric metric);
+
+bool cost_write_heatmap(const char *path, const float *cost, uint32_t width,
+                        uint32_t height);
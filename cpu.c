@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include "cpu.h"
+
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NODE_PATH "/sys/devices/system/node"
+#define MAX_NODES 1024
+
+//
+// Parses a kernel CPU list such as "0-3,8,10-11" into set. Returns false if the list
+// could not be read.
+//
+static bool read_cpulist(const char *path, cpu_set_t *set) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    char line[4096];
+    bool ok = fgets(line, sizeof(line), file) != NULL;
+    fclose(file);
+    if (!ok) {
+        return false;
+    }
+
+    CPU_ZERO(set);
+    for (char *save = NULL, *range = strtok_r(line, ",\n", &save); range;
+         range = strtok_r(NULL, ",\n", &save)) {
+        unsigned first, last;
+        int n = sscanf(range, "%u-%u", &first, &last);
+        if (n < 1) {
+            continue;
+        }
+        if (n == 1) {
+            last = first;
+        }
+        for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+    }
+    return true;
+}
+
+//
+// Returns the CPU time the cgroup quota allows in CPUs, or 0 if there is none.
+// Handles cgroup v2 (cpu.max, checked on every ancestor of our cgroup) and v1
+// (cpu.cfs_quota_us and cpu.cfs_period_us).
+//
+static double cgroup_quota(void) {
+    double quota = 0;
+
+    char cgroup[1024] = "";
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    if (file) {
+        char line[1024];
+        while (fgets(line, sizeof(line), file)) {
+            if (strncmp(line, "0::", 3) == 0) {
+                snprintf(cgroup, sizeof(cgroup), "%s", line + 3);
+                cgroup[strcspn(cgroup, "\n")] = '\0';
+            }
+        }
+        fclose(file);
+    }
+
+    // cgroup v2: the tightest limit of our cgroup and its ancestors applies
+    while (cgroup[0] == '/') {
+        char path[1200];
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cgroup);
+        file = fopen(path, "r");
+        if (file) {
+            char max[32];
+            double period;
+            if (fscanf(file, "%31s %lf", max, &period) == 2 && strcmp(max, "max") != 0 &&
+                period > 0) {
+                double cpus = atof(max) / period;
+                quota = quota == 0 || cpus < quota ? cpus : quota;
+            }
+            fclose(file);
+        }
+        char *slash = strrchr(cgroup, '/');
+        *slash = '\0';
+        if (slash == cgroup) {
+            break;
+        }
+    }
+
+    // cgroup v1, as mounted inside a container
+    const char *v1_dirs[] = {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"};
+    for (int i = 0; i < 2; i++) {
+        char path[256];
+        double cfs_quota = -1, cfs_period = 0;
+        snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", v1_dirs[i]);
+        file = fopen(path, "r");
+        if (file) {
+            if (fscanf(file, "%lf", &cfs_quota) != 1) {
+                cfs_quota = -1;
+            }
+            fclose(file);
+        }
+        snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", v1_dirs[i]);
+        file = fopen(path, "r");
+        if (file) {
+            if (fscanf(file, "%lf", &cfs_period) != 1) {
+                cfs_period = 0;
+            }
+            fclose(file);
+        }
+        if (cfs_quota > 0 && cfs_period > 0) {
+            double cpus = cfs_quota / cfs_period;
+            quota = quota == 0 || cpus < quota ? cpus : quota;
+        }
+    }
+
+    return quota;
+}
+
+//
+// Finds the CPUs we are allowed to run on (sched_getaffinity), the NUMA nodes they
+// belong to and the cgroup CPU quota. Without NUMA information in sysfs all CPUs are
+// put on a single node.
+//
+CpuTopology *topology_create(void) {
+    CpuTopology *topology = (CpuTopology *)calloc(1, sizeof(CpuTopology));
+    assert(topology != NULL);
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+    uint32_t count = (uint32_t)CPU_COUNT(&allowed);
+    topology->cpus = (uint32_t *)malloc(count * sizeof(uint32_t));
+    topology->cpu_nodes = (uint32_t *)malloc(count * sizeof(uint32_t));
+    topology->nodes = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+    assert(topology->cpus != NULL && topology->cpu_nodes != NULL &&
+           topology->nodes != NULL);
+
+    // Take the CPUs node by node, so that consecutive workers share a node
+    cpu_set_t placed;
+    CPU_ZERO(&placed);
+    for (uint32_t node = 0; node < MAX_NODES && topology->cpu_count < count; node++) {
+        char path[128];
+        cpu_set_t node_cpus;
+        snprintf(path, sizeof(path), NODE_PATH "/node%u/cpulist", node);
+        if (!read_cpulist(path, &node_cpus)) {
+            continue;
+        }
+        bool used = false;
+        for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &node_cpus) && CPU_ISSET(cpu, &allowed) &&
+                !CPU_ISSET(cpu, &placed)) {
+                CPU_SET(cpu, &placed);
+                topology->cpus[topology->cpu_count] = cpu;
+                topology->cpu_nodes[topology->cpu_count++] = topology->node_count;
+                used = true;
+            }
+        }
+        if (used) {
+            topology->nodes[topology->node_count++] = node;
+        }
+    }
+
+    // CPUs sysfs does not place on any node go on a node of their own
+    bool unplaced = false;
+    for (uint32_t cpu = 0; cpu < CPU_SETSIZE && topology->cpu_count < count; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &placed)) {
+            topology->cpus[topology->cpu_count] = cpu;
+            topology->cpu_nodes[topology->cpu_count++] = topology->node_count;
+            unplaced = true;
+        }
+    }
+    if (unplaced) {
+        topology->nodes[topology->node_count++] = 0;
+    }
+
+    topology->quota = (uint32_t)ceil(cgroup_quota());
+    return topology;
+}
+
+void topology_delete(CpuTopology **topology) {
+    if (*topology) {
+        free((*topology)->cpus);
+        free((*topology)->cpu_nodes);
+        free((*topology)->nodes);
+        free(*topology);
+        *topology = NULL;
+    }
+    return;
+}
+
+//
+// Returns how many render threads to use: one per available CPU, but no more than
+// the cgroup quota allows to run at once.
+//
+uint32_t topology_thread_count(const CpuTopology *topology) {
+    uint32_t threads = topology->cpu_count;
+    if (topology->quota > 0 && topology->quota < threads) {
+        threads = topology->quota;
+    }
+    return threads > 0 ? threads : 1;
+}
+
+void topology_print(const CpuTopology *topology) {
+    printf("CPUs: %u available on %u NUMA node%s", topology->cpu_count,
+           topology->node_count, topology->node_count == 1 ? "" : "s");
+    if (topology->quota > 0) {
+        printf(", cgroup quota %u", topology->quota);
+    }
+    printf("\n");
+}
+
+//
+// Pins the calling thread to a single CPU. Returns true on success.
+//
+bool cpu_pin(uint32_t cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
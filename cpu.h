@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The CPUs this process may run on and the NUMA nodes they belong to
+typedef struct {
+    uint32_t cpu_count;
+    uint32_t *cpus;      // Available CPUs, grouped by NUMA node
+    uint32_t *cpu_nodes; // Index into nodes of the node each of cpus belongs to
+    uint32_t node_count; // NUMA nodes with at least one available CPU
+    uint32_t *nodes;     // Their node numbers
+    uint32_t quota;      // CPUs worth of time the cgroup allows, 0 if unlimited
+} CpuTopology;
+
+CpuTopology *topology_create(void);
+
+void topology_delete(CpuTopology **topology);
+
+uint32_t topology_thread_count(const CpuTopology *topology);
+
+void topology_print(const CpuTopology *topology);
+
+bool cpu_pin(uint32_t cpu);
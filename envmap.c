@@ -0,0 +1,305 @@
+#include "envmap.h"
+#include "color.h"
+#include "util.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "include/stb_image/stb_image.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Decoding an HDR image takes far longer than rendering a small scene, so the decoded
+// environment is kept in a cache file next to it and memory mapped on later runs.
+// The cache is keyed by a hash of the image file's contents.
+//
+// Layout (native endianness):
+//      EnvMapCacheHeader
+//      float pixels[width * height * 3]
+//      float marginal_cdf[height + 1]
+//      float conditional_cdf[height * (width + 1)]
+
+#define ENVMAP_CACHE_MAGIC "PTENV"
+#define ENVMAP_CACHE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t reserved;
+    uint64_t key;
+    uint64_t size; // Of the whole file, so a truncated cache is caught
+} EnvMapCacheHeader;
+
+// Number of floats in the pixels and the two tables
+static size_t envmap_floats(uint32_t width, uint32_t height) {
+    return (size_t)width * height * 3 + (height + 1) + (size_t)height * (width + 1);
+}
+
+static void envmap_point_into(EnvMap *env, const float *data) {
+    env->pixels = data;
+    env->marginal_cdf = data + (size_t)env->width * env->height * 3;
+    env->conditional_cdf = env->marginal_cdf + env->height + 1;
+}
+
+//
+// Fills in the tables for importance sampling the environment. Each texel is weighted
+// by its luminance and by the sine of its polar angle, which makes up for the rows
+// near the poles covering less of the sphere.
+//
+static void build_cdfs(const float *pixels, uint32_t width, uint32_t height,
+                       float *marginal, float *conditional) {
+    double total = 0;
+    marginal[0] = 0;
+    for (uint32_t y = 0; y < height; y++) {
+        double sin_theta = sin(M_PI * (y + 0.5) / height);
+        float *row_cdf = conditional + (size_t)y * (width + 1);
+        double row_total = 0;
+        row_cdf[0] = 0;
+        for (uint32_t x = 0; x < width; x++) {
+            const float *p = pixels + ((size_t)y * width + x) * 3;
+            row_total += (0.2126 * p[0] + 0.7152 * p[1] + 0.0722 * p[2]) * sin_theta;
+            row_cdf[x + 1] = (float)row_total;
+        }
+        for (uint32_t x = 1; x <= width; x++) {
+            row_cdf[x] = row_total > 0 ? (float)(row_cdf[x] / row_total)
+                                       : (float)x / width;
+        }
+        total += row_total;
+        marginal[y + 1] = (float)total;
+    }
+    for (uint32_t y = 1; y <= height; y++) {
+        marginal[y] = total > 0 ? (float)(marginal[y] / total) : (float)y / height;
+    }
+}
+
+//
+// Decodes an environment image to linear RGB floats and builds its sampling tables.
+// The sRGB to linear conversion matches what lookups used to do on the 8 bit image.
+//
+static EnvMap *envmap_decode(const char *path) {
+    int width, height, channels;
+    unsigned char *image = stbi_load(path, &width, &height, &channels, 3);
+    if (image == NULL) {
+        return NULL;
+    }
+
+    float to_linear[256];
+    for (int i = 0; i < 256; i++) {
+        to_linear[i] = (float)SRGB_to_linear(v3_init(i / 255.0, 0, 0)).x;
+    }
+
+    EnvMap *env = (EnvMap *)calloc(1, sizeof(EnvMap));
+    assert(env != NULL);
+    env->width = (uint32_t)width;
+    env->height = (uint32_t)height;
+    float *data = (float *)malloc(envmap_floats(env->width, env->height) * sizeof(float));
+    assert(data != NULL);
+    size_t count = (size_t)width * height * 3;
+    for (size_t i = 0; i < count; i++) {
+        data[i] = to_linear[image[i]];
+    }
+    stbi_image_free(image);
+
+    envmap_point_into(env, data);
+    build_cdfs(data, env->width, env->height, (float *)env->marginal_cdf,
+               (float *)env->conditional_cdf);
+    return env;
+}
+
+//
+// Maps a cache written for the given key. Returns NULL if there is none or it is
+// out of date.
+//
+static EnvMap *envmap_read_cache(const char *cache_path, uint64_t key) {
+    int fd = open(cache_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(EnvMapCacheHeader)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    const EnvMapCacheHeader *header = (const EnvMapCacheHeader *)data;
+    if (memcmp(header->magic, ENVMAP_CACHE_MAGIC, sizeof(ENVMAP_CACHE_MAGIC)) != 0 ||
+        header->version != ENVMAP_CACHE_VERSION || header->key != key ||
+        header->size != size ||
+        size != sizeof(EnvMapCacheHeader) +
+                    envmap_floats(header->width, header->height) * sizeof(float)) {
+        munmap(data, size);
+        return NULL;
+    }
+
+    EnvMap *env = (EnvMap *)calloc(1, sizeof(EnvMap));
+    assert(env != NULL);
+    env->width = header->width;
+    env->height = header->height;
+    env->mapping = data;
+    env->mapping_size = size;
+    envmap_point_into(env, (const float *)(header + 1));
+    return env;
+}
+
+//
+// Writes a decoded environment to its cache, through a temporary file like
+// checkpoints. Returns true on success.
+//
+static bool envmap_write_cache(const char *cache_path, uint64_t key, const EnvMap *env) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Failed to open environment cache %s!\n", tmp_path);
+        return false;
+    }
+
+    size_t floats = envmap_floats(env->width, env->height);
+    EnvMapCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ENVMAP_CACHE_MAGIC, sizeof(ENVMAP_CACHE_MAGIC));
+    header.version = ENVMAP_CACHE_VERSION;
+    header.width = env->width;
+    header.height = env->height;
+    header.key = key;
+    header.size = sizeof(header) + floats * sizeof(float);
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(env->pixels, sizeof(float), floats, file) == floats;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path, cache_path) != 0) {
+        fprintf(stderr, "ERROR: Failed to write environment cache %s!\n", cache_path);
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+//
+// Loads an environment image. With a cache_path, a cache of the decoded image is
+// used when it is up to date, and written out after decoding otherwise. Returns
+// NULL if the image cannot be loaded.
+//
+EnvMap *envmap_load(const char *path, const char *cache_path) {
+    uint64_t key = 0;
+    if (!hash_file(path, ENVMAP_CACHE_VERSION, &key)) {
+        return NULL;
+    }
+    EnvMap *env = cache_path ? envmap_read_cache(cache_path, key) : NULL;
+    if (env == NULL) {
+        env = envmap_decode(path);
+        if (env && cache_path) {
+            envmap_write_cache(cache_path, key, env);
+        }
+    }
+    if (env) {
+        env->hash = key;
+    }
+    return env;
+}
+
+void envmap_delete(EnvMap **env) {
+    if (*env) {
+        if ((*env)->mapping) {
+            munmap((*env)->mapping, (*env)->mapping_size);
+        } else {
+            free((void *)(*env)->pixels);
+        }
+        free(*env);
+        *env = NULL;
+    }
+}
+
+// Finds the texel the environment shows in a given unit direction
+static void envmap_texel(const EnvMap *env, vec3 dir, uint32_t *x, uint32_t *y) {
+    double u = 0.5 + (atan2(dir.x, dir.z) / (2 * M_PI));
+    double v = 0.5 + (asin(dir.y) / M_PI);
+
+    *x = (uint32_t)(u * env->width);
+    *y = (uint32_t)((1.0 - v) * env->height);
+    *x = *x < env->width ? *x : env->width - 1;
+    *y = *y < env->height ? *y : env->height - 1;
+}
+
+//
+// Returns the environment's color in a given unit direction.
+//
+color envmap_lookup(const EnvMap *env, vec3 dir) {
+    uint32_t x, y;
+    envmap_texel(env, dir, &x, &y);
+    const float *p = env->pixels + ((size_t)y * env->width + x) * 3;
+    return v3_init(p[0], p[1], p[2]);
+}
+
+// The density, per unit solid angle, of picking a direction at the given latitude
+// within the texel in column x of row y
+static double texel_pdf(const EnvMap *env, uint32_t x, uint32_t y, double cos_latitude) {
+    const float *row_cdf = env->conditional_cdf + (size_t)y * (env->width + 1);
+    double row_p = env->marginal_cdf[y + 1] - env->marginal_cdf[y];
+    double col_p = row_cdf[x + 1] - row_cdf[x];
+    return cos_latitude > 0 ? row_p * col_p * env->width * env->height /
+                                  (2 * M_PI * M_PI * cos_latitude)
+                            : 0;
+}
+
+// Returns the i for which cdf[i] <= u < cdf[i + 1], among the count intervals
+static uint32_t find_interval(const float *cdf, uint32_t count, double u) {
+    uint32_t low = 0, high = count;
+    while (high - low > 1) {
+        uint32_t mid = (low + high) / 2;
+        if (cdf[mid] <= u) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+//
+// Picks a direction towards the environment with a probability in proportion to the
+// light coming from it, given two uniform random numbers in [0, 1). Stores the
+// density of the pick, per unit solid angle, in pdf.
+//
+vec3 envmap_sample(const EnvMap *env, double u1, double u2, double *pdf) {
+    uint32_t y = find_interval(env->marginal_cdf, env->height, u2);
+    const float *row_cdf = env->conditional_cdf + (size_t)y * (env->width + 1);
+    uint32_t x = find_interval(row_cdf, env->width, u1);
+
+    double row_p = env->marginal_cdf[y + 1] - env->marginal_cdf[y];
+    double col_p = row_cdf[x + 1] - row_cdf[x];
+    double dy = row_p > 0 ? (u2 - env->marginal_cdf[y]) / row_p : 0.5;
+    double dx = col_p > 0 ? (u1 - row_cdf[x]) / col_p : 0.5;
+
+    // Invert the mapping of envmap_lookup()
+    double u = (x + dx) / env->width;
+    double v = 1.0 - (y + dy) / env->height;
+    double phi = (u - 0.5) * 2 * M_PI;
+    double latitude = (v - 0.5) * M_PI;
+    double cos_latitude = cos(latitude);
+
+    *pdf = texel_pdf(env, x, y, cos_latitude);
+    return v3_init(cos_latitude * sin(phi), sin(latitude), cos_latitude * cos(phi));
+}
+
+//
+// Returns the density, per unit solid angle, with which envmap_sample() picks a
+// given unit direction.
+//
+double envmap_pdf(const EnvMap *env, vec3 dir) {
+    uint32_t x, y;
+    envmap_texel(env, dir, &x, &y);
+    return texel_pdf(env, x, y, sqrt(fmax(0, 1 - dir.y * dir.y)));
+}
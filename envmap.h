@@ -0,0 +1,28 @@
+#pragma once
+
+#include "vec3.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// An equirectangular environment image, decoded to linear RGB, along with the tables
+// for picking directions in proportion to how much light comes from them.
+typedef struct {
+    uint32_t width, height;
+    const float *pixels;          // width * height linear RGB triples, top row first
+    const float *marginal_cdf;    // height + 1 entries, over the rows
+    const float *conditional_cdf; // height rows of width + 1 entries, over each row
+    void *mapping;                // Cache file the arrays point into, NULL if decoded
+    size_t mapping_size;
+    uint64_t hash; // Of the image file's contents, which tells environments apart
+} EnvMap;
+
+EnvMap *envmap_load(const char *path, const char *cache_path);
+
+void envmap_delete(EnvMap **env);
+
+color envmap_lookup(const EnvMap *env, vec3 dir);
+
+vec3 envmap_sample(const EnvMap *env, double u1, double u2, double *pdf);
+
+double envmap_pdf(const EnvMap *env, vec3 dir);
@@ -0,0 +1,100 @@
+#include "framebuffer.h"
+#include "color.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+// Number of pixels resolved per block in fb_resolve()
+#define RESOLVE_BLOCK 64
+
+//
+// Creates a zeroed framebuffer of the given dimensions.
+//
+Framebuffer *fb_create(uint32_t width, uint32_t height) {
+    Framebuffer *fb = (Framebuffer *)malloc(sizeof(Framebuffer));
+    assert(fb != NULL);
+
+    fb->width = width;
+    fb->height = height;
+    fb->accum = (float *)calloc((size_t)width * height * 3, sizeof(float));
+    assert(fb->accum != NULL);
+    fb->samples = (uint32_t *)calloc((size_t)width * height, sizeof(uint32_t));
+    assert(fb->samples != NULL);
+
+    return fb;
+}
+
+//
+// Deallocates framebuffer memory.
+//
+void fb_delete(Framebuffer **fb) {
+    if (*fb) {
+        free((*fb)->accum);
+        free((*fb)->samples);
+        free(*fb);
+        *fb = NULL;
+    }
+    return;
+}
+
+//
+// Adds the sum of count samples to a pixel. A pixel must only ever be written by one
+// thread at a time.
+//
+void fb_add_samples(Framebuffer *fb, uint32_t pixel, color sum, uint32_t count) {
+    float *p = &fb->accum[(size_t)pixel * 3];
+    p[0] += (float)sum.x;
+    p[1] += (float)sum.y;
+    p[2] += (float)sum.z;
+    fb->samples[pixel] += count;
+}
+
+//
+// Returns the lowest sample count of any pixel in the framebuffer.
+//
+uint32_t fb_min_samples(const Framebuffer *fb) {
+    size_t pixel_count = (size_t)fb->width * fb->height;
+    uint32_t min = UINT32_MAX;
+    for (size_t i = 0; i < pixel_count; i++) {
+        min = fb->samples[i] < min ? fb->samples[i] : min;
+    }
+    return pixel_count ? min : 0;
+}
+
+//
+// Returns the average number of samples taken per pixel.
+//
+double fb_mean_samples(const Framebuffer *fb) {
+    size_t pixel_count = (size_t)fb->width * fb->height;
+    uint64_t total = 0;
+    for (size_t i = 0; i < pixel_count; i++) {
+        total += fb->samples[i];
+    }
+    return pixel_count ? (double)total / (double)pixel_count : 0.0;
+}
+
+//
+// Post-process pass: averages the accumulated samples, applies exposure and converts
+// the whole frame to 8-bit sRGB. Pixels are processed in blocks so that the scaling
+// and tone mapping loops run over flat float arrays the compiler can vectorize.
+//
+void fb_resolve(const Framebuffer *fb, uint8_t *image, double exposure) {
+    size_t pixel_count = (size_t)fb->width * fb->height;
+    float block[RESOLVE_BLOCK * 3];
+
+    for (size_t start = 0; start < pixel_count; start += RESOLVE_BLOCK) {
+        size_t n = pixel_count - start < RESOLVE_BLOCK ? pixel_count - start
+                                                       : RESOLVE_BLOCK;
+        const float *accum = &fb->accum[start * 3];
+        const uint32_t *samples = &fb->samples[start];
+
+        for (size_t i = 0; i < n; i++) {
+            float scale = samples[i] ? (float)exposure / (float)samples[i] : 0.0f;
+            block[i * 3] = accum[i * 3] * scale;
+            block[i * 3 + 1] = accum[i * 3 + 1] * scale;
+            block[i * 3 + 2] = accum[i * 3 + 2] * scale;
+        }
+
+        tonemap_block(block, &image[start * 3], n * 3);
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "vec3.h"
+
+#include <stdint.h>
+
+// Linear HDR accumulation buffer. Workers add the radiance of their samples to
+// accum and bump the pixel's sample count; turning that into a displayable image is
+// a separate pass over the whole frame (fb_resolve), so the render threads never
+// touch the transfer curves and the HDR data is kept around.
+typedef struct {
+    uint32_t width, height;
+    float *accum;      // Sum of all samples, 3 floats (linear RGB) per pixel
+    uint32_t *samples; // Number of samples accumulated per pixel
+} Framebuffer;
+
+Framebuffer *fb_create(uint32_t width, uint32_t height);
+
+void fb_delete(Framebuffer **fb);
+
+void fb_add_samples(Framebuffer *fb, uint32_t pixel, color sum, uint32_t count);
+
+uint32_t fb_min_samples(const Framebuffer *fb);
+
+double fb_mean_samples(const Framebuffer *fb);
+
+void fb_resolve(const Framebuffer *fb, uint8_t *image, double exposure);
@@ -1,4 +1,7 @@
 #include "hittable.h"
+#include "instance.h"
+#include "mesh.h"
+#include "plane.h"
 #include "sphere.h"
 
 #include <assert.h>
@@ -26,6 +29,15 @@ void hittable_delete(Hittable **hittable) {
         if ((*hittable)->type == SPHERE) {
             Sphere *s = (Sphere *)(*hittable)->object;
             sphere_delete(&s);
+        } else if ((*hittable)->type == MESH) {
+            Mesh *mesh = (Mesh *)(*hittable)->object;
+            mesh_delete(&mesh);
+        } else if ((*hittable)->type == INSTANCE) {
+            Instance *instance = (Instance *)(*hittable)->object;
+            instance_delete(&instance);
+        } else {
+            // The other shapes own nothing besides themselves
+            free((*hittable)->object);
         }
         free(*hittable);
         *hittable = NULL;
@@ -33,12 +45,65 @@ void hittable_delete(Hittable **hittable) {
     return;
 }
 
+//
+// Deep copies a hittable and the object it wraps. The material is shared, and so is
+// the group of an instance.
+//
+Hittable *hittable_clone(Hittable *h) {
+    void *object = NULL;
+    switch (h->type) {
+    case SPHERE: {
+        Sphere *s = (Sphere *)h->object;
+        object = sphere_create(s->center, s->radius, s->material);
+        break;
+    }
+    case PLANE: {
+        Plane *p = (Plane *)h->object;
+        object = plane_create(p->point, p->normal, p->material);
+        break;
+    }
+    case RECT: {
+        Rect *rect = (Rect *)h->object;
+        object = rect_create(rect->axis, rect->k, rect->u0, rect->u1, rect->v0, rect->v1,
+                             rect->material);
+        break;
+    }
+    case DISK: {
+        Disk *d = (Disk *)h->object;
+        object = disk_create(d->center, d->radius, d->axis, d->material);
+        break;
+    }
+    case MESH:
+        object = mesh_clone((Mesh *)h->object);
+        break;
+    case INSTANCE:
+        object = instance_clone((Instance *)h->object);
+        break;
+    }
+    return hittable_create(object, h->type);
+}
+
 bool hittable_intersect(Hittable h, ray r, double t_min, double t_max, HitRecord *rec) {
     bool hit = false;
     switch (h.type) {
     case SPHERE:
         hit = sphere_intersect(*((Sphere *)(h.object)), r, t_min, t_max, rec);
         break;
+    case PLANE:
+        hit = plane_intersect(*((Plane *)(h.object)), r, t_min, t_max, rec);
+        break;
+    case RECT:
+        hit = rect_intersect(*((Rect *)(h.object)), r, t_min, t_max, rec);
+        break;
+    case DISK:
+        hit = disk_intersect(*((Disk *)(h.object)), r, t_min, t_max, rec);
+        break;
+    case MESH:
+        hit = mesh_intersect((Mesh *)h.object, r, t_min, t_max, rec);
+        break;
+    case INSTANCE:
+        hit = instance_intersect((Instance *)h.object, r, t_min, t_max, rec);
+        break;
     default:
         fprintf(stderr,
                 "ERROR: Unknown object type encountered in hittable_intersect()!\n");
@@ -51,13 +116,23 @@ bool hittable_intersect(Hittable h, ray r, double t_min, double t_max, HitRecord
 
 //
 // Constructs a bounding box for a hittable, passed back through the AABB pointer
-// output_box. True is returned because the object has a definable bounding box.
+// output_box. Returns false for unbounded objects (planes), which have none.
 //
 bool hittable_bounding_box(Hittable h, AABB *output_box) {
     switch (h.type) {
         case SPHERE:
             return sphere_bounding_box(*((Sphere *)(h.object)), output_box);
             break;
+        case PLANE:
+            return false;
+        case RECT:
+            return rect_bounding_box(*((Rect *)(h.object)), output_box);
+        case DISK:
+            return disk_bounding_box(*((Disk *)(h.object)), output_box);
+        case MESH:
+            return mesh_bounding_box((Mesh *)h.object, output_box);
+        case INSTANCE:
+            return instance_bounding_box((Instance *)h.object, output_box);
         default:
             fprintf(stderr,
                     "ERROR: Invalid hittable type encountered in hittable_bounding_box()\n");
@@ -75,6 +150,21 @@ void hittable_print(Hittable *h) {
         case SPHERE:
             sphere_print((Sphere *)h->object);
             break;
+        case PLANE:
+            plane_print((Plane *)h->object);
+            break;
+        case RECT:
+            rect_print((Rect *)h->object);
+            break;
+        case DISK:
+            disk_print((Disk *)h->object);
+            break;
+        case MESH:
+            mesh_print((Mesh *)h->object);
+            break;
+        case INSTANCE:
+            instance_print((Instance *)h->object);
+            break;
         default:
             fprintf(stderr,
                     "ERRROR: Unknown object type encountered in hittable_print()!\n");
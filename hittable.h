@@ -3,7 +3,7 @@
 #include "aabb.h"
 #include "hit.h"
 
-enum HittableType { SPHERE };
+enum HittableType { SPHERE, PLANE, RECT, DISK, MESH, INSTANCE };
 typedef enum HittableType HittableType;
 
 typedef struct Hittable Hittable;
@@ -15,6 +15,8 @@ struct Hittable {
 
 Hittable *hittable_create(void *object, HittableType type);
 
+Hittable *hittable_clone(Hittable *h);
+
 bool hittable_intersect(Hittable h, ray r, double t_min, double t_max, HitRecord *rec);
 
 bool hittable_bounding_box(Hittable h, AABB *output_box);
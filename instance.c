@@ -0,0 +1,155 @@
+//
+// Instanced geometry. A group is built once, with a BVH of its own, and placed into a
+// scene any number of times by instances, each with a transform and optionally a
+// material of its own. The scene's BVH holds the instances, and the group's BVH their
+// contents, so the two make up a two level acceleration structure: traversal goes
+// through the scene's BVH down to an instance, moves the ray into the group's space
+// and continues through the group's BVH.
+//
+// The ray's direction is transformed without normalizing it, so that the distance t
+// along it is the same in both spaces and hits compare directly with those of other
+// objects.
+//
+
+#include "instance.h"
+#include "hittable.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+//
+// Constructor for a group. The group takes ownership of the scene and its BVH, which
+// may be NULL. Returns NULL if the scene holds no objects or unbounded ones.
+//
+Group *group_create(Scene *scene, BVHNode *bvh) {
+    if (scene->object_count == 0 || scene->unbounded_count > 0) {
+        fprintf(stderr, "ERROR: A group needs objects, and only bounded ones!\n");
+        return NULL;
+    }
+
+    Group *group = (Group *)malloc(sizeof(Group));
+    assert(group != NULL);
+    group->scene = scene;
+    group->bvh = bvh;
+    hittable_bounding_box(*scene->objects[0], &group->box);
+    for (uint32_t i = 1; i < scene->object_count; i++) {
+        AABB box;
+        hittable_bounding_box(*scene->objects[i], &box);
+        group->box = surrounding_box(group->box, box);
+    }
+    group->hash = scene_hash(scene);
+    atomic_init(&group->references, 1);
+    return group;
+}
+
+//
+// Adds a reference to a group, which then lives until it is released once more.
+//
+Group *group_retain(Group *group) {
+    atomic_fetch_add(&group->references, 1);
+    return group;
+}
+
+//
+// Drops a reference to a group, and frees it along with its scene and BVH if it was
+// the last one.
+//
+void group_release(Group **group) {
+    if (*group) {
+        if (atomic_fetch_sub(&(*group)->references, 1) == 1) {
+            bvh_delete(&(*group)->bvh);
+            scene_delete(&(*group)->scene);
+            free(*group);
+        }
+        *group = NULL;
+    }
+}
+
+//
+// Constructor for an instance of a group, which takes a reference to it. Returns NULL
+// if the transform cannot be inverted.
+//
+Instance *instance_create(Group *group, Transform to_world, Material *material) {
+    Transform to_object;
+    if (!transform_invert(to_world, &to_object)) {
+        fprintf(stderr, "ERROR: Instance transform is not invertible!\n");
+        return NULL;
+    }
+
+    Instance *instance = (Instance *)malloc(sizeof(Instance));
+    assert(instance != NULL);
+    instance->group = group_retain(group);
+    instance->to_world = to_world;
+    instance->to_object = to_object;
+    instance->box = transform_box(&to_world, group->box);
+    instance->material = material;
+    return instance;
+}
+
+//
+// Copies an instance. The copy shares the group.
+//
+Instance *instance_clone(const Instance *instance) {
+    Instance *copy = (Instance *)malloc(sizeof(Instance));
+    assert(copy != NULL);
+    *copy = *instance;
+    group_retain(copy->group);
+    return copy;
+}
+
+//
+// Destructor for an instance. Releases its reference to the group.
+//
+void instance_delete(Instance **instance) {
+    if (*instance) {
+        group_release(&(*instance)->group);
+        free(*instance);
+        *instance = NULL;
+    }
+}
+
+//
+// Intersects a ray with an instance: with the group's objects, in the group's space.
+// The hit point and normal are moved back into the scene's space.
+//
+bool instance_intersect(const Instance *instance, ray r, double t_min, double t_max,
+                        HitRecord *rec) {
+    const Group *group = instance->group;
+    ray local = transform_ray(&instance->to_object, r);
+    HitRecord local_rec;
+    bool hit;
+    if (group->bvh) {
+        local_rec.t = INFINITY;
+        hit = bvh_hit(group->bvh, local, t_min, t_max, &local_rec);
+    } else {
+        hit = scene_intersect(group->scene, local, t_min, t_max, &local_rec);
+    }
+    if (!hit) {
+        return false;
+    }
+
+    // The normal already faces against the local ray, and so against r, as normals
+    // transform with the inverse transpose
+    *rec = local_rec;
+    rec->p = ray_at(r, local_rec.t);
+    vec3 normal = transform_normal(&instance->to_object, local_rec.normal);
+    rec->normal = v3_unit_vector(normal);
+    if (instance->material) {
+        rec->material = instance->material;
+    }
+    return true;
+}
+
+bool instance_bounding_box(const Instance *instance, AABB *output_box) {
+    *output_box = instance->box;
+    return true;
+}
+
+void instance_print(const Instance *instance) {
+    if (instance) {
+        printf("Instance -> group of %u objects\n", instance->group->scene->object_count);
+        aabb_print(instance->box);
+    }
+}
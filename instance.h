@@ -0,0 +1,52 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hit.h"
+#include "material.h"
+#include "ray.h"
+#include "scene.h"
+#include "transform.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// A scene of objects, with the BVH over them, that instances place into other scenes.
+// A group is shared by every instance of it, and freed with the last one. Its objects
+// have to be bounded, as the group's box is the box of its instances.
+typedef struct {
+    Scene *scene;
+    BVHNode *bvh; // NULL to test the objects one by one
+    AABB box;
+    uint64_t hash; // scene_hash() of the group's scene
+    atomic_uint references;
+} Group;
+
+// A group placed into a scene by a transform. Rays are moved into the group's space
+// instead of the objects into the scene's, so each instance only costs its transforms.
+struct Instance {
+    Group *group;
+    Transform to_world, to_object;
+    AABB box; // The group's box, in the scene's space
+    Material *material; // Replaces the materials of the group's objects, unless NULL
+};
+
+Group *group_create(Scene *scene, BVHNode *bvh);
+
+Group *group_retain(Group *group);
+
+void group_release(Group **group);
+
+Instance *instance_create(Group *group, Transform to_world, Material *material);
+
+Instance *instance_clone(const Instance *instance);
+
+void instance_delete(Instance **instance);
+
+bool instance_intersect(const Instance *instance, ray r, double t_min, double t_max,
+                        HitRecord *rec);
+
+bool instance_bounding_box(const Instance *instance, AABB *output_box);
+
+void instance_print(const Instance *instance);
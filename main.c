@@ -1,281 +1,495 @@
 #include "bvh.h"
 #include "camera.h"
+#include "checkpoint.h"
 #include "color.h"
+#include "config.h"
+#include "cpu.h"
+#include "cost.h"
+#include "envmap.h"
+#include "framebuffer.h"
 #include "hit.h"
 #include "hittable.h"
 #include "material.h"
+#include "output.h"
+#include "placement.h"
 #include "ray.h"
+#include "render.h"
 #include "scene.h"
+#include "scene_cache.h"
+#include "scene_file.h"
 #include "sphere.h"
+#include "stats.h"
+#include "sweep.h"
+#include "trace.h"
 #include "util.h"
 #include "vec3.h"
 
+#include <assert.h>
+#include <getopt.h>
+#include <limits.h>
 #include <math.h>
-#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "include/stb_image/stb_image_write.h"
-
-#define STB_IMAGE_IMPLEMENTATION
-#include "include/stb_image/stb_image.h"
-
-#define MULITHREAD true
-#define BVH true
-#define NUM_THREADS 8
+#define STATS_PATH "render_stats.json" // Written when built with `make STATS=1`
+#define TRACE_PATH "trace.json"        // Written when built with `make TRACE=1`
 
 // TODOS:
 // ----------------------------------------------------------------------------
 // TODO: Deallocate material memory.
 
-unsigned char *skybox;
-int sky_width, sky_height, sky_channels;
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    render_request_stop();
+}
 
 typedef struct {
-    Scene *scene;
-    Camera *cam;
-    BVHNode *bvh;
-    uint32_t image_width, image_height, samples_per_pixel, max_depth;
-    uint8_t *image;
-    uint32_t thread_id;
-} RenderArgs;
+    ImageWriter *out;
+    Framebuffer *band;
+    uint32_t first_row;
+} BandWrite;
 
+//
+// Pool task that writes a finished band to the output image and frees it.
+//
+static void write_band(void *band_write, uint32_t worker) {
+    (void)worker;
+    BandWrite *job = (BandWrite *)band_write;
+    TRACE_BEGIN("write band");
+    output_write_band(job->out, job->band, job->first_row);
+    TRACE_END("write band");
+    fb_delete(&job->band);
+}
 
+typedef struct {
+    const char *path;
+    const char *cache_path; // NULL to always decode
+    EnvMap *env;
+} SkyboxLoad;
 
 //
-// Given a unit vector, return a color.
+// Pool task that loads the skybox, so that decoding it overlaps with the BVH build.
 //
-color get_background_color(vec3 dir) {
-    color col; // Final bg color to return
-
-    int bg_type = 1;
-    switch (bg_type) {
-    case 1: {
-        // Set background to a gradient between two colors
-        double t = 0.5 * (dir.y + 1.0);
-        color start_color = v3_init(1.0, 1.0, 1.0);
-        color end_color = v3_init(0.5, 0.7, 1.0);
-        col = v3_lerp(start_color, end_color, t);
-        break;
-    }
-    case 2: {
-        // Set background to a skybox image
-        // Get uv coords of skybox
-        double u = 0.5 + (atan2(dir.x, dir.z) / (2 * M_PI));
-        double v = 0.5 + (asin(dir.y) / M_PI);
+static void load_skybox(void *skybox_load, uint32_t worker) {
+    (void)worker;
+    SkyboxLoad *load = (SkyboxLoad *)skybox_load;
+    TRACE_BEGIN("skybox load");
+    load->env = envmap_load(load->path, load->cache_path);
+    TRACE_END("skybox load");
+}
 
-        uint32_t x = u * sky_width;
-        uint32_t y = (1.0 - v) * sky_height;
+//
+// Makes sure the skybox loaded, and makes it the one the renderer looks up.
+//
+static void use_skybox(SkyboxLoad *load) {
+    if (load->env == NULL) {
+        fprintf(stderr, "ERROR: Failed to load skybox HDRI image %s!\n", load->path);
+        exit(1);
+    }
+    skybox = load->env;
+    printf("Skybox: %u x %u%s\n", skybox->width, skybox->height,
+           skybox->mapping ? ", from cache" : "");
+}
 
-        uint32_t i = y * sky_width * sky_channels + x * sky_channels;
+// Scene and BVH construction, run as a chain of pool tasks: the scene load adds the
+// BVH build to built, which in turn adds the scene cache write to background.
+typedef struct {
+    Config config; // A copy, main() parses the command line again meanwhile
+    ThreadPool *pool;
+    TaskGroup *built;
+    TaskGroup *background;
+    char cache_path[PATH_MAX]; // Empty for no scene cache
+    uint64_t cache_key;
+    SceneDesc desc;
+    Scene *scene; // NULL if the scene file failed to load
+    BVHNode *bvh;
+    bool bvh_cached;
+    double load_seconds, build_seconds;
+    double optimize_seconds, sah_built, sah_optimized; // With --optimize-bvh
+    uint32_t optimize_rounds;
+} SceneLoad;
 
-        col.x = skybox[i] / (double)255;
-        col.y = skybox[i + 1] / (double)255;
-        col.z = skybox[i + 2] / (double)255;
+//
+// Pool task that writes the scene cache once the BVH is built. Rendering only reads
+// the scene and BVH, so it does not wait for this.
+//
+static void write_scene_cache(void *loader, uint32_t worker) {
+    (void)worker;
+    SceneLoad *load = (SceneLoad *)loader;
+    TRACE_BEGIN("scene cache write");
+    scene_cache_write(load->cache_path, load->cache_key, &load->desc, load->scene,
+                      load->bvh);
+    TRACE_END("scene cache write");
+}
 
-        col = SRGB_to_linear(col);
-        break;
+//
+// Pool task that builds the BVH of a loaded scene, and optimizes it if asked to. The
+// build starts from the seed's random stream on whichever thread runs it, so the tree
+// does not depend on that. The scene cache gets the optimized tree.
+//
+static void build_bvh(void *loader, uint32_t worker) {
+    (void)worker;
+    SceneLoad *load = (SceneLoad *)loader;
+    TRACE_BEGIN("BVH build");
+    double start = now_seconds();
+    random_seed(load->config.seed);
+    load->bvh = bvh_build_with(load->scene, load->config.builder, load->config.leaf_size,
+                               load->pool);
+    load->build_seconds = now_seconds() - start;
+    TRACE_END("BVH build");
+    if (load->config.optimize_bvh && load->bvh) {
+        TRACE_BEGIN("BVH optimize");
+        start = now_seconds();
+        load->sah_built = bvh_sah_cost(load->bvh);
+        load->optimize_rounds = bvh_optimize(load->scene, &load->bvh, load->pool);
+        load->sah_optimized = bvh_sah_cost(load->bvh);
+        load->optimize_seconds = now_seconds() - start;
+        TRACE_END("BVH optimize");
     }
-    default:
-        // Just set bg to black
-        col = v3_init(0, 0, 0);
-        break;
+    if (load->cache_path[0]) {
+        pool_submit(load->pool, load->background, write_scene_cache, load);
     }
-
-    return col;
 }
 
 //
-// Returns the color a given ray is pointing at
+// Pool task that loads the scene, from the scene cache if it is up to date, from the
+// scene file otherwise, or the built-in scene without one. Hands the BVH build on to
+// the pool unless the cache had it.
 //
-color ray_color(Scene *scene, BVHNode *bvh, ray r, uint32_t depth) {
-    HitRecord rec;
-    rec.t = INFINITY;
-
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth == 0) {
-        return v3_init(0, 0, 0);
+static void load_scene(void *loader, uint32_t worker) {
+    (void)worker;
+    SceneLoad *load = (SceneLoad *)loader;
+    const Config *config = &load->config;
+    TRACE_BEGIN("scene load");
+    double start = now_seconds();
+    if (config->scene_path) {
+        // The cache holds a BVH, so it is only of use to a single render with one
+        const char *cache = config->scene_cache_path;
+        if (config->use_bvh && config->sweep_count == 0 && !(cache && cache[0] == '\0')) {
+            if (cache) {
+                snprintf(load->cache_path, sizeof(load->cache_path), "%s", cache);
+            } else {
+                snprintf(load->cache_path, sizeof(load->cache_path), "%s.cache",
+                         config->scene_path);
+            }
+            if (scene_cache_key(config->scene_path, config->leaf_size, config->builder,
+                                config->optimize_bvh, config->seed, &load->cache_key)) {
+                load->scene = scene_cache_read(load->cache_path, load->cache_key,
+                                               &load->desc, &load->bvh);
+                load->bvh_cached = load->bvh != NULL;
+            } else {
+                load->cache_path[0] = '\0';
+            }
+        }
+        if (load->scene == NULL) {
+            // Meshes are cached next to their files unless caching is turned off
+            bool cache_meshes = !(cache && cache[0] == '\0');
+            load->scene = scene_load(config->scene_path, &load->desc, cache_meshes);
+        }
+    } else {
+        memset(&load->desc, 0, sizeof(load->desc));
+        load->scene = two_sphere_scene();
     }
+    load->load_seconds = now_seconds() - start;
+    TRACE_END("scene load");
 
-    // Check if ray hits an object in our scene
-    if (!bvh_hit(bvh, r, 0.001, INFINITY, &rec)) {
-        // If ray hits nothing, return background color
-        vec3 unit_direction = v3_unit_vector(r.dir);
-        return get_background_color(unit_direction);
+    // Sweeps build a BVH of their own for every run
+    if (load->scene && config->use_bvh && config->sweep_count == 0 && load->bvh == NULL) {
+        pool_submit(load->pool, load->built, build_bvh, load);
     }
+}
 
-    ray scattered;
-    color attenuation;
-    color emitted_col = emitted(rec.material, rec.u, rec.v, rec.p);
-
-    if (!scatter(rec.material, r, &rec, &attenuation, &scattered)) {
-        return emitted_col;
+//
+// Hands decoding the skybox to the pool if it is the background. Returns whether it is.
+//
+static bool start_skybox(const Config *config, ThreadPool *pool, TaskGroup *group,
+                         SkyboxLoad *load, char cache_path[PATH_MAX]) {
+    if (config->background != BACKGROUND_SKYBOX) {
+        return false;
     }
-
-    return v3_add(emitted_col,
-                  v3_hadamard(attenuation, ray_color(scene, bvh, scattered, depth - 1)));
+    // The decoded image is cached next to it unless told otherwise
+    if (config->skybox_cache_path) {
+        snprintf(cache_path, PATH_MAX, "%s", config->skybox_cache_path);
+    } else {
+        snprintf(cache_path, PATH_MAX, "%s.cache", config->skybox_path);
+    }
+    *load = (SkyboxLoad){config->skybox_path, cache_path[0] ? cache_path : NULL, NULL};
+    pool_submit(pool, group, load_skybox, load);
+    return true;
 }
 
-void *render(void *thread_args) {
-    RenderArgs *args = (RenderArgs *)thread_args;
+int main(int argc, char **argv) {
+    TRACE_THREAD(0, "main");
 
-    printf("Thread %d start!\n", args->thread_id);
-
-    // Render chunk of image buffer from start_idx to end_idx
-    for (uint32_t i = args->thread_id * 3;
-         i <= args->image_width * args->image_height * 3; i += (NUM_THREADS * 3)) {
-        uint32_t x = (i / 3) % args->image_width;
-        uint32_t y = i / args->image_width / 3;
-
-        // Take multiple samples per pixel
-        color pixel_color = v3_init(0, 0, 0);
-        for (uint32_t s = 0; s < args->samples_per_pixel; s++) {
-            // Map image coordinates to normalized (u, v) coordinates,
-            // offset by random amount for antialiasing
-            double u = (double)(x + random_uniform()) / (args->image_width - 1);
-            double v = 1.0 - ((double)(y + random_uniform()) / (args->image_height - 1));
-
-            // Get view ray from camera to viewport
-            ray view_ray = get_view_ray(args->cam, u, v);
+    Config config;
+    config_defaults(&config);
+    if (!config_parse(&config, argc, argv)) {
+        exit(1);
+    }
 
-            // Accumulate color of what ray is looking at
-            pixel_color = v3_add(pixel_color, ray_color(args->scene, args->bvh, view_ray,
-                                                        args->max_depth));
+    // Use every CPU we may run on unless told otherwise
+    CpuTopology *topology = topology_create();
+    topology_print(topology);
+    uint32_t thread_count = config.thread_count;
+    if (thread_count == 0) {
+        thread_count = topology_thread_count(topology);
+    }
+    printf("Render threads: %u%s%s\n", thread_count,
+           config.pin_threads || config.numa_replicas ? ", pinned" : "",
+           config.numa_replicas ? ", scene replicated per NUMA node" : "");
+
+    // Workers that live for the whole run and take on startup, the render passes and
+    // the band writes. The main thread helps out whenever it waits on them, so it
+    // makes up the last of the render threads.
+    bool pin = config.pin_threads || config.numa_replicas;
+    ThreadPool *pool = pool_create(thread_count - 1, pin ? topology : NULL);
+
+    // Startup runs on the pool as a graph of tasks:
+    //
+    //      scene load --> BVH build --> scene cache write
+    //      skybox decode
+    //
+    // Rendering starts once the scene, its BVH and the skybox are in, while the
+    // scene cache is still being written. Without a scene file the skybox is known
+    // up front and decodes alongside the scene load, otherwise the file may name it,
+    // so it waits for the load.
+    TaskGroup loading = {0}, built = {0}, background = {0};
+    SceneLoad loader = {
+        .config = config, .pool = pool, .built = &built, .background = &background};
+    SkyboxLoad sky_load = {NULL, NULL, NULL};
+    char sky_cache_path[PATH_MAX] = "";
+    bool use_sky = false;
+    if (config.scene_path == NULL) {
+        use_sky = start_skybox(&config, pool, &built, &sky_load, sky_cache_path);
+    }
+    pool_submit(pool, &loading, load_scene, &loader);
+    pool_wait(pool, &loading);
+    Scene *scene = loader.scene;
+    if (scene == NULL) {
+        exit(1);
+    }
+    SceneDesc *desc = &loader.desc;
+
+    if (config.scene_path) {
+        printf("Loaded %s: %u objects in %.3fs%s\n", config.scene_path,
+               scene->object_count + scene->unbounded_count, loader.load_seconds,
+               loader.bvh_cached ? ", BVH from cache" : "");
+
+        // A scene file's settings sit between the defaults and the command line, so
+        // parse the command line again on top of them
+        const char *scene_path = config.scene_path;
+        config_defaults(&config);
+        config_apply_scene(&config, desc);
+        optind = 0;
+        if (!config_parse(&config, argc, argv)) {
+            exit(1);
         }
-        // Write color to final image
-        write_color(args->image, pixel_color, i, args->samples_per_pixel);
+        config.scene_path = scene_path;
+        use_sky = start_skybox(&config, pool, &built, &sky_load, sky_cache_path);
     }
+    config.thread_count = thread_count;
 
-    printf("Thread %d done!\n", args->thread_id);
-
-    return NULL;
-}
-
-int main(void) {
     // Image Settings
-    const double aspect_ratio = 4.0 / 3.0;
-    const uint32_t image_width = 400;
-    const uint32_t image_height = (uint32_t)(image_width / aspect_ratio);
-    // Buffer for storing image data
-    uint8_t *image = (uint8_t *)calloc(image_width * image_height * 3, sizeof(uint8_t));
-    uint32_t samples_per_pixel = 100;
-    uint32_t max_depth = 50;
+    const uint32_t image_width = config.image_width;
+    const uint32_t image_height = config.image_height;
+    const double aspect_ratio = (double)image_width / image_height;
+    uint32_t max_depth = config.max_depth;
 
     // Camera settings
     vec3 vup = v3_init(0, 1, 0);
     vec3 look_from = v3_init(0, 0, 5);
     vec3 look_at = v3_init(0, 0, 0);
-    double dist_to_focus = v3_length(v3_sub(look_from, look_at));
     double aperture = 0.05;
     double vfov = 40;
+    double dist_to_focus = 0;
+    if (desc->has_camera) {
+        vup = desc->vup;
+        look_from = desc->look_from;
+        look_at = desc->look_at;
+        aperture = desc->aperture;
+        vfov = desc->vfov;
+        dist_to_focus = desc->focus_dist;
+    }
+    if (dist_to_focus <= 0) {
+        dist_to_focus = v3_length(v3_sub(look_from, look_at));
+    }
     Camera *cam =
         cam_create(vup, look_from, look_at, aspect_ratio, vfov, aperture, dist_to_focus);
 
-    // Scene settings
-    Scene *scene = scene_create();
+    // Finish the current pixel and flush what we have on SIGINT/SIGTERM
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // Wait for the BVH and the skybox
+    TRACE_BEGIN("wait for startup");
+    pool_wait(pool, &built);
+    TRACE_END("wait for startup");
+    BVHNode *bvh = loader.bvh;
+    if (bvh && !loader.bvh_cached) {
+        printf("Built BVH in %.3fs\n", loader.build_seconds);
+        if (config.optimize_bvh) {
+            printf("Optimized BVH in %.3fs, %u passes: SAH cost %.2f -> %.2f\n",
+                   loader.optimize_seconds, loader.optimize_rounds, loader.sah_built,
+                   loader.sah_optimized);
+        }
+    }
+    if (use_sky) {
+        use_skybox(&sky_load);
+    }
 
-    Material *red_metal = create_metal(v3_init(8.0, 0.1, 0.1), 0.1);
-    Material *white_diffuse = create_lambertian(v3_init(0.73, 0.73, 0.73));
-    Material *green = create_lambertian(v3_init(0.12, 0.45, 0.15));
-    Material *light = create_diffuse_light(v3_init(15, 15, 15));
+    if (config.sweep_count > 0) {
+        // Sweeps create their own pool for every run
+        pool_delete(&pool);
+        sweep_run(&config, scene, cam, topology);
+        envmap_delete(&skybox);
+        scene_delete(&scene);
+        cam_delete(&cam);
+        topology_delete(&topology);
+        return 0;
+    }
 
-    scene_add_sphere(scene, 0, 0, 0, 1, red_metal);
-    scene_add_sphere(scene, 0, -1001, 0, 1000, white_diffuse);
+    Placement *placement = NULL;
+    if (config.numa_replicas) {
+        TRACE_BEGIN("NUMA replicas");
+        placement = placement_create(topology, scene, bvh);
+        TRACE_END("NUMA replicas");
+    }
 
-    // Load skybox asset
-    skybox = stbi_load("assets/parched_canal_4k.hdr", &sky_width, &sky_height,
-                       &sky_channels, 0);
-    printf("Skybox: %d x %d, channels = %d\n", sky_width, sky_height, sky_channels);
-    if (skybox == NULL) {
-        fprintf(stderr, "ERROR: Failed to load skybox HDRI image!\n");
+    RenderArgs args = {.scene = scene,
+                       .cam = cam,
+                       .bvh = bvh,
+                       .background = config.background,
+                       .image_width = image_width,
+                       .image_height = image_height,
+                       .max_depth = max_depth,
+                       .seed = config.seed,
+                       .pool = pool,
+                       .placement = placement,
+                       .cost_metric = config.cost_metric};
+
+    // Per-pixel cost of this run. A resumed render only counts the samples taken since.
+    if (config.cost_metric != COST_NONE) {
+        if (config.cost_metric == COST_WORK && !RENDER_STATS) {
+            fprintf(stderr, "ERROR: --cost work needs the render statistics, build with "
+                            "`make STATS=1`!\n");
+            exit(1);
+        }
+        args.cost = (float *)calloc((size_t)image_width * image_height, sizeof(float));
+        assert(args.cost != NULL);
+    }
+
+    // Open the output image, the format follows from the extension (.png/.pfm/.exr)
+    ImageWriter *out =
+        output_open(config.output_path, image_width, image_height, config.exposure);
+    if (out == NULL) {
         exit(1);
     }
 
-    // Construct BVH
-    BVHNode *bvh = NULL;
-    bvh = bvh_create(scene, 0, scene->object_count - 1);
-
-    if (MULITHREAD) {
-        // Thread setup
-        pthread_t threads[NUM_THREADS];
-        RenderArgs thread_args[NUM_THREADS];
-
-        // Initialize thread creation arguments for each thread
-        for (int thread = 0; thread < NUM_THREADS; thread++) {
-            thread_args[thread].bvh = bvh;
-            thread_args[thread].cam = cam;
-            thread_args[thread].scene = scene;
-            thread_args[thread].image_width = image_width;
-            thread_args[thread].image_height = image_height;
-            thread_args[thread].samples_per_pixel = samples_per_pixel;
-            thread_args[thread].max_depth = max_depth;
-            thread_args[thread].image = image;
-            thread_args[thread].thread_id = thread;
+    double render_start = now_seconds();
+    TRACE_BEGIN("render");
+    if (config.band_height == 0) {
+        // Linear HDR buffer the render threads accumulate samples into
+        Framebuffer *fb = fb_create(image_width, image_height);
+        args.fb = fb;
+
+        // Resume from the checkpoint of an interrupted run of this exact render, if any.
+        uint64_t render_key = scene_hash(scene);
+        render_key = hash_bytes(cam, sizeof(Camera), render_key);
+        render_key = hash_bytes(&max_depth, sizeof(max_depth), render_key);
+        render_key = hash_bytes(&config.background, sizeof(config.background), render_key);
+        if (config.background == BACKGROUND_SKYBOX) {
+            // Samples lit by another environment image must not be averaged in
+            render_key = hash_bytes(&skybox->hash, sizeof(skybox->hash), render_key);
         }
-
-        // Spawn each thread
-        for (int thread = 0; thread < NUM_THREADS; thread++) {
-            int rc = pthread_create(&threads[thread], NULL, render,
-                                    (void *)&thread_args[thread]);
-            if (rc) {
-                fprintf(stderr, "ERROR: Return code from pthread_create() is %d\n", rc);
-                exit(1);
-            }
+        if (config.checkpoint_path &&
+            checkpoint_read(config.checkpoint_path, fb, config.seed, render_key)) {
+            printf("Resuming from checkpoint %s\n", config.checkpoint_path);
         }
 
-        // Join threads
-        for (int thread = 0; thread < NUM_THREADS; thread++) {
-            pthread_join(threads[thread], NULL);
-        }
+        render_progressive(&args, config.samples_per_pixel, config.time_budget,
+                           config.checkpoint_path, render_key, true);
 
+        printf("Rendered for %.2f s, %u spp minimum, %.2f spp average%s\n",
+               now_seconds() - render_start, fb_min_samples(fb), fb_mean_samples(fb),
+               fb_min_samples(fb) == 0 && !render_stop_requested()
+                   ? " (time budget ran out before every pixel got a sample)"
+                   : "");
+
+        TRACE_END("render");
+        TRACE_BEGIN("write image");
+        output_write_band(out, fb, 0);
+        TRACE_END("write image");
+        fb_delete(&fb);
     } else {
-        // Iterate over each pixel in the image
-        for (uint32_t y = 0; y < image_height; y++) {
-            // Print progress
-            if (y % 50 == 0) {
-                printf("Rows remaining: %d\n", image_height - y);
-            }
-            for (uint32_t x = 0; x < image_width; x++) {
-                // Get index into buffer from x and y coordinates
-                uint32_t i = y * image_width * 3 + x * 3;
-
-                // Take multiple samples per pixel
-                color pixel_color = v3_init(0, 0, 0);
-                for (uint32_t s = 0; s < samples_per_pixel; s++) {
-                    // Map image coordinates to normalized (u, v) coordinates,
-                    // offset by random amount for antialiasing
-                    double u = (double)(x + random_uniform()) / (image_width - 1);
-                    double v =
-                        1.0 - ((double)(y + random_uniform()) / (image_height - 1));
-
-                    // Get view ray from camera to viewport
-                    ray view_ray = get_view_ray(cam, u, v);
-
-                    // Accumulate color of what ray is looking at
-                    pixel_color =
-                        v3_add(pixel_color, ray_color(scene, bvh, view_ray, max_depth));
-                }
-                // Write color to final image
-                write_color(image, pixel_color, i, samples_per_pixel);
-            }
+        // Render the image one band of rows at a time and hand each finished band to the
+        // pool as a write job, which streams it out while the next band renders. Only
+        // two bands are ever held in memory. An interrupted render still writes every
+        // band, the ones that were never started simply come out black.
+        const uint32_t band_height = config.band_height;
+        BandWrite job;
+        TaskGroup writing = {0};
+        for (uint32_t y = 0; y < image_height; y += band_height) {
+            uint32_t rows = image_height - y < band_height ? image_height - y : band_height;
+            args.fb = fb_create(image_width, rows);
+            args.row_offset = y;
+            render_progressive(&args, config.samples_per_pixel, 0, NULL, 0, false);
+            printf("Rows %u-%u done\n", y, y + rows - 1);
+
+            // Bands go out in order, so the previous write has to be done first
+            pool_wait(pool, &writing);
+            job = (BandWrite){out, args.fb, y};
+            pool_submit(pool, &writing, write_band, &job);
         }
+        pool_wait(pool, &writing);
+        TRACE_END("render");
+
+        printf("Rendered for %.2f s\n", now_seconds() - render_start);
     }
 
-    // Write contents of image buffer out to PNG
-    char *image_name = "out.png";
-    if ((stbi_write_png(image_name, image_width, image_height, 3, image,
-                        image_width * 3)) == 0) {
+    TRACE_BEGIN("close image");
+    if (!output_close(&out)) {
         fprintf(stderr, "Failed to write image out to file\n");
         exit(1);
     }
+    TRACE_END("close image");
+
+    if (args.cost) {
+        cost_write_heatmap(config.cost_path, args.cost, image_width, image_height);
+        free(args.cost);
+    }
+
+#if RENDER_STATS
+    RenderStats stats;
+    stats_collect(&stats);
+    stats_print(&stats);
+    if (!stats_write_json(STATS_PATH, &stats)) {
+        fprintf(stderr, "ERROR: Failed to write render statistics!\n");
+    }
+#endif
+
+#if RENDER_TRACE
+    if (!trace_write(TRACE_PATH)) {
+        fprintf(stderr, "ERROR: Failed to write trace!\n");
+    }
+#endif
 
     // Free allocated memory
-    free(image);
+    pool_wait(pool, &background);
+    pool_delete(&pool);
+    placement_delete(&placement);
+    topology_delete(&topology);
+    bvh_delete(&bvh);
     scene_delete(&scene);
     cam_delete(&cam);
+    envmap_delete(&skybox);
 
     return 0;
 }
@@ -229,3 +229,74 @@ color emitted(Material *mat, double u, double v, vec3 p) {
     }
     return col;
 }
+
+//
+// Folds the type and parameters of a material into a running hash.
+//
+uint64_t mat_hash(Material *mat, uint64_t hash) {
+    hash = hash_bytes(&mat->type, sizeof(mat->type), hash);
+    switch (mat->type) {
+    case LAMBERTIAN:
+        hash = hash_bytes(mat->material, sizeof(Lambertian), hash);
+        break;
+    case METAL:
+        hash = hash_bytes(mat->material, sizeof(Metal), hash);
+        break;
+    case DIELECTRIC:
+        hash = hash_bytes(mat->material, sizeof(Dielectric), hash);
+        break;
+    case DIFFUSE_LIGHT:
+        hash = hash_bytes(mat->material, sizeof(DiffuseLight), hash);
+        break;
+    }
+    return hash;
+}
+
+//
+// Flattens a material into its type and up to MAT_PARAM_COUNT numbers, so it can be
+// written to a file and recreated by mat_from_params(). Returns the type.
+//
+uint32_t mat_params(Material *mat, double params[MAT_PARAM_COUNT]) {
+    for (uint32_t i = 0; i < MAT_PARAM_COUNT; i++) {
+        params[i] = 0;
+    }
+    color c = v3_init(0, 0, 0);
+    switch (mat->type) {
+    case LAMBERTIAN:
+        c = ((Lambertian *)mat->material)->albedo;
+        break;
+    case METAL:
+        c = ((Metal *)mat->material)->albedo;
+        params[3] = ((Metal *)mat->material)->fuzz;
+        break;
+    case DIELECTRIC:
+        params[3] = ((Dielectric *)mat->material)->index_of_refraction;
+        break;
+    case DIFFUSE_LIGHT:
+        c = ((DiffuseLight *)mat->material)->emittted;
+        break;
+    }
+    params[0] = c.x;
+    params[1] = c.y;
+    params[2] = c.z;
+    return (uint32_t)mat->type;
+}
+
+//
+// Recreates a material flattened by mat_params(). Returns NULL for an unknown type.
+//
+Material *mat_from_params(uint32_t type, const double params[MAT_PARAM_COUNT]) {
+    color c = v3_init(params[0], params[1], params[2]);
+    switch (type) {
+    case LAMBERTIAN:
+        return create_lambertian(c);
+    case METAL:
+        return create_metal(c, params[3]);
+    case DIELECTRIC:
+        return create_dielectric(params[3]);
+    case DIFFUSE_LIGHT:
+        return create_diffuse_light(c);
+    default:
+        return NULL;
+    }
+}
@@ -5,6 +5,7 @@
 #include "vec3.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct Material Material;
 
@@ -22,3 +23,11 @@ bool scatter(Material *mat, ray ray_in, HitRecord *rec, color *attenuation,
              ray *ray_scattered);
 
 color emitted(Material *, double u, double v, vec3 p);
+
+uint64_t mat_hash(Material *mat, uint64_t hash);
+
+#define MAT_PARAM_COUNT 4
+
+uint32_t mat_params(Material *mat, double params[MAT_PARAM_COUNT]);
+
+Material *mat_from_params(uint32_t type, const double params[MAT_PARAM_COUNT]);
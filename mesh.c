@@ -0,0 +1,683 @@
+#include "mesh.h"
+#include "obj.h"
+#include "stats.h"
+#include "util.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Loading a large OBJ and building its BVH takes seconds, so the result is kept in a
+// cache file next to it and memory mapped on later runs, like the skybox. The cache
+// is keyed by a hash of the OBJ file's contents.
+//
+// Layout (native endianness):
+//      MeshCacheHeader
+//      MeshNode     nodes[node_count]
+//      float        positions[vertex_count * 3]
+//      float        normals[vertex_count * 3], if has_normals
+//      float        uvs[vertex_count * 2], if has_uvs
+//      MeshTriangle triangles[triangle_count]
+
+#define MESH_CACHE_MAGIC "PTMESH"
+#define MESH_CACHE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t vertex_count, triangle_count, node_count;
+    uint32_t has_normals, has_uvs;
+    uint64_t key;
+    uint64_t size; // Of the whole file, so a truncated cache is caught
+} MeshCacheHeader;
+
+#define MESH_SAH_BINS 16
+#define MESH_BOX_PADDING 1e-4
+#define MESH_SLAB_SCALE (1 + 4 * DBL_EPSILON)
+
+// A triangle being sorted into the BVH
+typedef struct {
+    AABB box;
+    vec3 centroid; // Of the box
+    uint32_t triangle;
+} BuildRef;
+
+// Scratch space for building a mesh's BVH
+typedef struct {
+    BuildRef *refs; // Partitioned in place as the tree is built
+    MeshNode *nodes;
+    uint32_t node_count;
+} MeshBuild;
+
+//
+// Constructor for a mesh with room for the given number of vertices and triangles,
+// and optionally normals and uvs. It has no BVH until mesh_build() is called.
+//
+Mesh *mesh_create(uint32_t vertex_count, uint32_t triangle_count, bool normals,
+                  bool uvs) {
+    Mesh *mesh = (Mesh *)calloc(1, sizeof(Mesh));
+    assert(mesh != NULL);
+    mesh->vertex_count = vertex_count;
+    mesh->triangle_count = triangle_count;
+    mesh->positions = (float *)malloc(((size_t)vertex_count * 3 + 1) * sizeof(float));
+    mesh->triangles =
+        (MeshTriangle *)malloc(((size_t)triangle_count + 1) * sizeof(MeshTriangle));
+    assert(mesh->positions != NULL && mesh->triangles != NULL);
+    if (normals) {
+        mesh->normals = (float *)malloc(((size_t)vertex_count * 3 + 1) * sizeof(float));
+        assert(mesh->normals != NULL);
+    }
+    if (uvs) {
+        mesh->uvs = (float *)malloc(((size_t)vertex_count * 2 + 1) * sizeof(float));
+        assert(mesh->uvs != NULL);
+    }
+    return mesh;
+}
+
+static vec3 vertex_position(const Mesh *mesh, uint32_t v) {
+    const float *p = mesh->positions + (size_t)v * 3;
+    return v3_init(p[0], p[1], p[2]);
+}
+
+static AABB empty_box(void) {
+    return aabb_init(v3_init(INFINITY, INFINITY, INFINITY),
+                     v3_init(-INFINITY, -INFINITY, -INFINITY));
+}
+
+// Grows a box to take in the box from min to max
+static void grow_box(AABB *box, vec3 min, vec3 max) {
+    box->min.x = min.x < box->min.x ? min.x : box->min.x;
+    box->min.y = min.y < box->min.y ? min.y : box->min.y;
+    box->min.z = min.z < box->min.z ? min.z : box->min.z;
+    box->max.x = max.x > box->max.x ? max.x : box->max.x;
+    box->max.y = max.y > box->max.y ? max.y : box->max.y;
+    box->max.z = max.z > box->max.z ? max.z : box->max.z;
+}
+
+static uint32_t bin_of(const BuildRef *ref, uint32_t axis, double low, double scale) {
+    uint32_t n = (uint32_t)((v3_axis(ref->centroid, axis) - low) * scale);
+    return n < MESH_SAH_BINS ? n : MESH_SAH_BINS - 1;
+}
+
+// Makes nodes[i] a leaf of the count triangles from start on
+static void make_leaf(MeshBuild *b, uint32_t i, uint32_t start, uint32_t count) {
+    b->nodes[i].index = start;
+    b->nodes[i].count = count;
+}
+
+//
+// Builds the subtree over the count triangles of refs from start on, returning the
+// index of its root, given the bounds of the triangles and of their centroids. Splits
+// are picked with the surface area heuristic over MESH_SAH_BINS bins of centroids
+// along the widest axis. A range that does not pay to split becomes a leaf, as long
+// as it holds at most MESH_MAX_LEAF_SIZE triangles; larger ones are split at their
+// median instead.
+//
+static uint32_t build_node(MeshBuild *b, uint32_t start, uint32_t count, uint32_t depth,
+                           AABB box, AABB centroid_box) {
+    uint32_t i = b->node_count++;
+    BuildRef *refs = b->refs + start;
+    b->nodes[i].box = box;
+    if (count <= MESH_LEAF_SIZE || depth == MESH_MAX_DEPTH) {
+        make_leaf(b, i, start, count);
+        return i;
+    }
+
+    vec3 extent = v3_sub(centroid_box.max, centroid_box.min);
+    uint32_t axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2)
+                                        : (extent.y > extent.z ? 1 : 2);
+    double low = v3_axis(centroid_box.min, axis);
+    double width = v3_axis(extent, axis);
+
+    uint32_t left_count = count / 2;
+    AABB child_boxes[2], child_centroids[2];
+    bool bounded = false; // Whether the children's bounds are known
+    if (width > 0) {
+        // Bin the centroids, then sweep the bins from both ends for the cheapest split
+        uint32_t bin_counts[MESH_SAH_BINS] = {0};
+        AABB bin_boxes[MESH_SAH_BINS], bin_centroids[MESH_SAH_BINS];
+        for (uint32_t n = 0; n < MESH_SAH_BINS; n++) {
+            bin_boxes[n] = bin_centroids[n] = empty_box();
+        }
+        double scale = MESH_SAH_BINS / width;
+        for (uint32_t k = 0; k < count; k++) {
+            uint32_t n = bin_of(&refs[k], axis, low, scale);
+            bin_counts[n]++;
+            grow_box(&bin_boxes[n], refs[k].box.min, refs[k].box.max);
+            grow_box(&bin_centroids[n], refs[k].centroid, refs[k].centroid);
+        }
+
+        // The bounds of everything right of each bin boundary, and then left of it
+        double right_cost[MESH_SAH_BINS];
+        AABB right_boxes[MESH_SAH_BINS], right_centroids[MESH_SAH_BINS];
+        AABB right_box = empty_box(), right_centroid = empty_box();
+        uint32_t right_count = 0;
+        for (uint32_t n = MESH_SAH_BINS - 1; n > 0; n--) {
+            grow_box(&right_box, bin_boxes[n].min, bin_boxes[n].max);
+            grow_box(&right_centroid, bin_centroids[n].min, bin_centroids[n].max);
+            right_boxes[n] = right_box;
+            right_centroids[n] = right_centroid;
+            right_count += bin_counts[n];
+            right_cost[n] =
+                right_count ? right_count * aabb_surface_area(right_box) : 0;
+        }
+        AABB left_box = empty_box(), left_centroid = empty_box();
+        uint32_t left = 0, best_bin = 0;
+        double best_cost = INFINITY;
+        for (uint32_t n = 0; n + 1 < MESH_SAH_BINS; n++) {
+            grow_box(&left_box, bin_boxes[n].min, bin_boxes[n].max);
+            grow_box(&left_centroid, bin_centroids[n].min, bin_centroids[n].max);
+            left += bin_counts[n];
+            double cost =
+                (left ? left * aabb_surface_area(left_box) : 0) + right_cost[n + 1];
+            if (left > 0 && left < count && cost < best_cost) {
+                best_cost = cost;
+                best_bin = n;
+                child_boxes[0] = left_box;
+                child_centroids[0] = left_centroid;
+                child_boxes[1] = right_boxes[n + 1];
+                child_centroids[1] = right_centroids[n + 1];
+            }
+        }
+
+        // A traversal step costs about as much as a triangle test
+        double area = aabb_surface_area(box);
+        if (count <= MESH_MAX_LEAF_SIZE &&
+            (best_cost == INFINITY || area + best_cost >= count * area)) {
+            make_leaf(b, i, start, count);
+            return i;
+        }
+        if (best_cost < INFINITY) {
+            // Partition the range around the chosen bin
+            BuildRef *first = refs, *last = refs + count;
+            while (first < last) {
+                if (bin_of(first, axis, low, scale) <= best_bin) {
+                    first++;
+                } else {
+                    BuildRef swap = *first;
+                    *first = *--last;
+                    *last = swap;
+                }
+            }
+            left_count = (uint32_t)(first - refs);
+            bounded = true;
+        }
+    } else if (count <= MESH_MAX_LEAF_SIZE) {
+        // All the centroids coincide, so no split separates them
+        make_leaf(b, i, start, count);
+        return i;
+    }
+
+    if (!bounded) {
+        // Split at the median, in whatever order the triangles are in
+        for (uint32_t c = 0; c < 2; c++) {
+            child_boxes[c] = child_centroids[c] = empty_box();
+            uint32_t end = c ? count : left_count;
+            for (uint32_t k = c ? left_count : 0; k < end; k++) {
+                grow_box(&child_boxes[c], refs[k].box.min, refs[k].box.max);
+                grow_box(&child_centroids[c], refs[k].centroid, refs[k].centroid);
+            }
+        }
+    }
+
+    b->nodes[i].count = 0;
+    build_node(b, start, left_count, depth + 1, child_boxes[0], child_centroids[0]);
+    b->nodes[i].index = build_node(b, start + left_count, count - left_count, depth + 1,
+                                   child_boxes[1], child_centroids[1]);
+    return i;
+}
+
+//
+// Builds the mesh's BVH and reorders its triangles to match the leaves.
+//
+void mesh_build(Mesh *mesh) {
+    assert(mesh->mapping == NULL);
+    uint32_t n = mesh->triangle_count;
+    free(mesh->nodes);
+    mesh->nodes = NULL;
+    mesh->node_count = 0;
+    if (n == 0) {
+        return;
+    }
+
+    AABB box = empty_box(), centroid_box = empty_box();
+    BuildRef *refs = (BuildRef *)malloc((size_t)n * sizeof(BuildRef));
+    MeshNode *nodes = (MeshNode *)malloc((2 * (size_t)n - 1) * sizeof(MeshNode));
+    assert(refs != NULL && nodes != NULL);
+    for (uint32_t t = 0; t < n; t++) {
+        const MeshTriangle *tri = &mesh->triangles[t];
+        vec3 p0 = vertex_position(mesh, tri->v[0]);
+        vec3 p1 = vertex_position(mesh, tri->v[1]);
+        vec3 p2 = vertex_position(mesh, tri->v[2]);
+        refs[t].box = aabb_init(p0, p0);
+        grow_box(&refs[t].box, p1, p1);
+        grow_box(&refs[t].box, p2, p2);
+        refs[t].centroid = v3_scale(v3_add(refs[t].box.min, refs[t].box.max), 0.5);
+        refs[t].triangle = t;
+        grow_box(&box, refs[t].box.min, refs[t].box.max);
+        grow_box(&centroid_box, refs[t].centroid, refs[t].centroid);
+    }
+
+    MeshBuild build = {refs, nodes, 0};
+    build_node(&build, 0, n, 0, box, centroid_box);
+    mesh->node_count = build.node_count;
+    mesh->nodes = (MeshNode *)realloc(nodes, build.node_count * sizeof(MeshNode));
+    assert(mesh->nodes != NULL);
+
+    // Put the triangles in leaf order
+    MeshTriangle *triangles = (MeshTriangle *)malloc((size_t)n * sizeof(MeshTriangle));
+    assert(triangles != NULL);
+    for (uint32_t t = 0; t < n; t++) {
+        triangles[t] = mesh->triangles[refs[t].triangle];
+    }
+    free(mesh->triangles);
+    mesh->triangles = triangles;
+    free(refs);
+}
+
+//
+// Maps a cache written for the given key. Returns NULL if there is none or it is
+// out of date.
+//
+static Mesh *mesh_read_cache(const char *cache_path, uint64_t key) {
+    int fd = open(cache_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MeshCacheHeader)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    unsigned char *data =
+        (unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    const MeshCacheHeader *header = (const MeshCacheHeader *)data;
+    size_t floats_per_vertex =
+        3 + (header->has_normals ? 3 : 0) + (header->has_uvs ? 2 : 0);
+    size_t vertex_floats = (size_t)header->vertex_count * floats_per_vertex;
+    if (memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)) != 0 ||
+        header->version != MESH_CACHE_VERSION || header->key != key ||
+        header->size != size ||
+        size != sizeof(MeshCacheHeader) + header->node_count * sizeof(MeshNode) +
+                    vertex_floats * sizeof(float) +
+                    header->triangle_count * sizeof(MeshTriangle)) {
+        munmap(data, size);
+        return NULL;
+    }
+
+    Mesh *mesh = (Mesh *)calloc(1, sizeof(Mesh));
+    assert(mesh != NULL);
+    mesh->vertex_count = header->vertex_count;
+    mesh->triangle_count = header->triangle_count;
+    mesh->node_count = header->node_count;
+    mesh->mapping = data;
+    mesh->mapping_size = size;
+    mesh->nodes = (MeshNode *)(header + 1);
+    float *floats = (float *)(mesh->nodes + mesh->node_count);
+    mesh->positions = floats;
+    floats += (size_t)mesh->vertex_count * 3;
+    if (header->has_normals) {
+        mesh->normals = floats;
+        floats += (size_t)mesh->vertex_count * 3;
+    }
+    if (header->has_uvs) {
+        mesh->uvs = floats;
+        floats += (size_t)mesh->vertex_count * 2;
+    }
+    mesh->triangles = (MeshTriangle *)floats;
+    return mesh;
+}
+
+//
+// Writes a built mesh to its cache, through a temporary file like checkpoints.
+// Returns true on success.
+//
+static bool mesh_write_cache(const char *cache_path, uint64_t key, const Mesh *mesh) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Failed to open mesh cache %s!\n", tmp_path);
+        return false;
+    }
+
+    size_t v3s = (size_t)mesh->vertex_count * 3, v2s = (size_t)mesh->vertex_count * 2;
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+    header.version = MESH_CACHE_VERSION;
+    header.vertex_count = mesh->vertex_count;
+    header.triangle_count = mesh->triangle_count;
+    header.node_count = mesh->node_count;
+    header.has_normals = mesh->normals != NULL;
+    header.has_uvs = mesh->uvs != NULL;
+    header.key = key;
+    size_t vertex_floats = v3s + (mesh->normals ? v3s : 0) + (mesh->uvs ? v2s : 0);
+    header.size = sizeof(header) + mesh->node_count * sizeof(MeshNode) +
+                  vertex_floats * sizeof(float) +
+                  mesh->triangle_count * sizeof(MeshTriangle);
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(mesh->nodes, sizeof(MeshNode), mesh->node_count, file) ==
+                  mesh->node_count &&
+              fwrite(mesh->positions, sizeof(float), v3s, file) == v3s &&
+              (!mesh->normals ||
+               fwrite(mesh->normals, sizeof(float), v3s, file) == v3s) &&
+              (!mesh->uvs || fwrite(mesh->uvs, sizeof(float), v2s, file) == v2s) &&
+              fwrite(mesh->triangles, sizeof(MeshTriangle), mesh->triangle_count, file) ==
+                  mesh->triangle_count;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path, cache_path) != 0) {
+        fprintf(stderr, "ERROR: Failed to write mesh cache %s!\n", cache_path);
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+//
+// Loads an OBJ file as a mesh of the given material and builds its BVH. With a
+// cache_path, a cache of the built mesh is used when it is up to date, and written
+// out after building otherwise. Returns NULL if the file cannot be loaded.
+//
+Mesh *mesh_load(const char *path, const char *cache_path, Material *material) {
+    uint64_t key = 0;
+    if (cache_path && !hash_file(path, MESH_CACHE_VERSION, &key)) {
+        fprintf(stderr, "ERROR: Failed to open mesh %s!\n", path);
+        return NULL;
+    }
+    Mesh *mesh = cache_path ? mesh_read_cache(cache_path, key) : NULL;
+    if (mesh == NULL) {
+        mesh = obj_load(path);
+        if (mesh == NULL) {
+            return NULL;
+        }
+        mesh_build(mesh);
+        if (cache_path) {
+            mesh_write_cache(cache_path, key, mesh);
+        }
+    }
+    mesh->material = material;
+    return mesh;
+}
+
+//
+// Deep copies a mesh into memory of its own. The material is shared.
+//
+Mesh *mesh_clone(const Mesh *mesh) {
+    Mesh *copy = mesh_create(mesh->vertex_count, mesh->triangle_count,
+                             mesh->normals != NULL, mesh->uvs != NULL);
+    size_t v3s = (size_t)mesh->vertex_count * 3;
+    memcpy(copy->positions, mesh->positions, v3s * sizeof(float));
+    if (mesh->normals) {
+        memcpy(copy->normals, mesh->normals, v3s * sizeof(float));
+    }
+    if (mesh->uvs) {
+        memcpy(copy->uvs, mesh->uvs, (size_t)mesh->vertex_count * 2 * sizeof(float));
+    }
+    memcpy(copy->triangles, mesh->triangles, mesh->triangle_count * sizeof(MeshTriangle));
+    copy->node_count = mesh->node_count;
+    copy->nodes = (MeshNode *)malloc((mesh->node_count + 1) * sizeof(MeshNode));
+    assert(copy->nodes != NULL);
+    memcpy(copy->nodes, mesh->nodes, mesh->node_count * sizeof(MeshNode));
+    copy->material = mesh->material;
+    return copy;
+}
+
+void mesh_delete(Mesh **mesh) {
+    if (*mesh) {
+        if ((*mesh)->mapping) {
+            munmap((*mesh)->mapping, (*mesh)->mapping_size);
+        } else {
+            free((*mesh)->positions);
+            free((*mesh)->normals);
+            free((*mesh)->uvs);
+            free((*mesh)->triangles);
+            free((*mesh)->nodes);
+        }
+        free(*mesh);
+        *mesh = NULL;
+    }
+}
+
+//
+// Slab test of a ray, given the reciprocals of its direction, against a box. Returns
+// the distance the ray enters the box at, or INFINITY if it misses. The exit distance
+// is rounded up a little, so that rounding never culls a hit on the box's surface,
+// which triangles meet at their vertices (Ize, Robust BVH Ray Traversal).
+//
+static double node_entry(const AABB *box, vec3 orig, vec3 inv_dir, double t_min,
+                         double t_max) {
+    double t0 = (box->min.x - orig.x) * inv_dir.x, t1 = (box->max.x - orig.x) * inv_dir.x;
+    t_min = fmax(t_min, fmin(t0, t1));
+    t_max = fmin(t_max, fmax(t0, t1));
+    t0 = (box->min.y - orig.y) * inv_dir.y, t1 = (box->max.y - orig.y) * inv_dir.y;
+    t_min = fmax(t_min, fmin(t0, t1));
+    t_max = fmin(t_max, fmax(t0, t1));
+    t0 = (box->min.z - orig.z) * inv_dir.z, t1 = (box->max.z - orig.z) * inv_dir.z;
+    t_min = fmax(t_min, fmin(t0, t1));
+    t_max = fmin(t_max, fmax(t0, t1));
+    return t_min <= t_max * MESH_SLAB_SCALE ? t_min : INFINITY;
+}
+
+// A ray set up for watertight triangle tests: the axis the direction is largest along
+// becomes z, and a shear takes the direction onto it
+typedef struct {
+    vec3 orig;
+    uint32_t kx, ky, kz;
+    double sx, sy, sz;
+} ShearedRay;
+
+static ShearedRay shear_ray(ray r) {
+    double d[3] = {r.dir.x, r.dir.y, r.dir.z};
+    ShearedRay s;
+    s.orig = r.orig;
+    s.kz = fabs(d[0]) > fabs(d[1]) ? (fabs(d[0]) > fabs(d[2]) ? 0 : 2)
+                                   : (fabs(d[1]) > fabs(d[2]) ? 1 : 2);
+    s.kx = (s.kz + 1) % 3;
+    s.ky = (s.kx + 1) % 3;
+    if (d[s.kz] < 0) {
+        // Keep the winding of the triangles
+        uint32_t swap = s.kx;
+        s.kx = s.ky;
+        s.ky = swap;
+    }
+    s.sx = d[s.kx] / d[s.kz];
+    s.sy = d[s.ky] / d[s.kz];
+    s.sz = 1.0 / d[s.kz];
+    return s;
+}
+
+//
+// Watertight ray-triangle intersection (Woop, Benthin and Wald). The vertices are
+// moved into the space of the sheared ray, where the hit test comes down to the signs
+// of three edge functions. Rays through a shared edge or vertex hit at least one of
+// the triangles around it, and triangles with no area are never hit. On a hit within
+// [t_min, t_max], stores the distance and the barycentric coordinates of the second
+// and third vertices.
+//
+static bool triangle_intersect(const ShearedRay *r, const float *p0, const float *p1,
+                               const float *p2, double t_min, double t_max, double *t,
+                               double *b1, double *b2) {
+    double o[3] = {r->orig.x, r->orig.y, r->orig.z};
+    double a[3] = {p0[0] - o[0], p0[1] - o[1], p0[2] - o[2]};
+    double b[3] = {p1[0] - o[0], p1[1] - o[1], p1[2] - o[2]};
+    double c[3] = {p2[0] - o[0], p2[1] - o[1], p2[2] - o[2]};
+    double ax = a[r->kx] - r->sx * a[r->kz], ay = a[r->ky] - r->sy * a[r->kz];
+    double bx = b[r->kx] - r->sx * b[r->kz], by = b[r->ky] - r->sy * b[r->kz];
+    double cx = c[r->kx] - r->sx * c[r->kz], cy = c[r->ky] - r->sy * c[r->kz];
+
+    double u = cx * by - cy * bx;
+    double v = ax * cy - ay * cx;
+    double w = bx * ay - by * ax;
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) {
+        return false;
+    }
+    double det = u + v + w;
+    if (det == 0) {
+        return false;
+    }
+    double z = u * a[r->kz] + v * b[r->kz] + w * c[r->kz];
+    double root = z * r->sz / det;
+    if (root < t_min || root > t_max) {
+        return false;
+    }
+    *t = root;
+    *b1 = v / det;
+    *b2 = w / det;
+    return true;
+}
+
+// Fills in the hit record for a hit on a triangle
+static void triangle_hit_record(const Mesh *mesh, const MeshTriangle *tri, ray r,
+                                double t, double b1, double b2, HitRecord *rec) {
+    vec3 p0 = vertex_position(mesh, tri->v[0]);
+    vec3 p1 = vertex_position(mesh, tri->v[1]);
+    vec3 p2 = vertex_position(mesh, tri->v[2]);
+    double b0 = 1 - b1 - b2;
+    rec->t = t;
+    rec->p = ray_at(r, t);
+    set_face_normal(rec, r, v3_unit_vector(v3_cross(v3_sub(p1, p0), v3_sub(p2, p0))));
+    if (mesh->normals) {
+        // Interpolate the vertex normals, kept on the side the ray came from
+        const float *n0 = mesh->normals + (size_t)tri->v[0] * 3;
+        const float *n1 = mesh->normals + (size_t)tri->v[1] * 3;
+        const float *n2 = mesh->normals + (size_t)tri->v[2] * 3;
+        vec3 n = v3_init(b0 * n0[0] + b1 * n1[0] + b2 * n2[0],
+                         b0 * n0[1] + b1 * n1[1] + b2 * n2[1],
+                         b0 * n0[2] + b1 * n1[2] + b2 * n2[2]);
+        if (v3_length_squared(n) > 0) {
+            n = v3_unit_vector(n);
+            rec->normal = v3_dot(n, rec->normal) < 0 ? v3_scale(n, -1.0) : n;
+        }
+    }
+    if (mesh->uvs) {
+        const float *uv0 = mesh->uvs + (size_t)tri->v[0] * 2;
+        const float *uv1 = mesh->uvs + (size_t)tri->v[1] * 2;
+        const float *uv2 = mesh->uvs + (size_t)tri->v[2] * 2;
+        rec->u = b0 * uv0[0] + b1 * uv1[0] + b2 * uv2[0];
+        rec->v = b0 * uv0[1] + b1 * uv1[1] + b2 * uv2[1];
+    } else {
+        rec->u = b1;
+        rec->v = b2;
+    }
+    rec->material = mesh->material;
+}
+
+//
+// Intersects a ray with a mesh, walking its BVH front to back with an explicit stack
+// and narrowing t_max to the closest hit so far. Returns true if a hit occurred.
+//
+bool mesh_intersect(const Mesh *mesh, ray r, double t_min, double t_max, HitRecord *rec) {
+    if (mesh->node_count == 0) {
+        return false;
+    }
+    vec3 inv_dir = v3_init(1.0 / r.dir.x, 1.0 / r.dir.y, 1.0 / r.dir.z);
+    ShearedRay sheared = shear_ray(r);
+    STAT_INC(box_tests);
+    if (node_entry(&mesh->nodes[0].box, r.orig, inv_dir, t_min, t_max) == INFINITY) {
+        return false;
+    }
+
+    uint32_t stack[MESH_MAX_DEPTH + 1];
+    uint32_t stack_size = 0, node = 0;
+    const MeshTriangle *hit_triangle = NULL;
+    double hit_b1 = 0, hit_b2 = 0;
+    for (;;) {
+        STAT_INC(bvh_nodes_visited);
+        const MeshNode *n = &mesh->nodes[node];
+        if (n->count > 0) {
+            for (uint32_t i = n->index; i < n->index + n->count; i++) {
+                const MeshTriangle *tri = &mesh->triangles[i];
+                double t, b1, b2;
+                STAT_INC(primitive_tests);
+                if (triangle_intersect(&sheared, mesh->positions + (size_t)tri->v[0] * 3,
+                                       mesh->positions + (size_t)tri->v[1] * 3,
+                                       mesh->positions + (size_t)tri->v[2] * 3, t_min,
+                                       t_max, &t, &b1, &b2)) {
+                    STAT_INC(primitive_hits);
+                    t_max = t;
+                    hit_triangle = tri;
+                    hit_b1 = b1;
+                    hit_b2 = b2;
+                }
+            }
+        } else {
+            uint32_t near = node + 1, far = n->index;
+            STAT_ADD(box_tests, 2);
+            const MeshNode *nodes = mesh->nodes;
+            double t_near = node_entry(&nodes[near].box, r.orig, inv_dir, t_min, t_max);
+            double t_far = node_entry(&nodes[far].box, r.orig, inv_dir, t_min, t_max);
+            if (t_far < t_near) {
+                uint32_t swap = near;
+                near = far;
+                far = swap;
+                double swap_t = t_near;
+                t_near = t_far;
+                t_far = swap_t;
+            }
+            if (t_near < INFINITY) {
+                if (t_far < INFINITY) {
+                    stack[stack_size++] = far;
+                }
+                node = near;
+                continue;
+            }
+        }
+        if (stack_size == 0) {
+            break;
+        }
+        node = stack[--stack_size];
+    }
+
+    if (hit_triangle == NULL) {
+        return false;
+    }
+    triangle_hit_record(mesh, hit_triangle, r, t_max, hit_b1, hit_b2, rec);
+    return true;
+}
+
+//
+// Constructs a bounding box for a mesh, the box of the root of its BVH. Returns
+// false for an empty mesh.
+//
+bool mesh_bounding_box(const Mesh *mesh, AABB *output_box) {
+    if (mesh->node_count == 0) {
+        return false;
+    }
+    // Padded like flat shapes, in case the whole mesh lies in an axis aligned plane
+    vec3 padding = v3_init(MESH_BOX_PADDING, MESH_BOX_PADDING, MESH_BOX_PADDING);
+    output_box->min = v3_sub(mesh->nodes[0].box.min, padding);
+    output_box->max = v3_add(mesh->nodes[0].box.max, padding);
+    return true;
+}
+
+//
+// Returns the number of bytes a mesh takes up.
+//
+size_t mesh_memory(const Mesh *mesh) {
+    size_t floats_per_vertex = 3 + (mesh->normals ? 3 : 0) + (mesh->uvs ? 2 : 0);
+    return sizeof(Mesh) + (size_t)mesh->vertex_count * floats_per_vertex * sizeof(float) +
+           (size_t)mesh->triangle_count * sizeof(MeshTriangle) +
+           (size_t)mesh->node_count * sizeof(MeshNode);
+}
+
+void mesh_print(const Mesh *mesh) {
+    printf("Mesh -> %u triangles, %u vertices, %u BVH nodes\n", mesh->triangle_count,
+           mesh->vertex_count, mesh->node_count);
+    if (mesh->node_count > 0) {
+        aabb_print(mesh->nodes[0].box);
+    }
+}
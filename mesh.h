@@ -0,0 +1,63 @@
+#pragma once
+
+#include "aabb.h"
+#include "hit.h"
+#include "material.h"
+#include "ray.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MESH_LEAF_SIZE 4 // Leaves are split further when the SAH says it pays off
+#define MESH_MAX_LEAF_SIZE 16
+#define MESH_MAX_DEPTH 64 // Deeper subtrees become leaves, bounding the traversal stack
+
+typedef struct Mesh Mesh;
+
+// A triangle, as indices into the mesh's vertex arrays
+typedef struct {
+    uint32_t v[3];
+} MeshTriangle;
+
+// A node of a mesh's BVH, which is stored flat in pre-order. A leaf's triangles are
+// count triangles from index on. An interior node has a count of 0, its left child
+// right after it and its right child at index.
+typedef struct {
+    AABB box;
+    uint32_t index, count;
+} MeshNode;
+
+// An indexed triangle mesh. Vertex attributes are shared between the triangles that
+// use them and stored in single precision; normals and uvs are optional. The
+// triangles are kept in the order of the leaves of the mesh's own BVH, so the whole
+// mesh is a single bounded object to the scene's BVH.
+struct Mesh {
+    uint32_t vertex_count, triangle_count, node_count;
+    float *positions; // vertex_count xyz triples
+    float *normals;   // vertex_count xyz triples, NULL for flat shading
+    float *uvs;       // vertex_count uv pairs, NULL for barycentric uvs
+    MeshTriangle *triangles;
+    MeshNode *nodes;
+    Material *material;
+    void *mapping; // Cache file the arrays point into, NULL if they were allocated
+    size_t mapping_size;
+};
+
+Mesh *mesh_create(uint32_t vertex_count, uint32_t triangle_count, bool normals, bool uvs);
+
+Mesh *mesh_load(const char *path, const char *cache_path, Material *material);
+
+void mesh_build(Mesh *mesh);
+
+Mesh *mesh_clone(const Mesh *mesh);
+
+void mesh_delete(Mesh **mesh);
+
+bool mesh_intersect(const Mesh *mesh, ray r, double t_min, double t_max, HitRecord *rec);
+
+bool mesh_bounding_box(const Mesh *mesh, AABB *output_box);
+
+size_t mesh_memory(const Mesh *mesh);
+
+void mesh_print(const Mesh *mesh);
@@ -0,0 +1,332 @@
+//
+// Loader for Wavefront OBJ meshes. Only the geometry is read: v, vt and vn lines, and
+// f lines whose corners take any of the v, v/vt, v//vn and v/vt/vn forms, with
+// negative indices counting back from the end. Polygons are split into fans of
+// triangles. Everything else (groups, smoothing groups, materials, lines) is skipped.
+//
+// Like scene files, the file is memory mapped and parsed in one pass. OBJ indexes
+// positions, uvs and normals separately, while a Mesh shares whole vertices, so each
+// distinct combination of the three becomes one vertex, found through a hash table.
+//
+
+#include "obj.h"
+#include "util.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NO_INDEX UINT32_MAX
+
+// An array that grows as values are pushed onto it
+typedef struct {
+    void *data;
+    size_t count, capacity, element_size;
+} Array;
+
+// A distinct combination of position, uv and normal indices, NO_INDEX for none
+typedef struct {
+    uint32_t p, t, n;
+} Corner;
+
+// Vertices by their corner, an open addressing hash table
+typedef struct {
+    Corner *keys;
+    uint32_t *values; // Vertex index, NO_INDEX for an empty slot
+    uint32_t capacity; // A power of two
+} CornerTable;
+
+typedef struct {
+    const char *p, *end; // Current position and end of the file
+    const char *path;
+    uint32_t line;
+} Parser;
+
+static void *array_push(Array *array) {
+    if (array->count == array->capacity) {
+        array->capacity = array->capacity ? array->capacity * 2 : 1024;
+        array->data = realloc(array->data, array->capacity * array->element_size);
+        assert(array->data != NULL);
+    }
+    return (char *)array->data + array->element_size * array->count++;
+}
+
+static void parse_error(Parser *parser, const char *message) {
+    fprintf(stderr, "ERROR: %s:%u: %s\n", parser->path, parser->line, message);
+}
+
+static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+static void skip_space(Parser *parser) {
+    while (parser->p < parser->end && is_space(*parser->p)) {
+        parser->p++;
+    }
+}
+
+static void skip_line(Parser *parser) {
+    const char *newline = memchr(parser->p, '\n', (size_t)(parser->end - parser->p));
+    parser->p = newline ? newline : parser->end;
+}
+
+//
+// Reads the next whitespace separated word. Returns its length, 0 at the end of a line.
+//
+static size_t next_word(Parser *parser, const char **word) {
+    skip_space(parser);
+    *word = parser->p;
+    while (parser->p < parser->end && !is_space(*parser->p) && *parser->p != '\n' &&
+           *parser->p != '#') {
+        parser->p++;
+    }
+    return (size_t)(parser->p - *word);
+}
+
+static bool next_float(Parser *parser, float *value) {
+    const char *word;
+    size_t length = next_word(parser, &word);
+    double v;
+    if (length == 0 || !parse_double(word, length, &v)) {
+        parse_error(parser, "expected a number");
+        return false;
+    }
+    *value = (float)v;
+    return true;
+}
+
+//
+// Reads one index of a face corner, starting at *p, and turns it into a 0 based index
+// into an array of count elements. Returns false if it is missing or out of range.
+//
+static bool parse_index(const char **p, const char *end, size_t count, uint32_t *index) {
+    bool negative = *p < end && **p == '-';
+    *p += negative;
+    uint64_t value = 0;
+    const char *digits = *p;
+    for (; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+        value = value < UINT32_MAX ? value * 10 + (uint64_t)(**p - '0') : value;
+    }
+    if (*p == digits || value == 0 || value > count) {
+        return false;
+    }
+    *index = (uint32_t)(negative ? count - value : value - 1);
+    return true;
+}
+
+static uint32_t corner_slot(const CornerTable *table, Corner c) {
+    uint64_t h = hash_bytes(&c, sizeof(c), 0);
+    uint32_t i = (uint32_t)h & (table->capacity - 1);
+    while (table->values[i] != NO_INDEX &&
+           (table->keys[i].p != c.p || table->keys[i].t != c.t ||
+            table->keys[i].n != c.n)) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return i;
+}
+
+static void corner_table_grow(CornerTable *table) {
+    CornerTable grown = {NULL, NULL, table->capacity ? table->capacity * 2 : 4096};
+    grown.keys = (Corner *)malloc(grown.capacity * sizeof(Corner));
+    grown.values = (uint32_t *)malloc(grown.capacity * sizeof(uint32_t));
+    assert(grown.keys != NULL && grown.values != NULL);
+    memset(grown.values, 0xff, grown.capacity * sizeof(uint32_t));
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        if (table->values[i] != NO_INDEX) {
+            uint32_t slot = corner_slot(&grown, table->keys[i]);
+            grown.keys[slot] = table->keys[i];
+            grown.values[slot] = table->values[i];
+        }
+    }
+    free(table->keys);
+    free(table->values);
+    *table = grown;
+}
+
+//
+// Reads a face and appends its triangles. Each corner is looked up in the table of
+// distinct corners, and added to it as a new vertex if it is not there yet.
+//
+static bool parse_face(Parser *parser, size_t position_count, size_t uv_count,
+                       size_t normal_count, CornerTable *table, Array *vertices,
+                       Array *face, Array *triangles) {
+    face->count = 0;
+    const char *word;
+    size_t length;
+    while ((length = next_word(parser, &word)) > 0) {
+        const char *p = word, *end = word + length;
+        Corner c = {NO_INDEX, NO_INDEX, NO_INDEX};
+        bool ok = parse_index(&p, end, position_count, &c.p);
+        if (ok && p < end && *p == '/') {
+            p++;
+            if (p == end) {
+                ok = false; // A slash with nothing after it, as in "1/"
+            } else if (*p != '/') {
+                ok = parse_index(&p, end, uv_count, &c.t);
+            }
+            if (ok && p < end && *p == '/') {
+                p++;
+                ok = parse_index(&p, end, normal_count, &c.n);
+            }
+        }
+        if (!ok || p != end) {
+            parse_error(parser, "invalid or out of range face index");
+            return false;
+        }
+
+        // Keep the table at most half full
+        if (2 * (vertices->count + 1) > table->capacity) {
+            corner_table_grow(table);
+        }
+        uint32_t slot = corner_slot(table, c);
+        if (table->values[slot] == NO_INDEX) {
+            if (vertices->count == NO_INDEX) {
+                parse_error(parser, "too many vertices");
+                return false;
+            }
+            table->keys[slot] = c;
+            table->values[slot] = (uint32_t)vertices->count;
+            *(Corner *)array_push(vertices) = c;
+        }
+        *(uint32_t *)array_push(face) = table->values[slot];
+    }
+    if (face->count < 3) {
+        parse_error(parser, "a face needs at least three vertices");
+        return false;
+    }
+
+    const uint32_t *corners = (const uint32_t *)face->data;
+    for (size_t i = 1; i + 1 < face->count; i++) {
+        MeshTriangle *tri = (MeshTriangle *)array_push(triangles);
+        tri->v[0] = corners[0];
+        tri->v[1] = corners[i];
+        tri->v[2] = corners[i + 1];
+    }
+    return true;
+}
+
+//
+// Loads the triangles of an OBJ file into a mesh, without building its BVH.
+// Returns NULL if the file cannot be read or has errors.
+//
+Mesh *obj_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "ERROR: Failed to open mesh %s!\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *data = "";
+    if (size > 0) {
+        data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "ERROR: Failed to map mesh %s!\n", path);
+            close(fd);
+            return NULL;
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    Array positions = {NULL, 0, 0, 3 * sizeof(float)};
+    Array uvs = {NULL, 0, 0, 2 * sizeof(float)};
+    Array normals = {NULL, 0, 0, 3 * sizeof(float)};
+    Array vertices = {NULL, 0, 0, sizeof(Corner)};
+    Array face = {NULL, 0, 0, sizeof(uint32_t)};
+    Array triangles = {NULL, 0, 0, sizeof(MeshTriangle)};
+    CornerTable table = {0};
+    corner_table_grow(&table);
+
+    Parser parser = {data, data + size, path, 1};
+    bool ok = true;
+    while (ok && parser.p < parser.end) {
+        const char *keyword;
+        size_t length = next_word(&parser, &keyword);
+        if (length == 1 && keyword[0] == 'v') {
+            float *v = (float *)array_push(&positions);
+            ok = next_float(&parser, &v[0]) && next_float(&parser, &v[1]) &&
+                 next_float(&parser, &v[2]);
+        } else if (length == 2 && keyword[0] == 'v' && keyword[1] == 't') {
+            float *t = (float *)array_push(&uvs);
+            ok = next_float(&parser, &t[0]);
+            t[1] = 0;
+            skip_space(&parser);
+            if (ok && parser.p < parser.end && *parser.p != '\n' && *parser.p != '#') {
+                ok = next_float(&parser, &t[1]);
+            }
+        } else if (length == 2 && keyword[0] == 'v' && keyword[1] == 'n') {
+            float *n = (float *)array_push(&normals);
+            ok = next_float(&parser, &n[0]) && next_float(&parser, &n[1]) &&
+                 next_float(&parser, &n[2]);
+        } else if (length == 1 && keyword[0] == 'f') {
+            ok = parse_face(&parser, positions.count, uvs.count, normals.count, &table,
+                            &vertices, &face, &triangles);
+        }
+
+        // Skip whatever else the line holds, like a w coordinate, and go to the next one
+        skip_line(&parser);
+        if (parser.p < parser.end) {
+            parser.p++;
+            parser.line++;
+        }
+    }
+    if (ok && triangles.count == 0) {
+        fprintf(stderr, "ERROR: %s: mesh has no faces!\n", path);
+        ok = false;
+    } else if (ok && triangles.count >= NO_INDEX) {
+        fprintf(stderr, "ERROR: %s: mesh has too many faces!\n", path);
+        ok = false;
+    }
+
+    Mesh *mesh = NULL;
+    if (ok) {
+        // Gather the attributes of each distinct corner
+        const Corner *corners = (const Corner *)vertices.data;
+        bool any_uvs = false, any_normals = false;
+        for (size_t i = 0; i < vertices.count; i++) {
+            any_uvs = any_uvs || corners[i].t != NO_INDEX;
+            any_normals = any_normals || corners[i].n != NO_INDEX;
+        }
+        mesh = mesh_create((uint32_t)vertices.count, (uint32_t)triangles.count,
+                           any_normals, any_uvs);
+        const float *p = (const float *)positions.data, *t = (const float *)uvs.data,
+                    *n = (const float *)normals.data;
+        for (size_t i = 0; i < vertices.count; i++) {
+            const Corner *c = &corners[i];
+            memcpy(mesh->positions + 3 * i, p + 3 * (size_t)c->p, 3 * sizeof(float));
+            if (any_uvs) {
+                float *uv = mesh->uvs + 2 * i;
+                uv[0] = c->t != NO_INDEX ? t[2 * (size_t)c->t] : 0;
+                uv[1] = c->t != NO_INDEX ? t[2 * (size_t)c->t + 1] : 0;
+            }
+            if (any_normals) {
+                // Corners without a normal get a zero one, which shades flat
+                float *normal = mesh->normals + 3 * i;
+                for (int k = 0; k < 3; k++) {
+                    normal[k] = c->n != NO_INDEX ? n[3 * (size_t)c->n + k] : 0;
+                }
+            }
+        }
+        memcpy(mesh->triangles, triangles.data, triangles.count * sizeof(MeshTriangle));
+    }
+
+    free(positions.data);
+    free(uvs.data);
+    free(normals.data);
+    free(vertices.data);
+    free(face.data);
+    free(triangles.data);
+    free(table.keys);
+    free(table.values);
+    if (size > 0) {
+        munmap((void *)data, size);
+    }
+    return mesh;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "mesh.h"
+
+Mesh *obj_load(const char *path);
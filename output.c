@@ -0,0 +1,431 @@
+#include "output.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "include/stb_image/stb_image_write.h"
+
+// Image output stage. The image is handed to the writer in horizontal bands of
+// finished rows, top to bottom, each as its own framebuffer. Every format is written
+// as the bands come in, so only the band being written has to be kept in memory:
+//      - PNG:  8-bit sRGB, tone mapped w/ fb_resolve(). An image that arrives as a
+//              single band is compressed by stb_image_write; otherwise rows are
+//              streamed as uncompressed (stored) deflate blocks.
+//      - PFM:  32-bit float linear RGB. Rows are stored bottom to top, so each row
+//              is written at its offset in the file.
+//      - EXR:  Uncompressed 32-bit float linear RGB scanline image. All chunks have
+//              the same size, so the offset table is known up front.
+// PFM and EXR hold the average radiance of each pixel w/o exposure or tone mapping.
+
+#define PNG_MAX_STORED_BLOCK 65535
+
+struct ImageWriter {
+    OutputFormat format;
+    FILE *file;
+    char *path;
+    uint32_t width, height;
+    double exposure;
+    uint32_t rows_written;
+    long data_offset; // File offset of the first pixel row (PFM, EXR)
+
+    // PNG streaming state
+    uint64_t raw_remaining; // Bytes of filtered scanline data still to come
+    uint32_t adler_a, adler_b;
+    bool png_single_band;
+};
+
+static uint32_t crc_table[256];
+
+static void crc_table_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static void put_u32_be(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+//
+// Writes a PNG chunk w/ the given 4 character type and payload.
+//
+static bool png_write_chunk(FILE *file, const char *type, const uint8_t *data,
+                            uint32_t size) {
+    uint8_t header[8];
+    put_u32_be(header, size);
+    memcpy(header + 4, type, 4);
+
+    uint32_t crc = crc_update(0xffffffffu, header + 4, 4);
+    crc = crc_update(crc, data, size);
+    uint8_t footer[4];
+    put_u32_be(footer, crc ^ 0xffffffffu);
+
+    return fwrite(header, 1, 8, file) == 8 &&
+           (size == 0 || fwrite(data, 1, size, file) == size) &&
+           fwrite(footer, 1, 4, file) == 4;
+}
+
+//
+// Returns the output format implied by the extension of the path. Anything that
+// isn't .pfm or .exr is written as PNG.
+//
+OutputFormat output_format_from_path(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (ext && strcasecmp(ext, ".pfm") == 0) {
+        return OUTPUT_PFM;
+    }
+    if (ext && strcasecmp(ext, ".exr") == 0) {
+        return OUTPUT_EXR;
+    }
+    return OUTPUT_PNG;
+}
+
+//
+// Appends an OpenEXR header attribute.
+//
+static void exr_attribute(FILE *file, const char *name, const char *type,
+                          const void *value, int32_t size) {
+    fwrite(name, 1, strlen(name) + 1, file);
+    fwrite(type, 1, strlen(type) + 1, file);
+    fwrite(&size, sizeof(size), 1, file);
+    fwrite(value, 1, size, file);
+}
+
+//
+// Writes the header and scanline offset table of an uncompressed float RGB EXR.
+// (EXR is little-endian, as is every platform we build on.)
+//
+static bool exr_write_header(ImageWriter *w) {
+    const uint8_t magic[8] = {0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0};
+    fwrite(magic, 1, sizeof(magic), w->file);
+
+    // Channels are listed in alphabetical order, each w/ pixel type FLOAT (2),
+    // pLinear = 0, three reserved bytes and x/y sampling of 1.
+    uint8_t channels[3 * 18 + 1];
+    const char names[3] = {'B', 'G', 'R'};
+    for (int c = 0; c < 3; c++) {
+        uint8_t *ch = &channels[c * 18];
+        int32_t fields[3] = {2, 1, 1};
+        ch[0] = (uint8_t)names[c];
+        ch[1] = 0;
+        memcpy(ch + 2, &fields[0], 4);
+        memset(ch + 6, 0, 4);
+        memcpy(ch + 10, &fields[1], 4);
+        memcpy(ch + 14, &fields[2], 4);
+    }
+    channels[3 * 18] = 0;
+    exr_attribute(w->file, "channels", "chlist", channels, sizeof(channels));
+
+    uint8_t compression = 0;
+    exr_attribute(w->file, "compression", "compression", &compression, 1);
+
+    int32_t window[4] = {0, 0, (int32_t)w->width - 1, (int32_t)w->height - 1};
+    exr_attribute(w->file, "dataWindow", "box2i", window, sizeof(window));
+    exr_attribute(w->file, "displayWindow", "box2i", window, sizeof(window));
+
+    uint8_t line_order = 0; // INCREASING_Y
+    exr_attribute(w->file, "lineOrder", "lineOrder", &line_order, 1);
+
+    float aspect = 1.0f;
+    exr_attribute(w->file, "pixelAspectRatio", "float", &aspect, sizeof(aspect));
+
+    float center[2] = {0.0f, 0.0f};
+    exr_attribute(w->file, "screenWindowCenter", "v2f", center, sizeof(center));
+
+    float window_width = 1.0f;
+    exr_attribute(w->file, "screenWindowWidth", "float", &window_width,
+                  sizeof(window_width));
+
+    fputc(0, w->file); // End of header
+
+    // One chunk per scanline: its y coordinate, its size, then the row data
+    uint64_t chunk_size = 8 + (uint64_t)w->width * 3 * sizeof(float);
+    uint64_t offset = (uint64_t)ftell(w->file) + (uint64_t)w->height * sizeof(uint64_t);
+    w->data_offset = (long)offset;
+    for (uint32_t y = 0; y < w->height; y++) {
+        uint64_t chunk_offset = offset + y * chunk_size;
+        fwrite(&chunk_offset, sizeof(chunk_offset), 1, w->file);
+    }
+
+    return ferror(w->file) == 0;
+}
+
+//
+// Opens an image file for writing. The format is picked from the file extension.
+// Returns NULL if the file can't be created.
+//
+ImageWriter *output_open(const char *path, uint32_t width, uint32_t height,
+                         double exposure) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Failed to open output image %s!\n", path);
+        return NULL;
+    }
+
+    ImageWriter *w = (ImageWriter *)calloc(1, sizeof(ImageWriter));
+    assert(w != NULL);
+    w->format = output_format_from_path(path);
+    w->file = file;
+    w->path = strdup(path);
+    w->width = width;
+    w->height = height;
+    w->exposure = exposure;
+
+    bool ok = true;
+    switch (w->format) {
+    case OUTPUT_PFM:
+        // Negative scale marks the data as little-endian
+        ok = fprintf(file, "PF\n%u %u\n-1.0\n", width, height) > 0;
+        w->data_offset = ftell(file);
+        break;
+    case OUTPUT_EXR:
+        ok = exr_write_header(w);
+        break;
+    case OUTPUT_PNG:
+        w->raw_remaining = (uint64_t)height * (1 + (uint64_t)width * 3);
+        w->adler_a = 1;
+        w->adler_b = 0;
+        break;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "ERROR: Failed to write header of output image %s!\n", path);
+        output_close(&w);
+        return NULL;
+    }
+
+    return w;
+}
+
+//
+// Fills out with the average linear radiance of every pixel in one row of a band.
+//
+static void band_row_average(const Framebuffer *band, uint32_t row, float *out) {
+    const float *accum = &band->accum[(size_t)row * band->width * 3];
+    const uint32_t *samples = &band->samples[(size_t)row * band->width];
+    for (uint32_t x = 0; x < band->width; x++) {
+        float scale = samples[x] ? 1.0f / (float)samples[x] : 0.0f;
+        out[x * 3] = accum[x * 3] * scale;
+        out[x * 3 + 1] = accum[x * 3 + 1] * scale;
+        out[x * 3 + 2] = accum[x * 3 + 2] * scale;
+    }
+}
+
+static bool pfm_write_band(ImageWriter *w, const Framebuffer *band, uint32_t first_row) {
+    size_t row_size = (size_t)w->width * 3 * sizeof(float);
+    float *row = (float *)malloc(row_size);
+    assert(row != NULL);
+
+    bool ok = true;
+    for (uint32_t r = 0; r < band->height && ok; r++) {
+        uint32_t y = first_row + r;
+        long offset = w->data_offset + (long)((w->height - 1 - y) * row_size);
+        band_row_average(band, r, row);
+        ok = fseek(w->file, offset, SEEK_SET) == 0 &&
+             fwrite(row, 1, row_size, w->file) == row_size;
+    }
+
+    free(row);
+    return ok;
+}
+
+static bool exr_write_band(ImageWriter *w, const Framebuffer *band, uint32_t first_row) {
+    uint32_t width = w->width;
+    size_t chunk_size = 8 + (size_t)width * 3 * sizeof(float);
+    uint8_t *chunk = (uint8_t *)malloc(chunk_size);
+    float *row = (float *)malloc((size_t)width * 3 * sizeof(float));
+    assert(chunk != NULL && row != NULL);
+
+    bool ok = fseek(w->file, w->data_offset + (long)(first_row * chunk_size), SEEK_SET) == 0;
+    for (uint32_t r = 0; r < band->height && ok; r++) {
+        int32_t y = (int32_t)(first_row + r);
+        int32_t data_size = (int32_t)(chunk_size - 8);
+        memcpy(chunk, &y, 4);
+        memcpy(chunk + 4, &data_size, 4);
+
+        // Pixel data is stored channel by channel in the order of the channel list
+        band_row_average(band, r, row);
+        float *channels = (float *)(chunk + 8);
+        for (uint32_t x = 0; x < width; x++) {
+            channels[x] = row[x * 3 + 2];
+            channels[width + x] = row[x * 3 + 1];
+            channels[2 * width + x] = row[x * 3];
+        }
+
+        ok = fwrite(chunk, 1, chunk_size, w->file) == chunk_size;
+    }
+
+    free(row);
+    free(chunk);
+    return ok;
+}
+
+static bool png_write_header(ImageWriter *w) {
+    const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    uint8_t ihdr[13];
+    put_u32_be(ihdr, w->width);
+    put_u32_be(ihdr + 4, w->height);
+    ihdr[8] = 8;  // Bit depth
+    ihdr[9] = 2;  // Color type: RGB
+    ihdr[10] = 0; // Compression: deflate
+    ihdr[11] = 0; // Filter method
+    ihdr[12] = 0; // No interlace
+
+    return fwrite(signature, 1, 8, w->file) == 8 &&
+           png_write_chunk(w->file, "IHDR", ihdr, sizeof(ihdr));
+}
+
+//
+// Streams a band of rows as one IDAT chunk holding stored deflate blocks. The first
+// band also carries the zlib header and the last one the Adler-32 checksum.
+//
+static bool png_stream_band(ImageWriter *w, const uint8_t *pixels, uint32_t rows) {
+    size_t row_bytes = (size_t)w->width * 3;
+    size_t raw_size = rows * (row_bytes + 1);
+    size_t block_count = (raw_size + PNG_MAX_STORED_BLOCK - 1) / PNG_MAX_STORED_BLOCK;
+    size_t capacity = 2 + raw_size + block_count * 5 + 4;
+    uint8_t *idat = (uint8_t *)malloc(capacity);
+    uint8_t *raw = (uint8_t *)malloc(raw_size);
+    assert(idat != NULL && raw != NULL);
+
+    // Filter type 0 (None) in front of every row
+    for (uint32_t r = 0; r < rows; r++) {
+        raw[r * (row_bytes + 1)] = 0;
+        memcpy(&raw[r * (row_bytes + 1) + 1], &pixels[r * row_bytes], row_bytes);
+    }
+
+    size_t n = 0;
+    if (w->rows_written == 0) {
+        idat[n++] = 0x78; // zlib header: deflate, 32K window, no dictionary
+        idat[n++] = 0x01;
+    }
+
+    for (size_t start = 0; start < raw_size; start += PNG_MAX_STORED_BLOCK) {
+        uint16_t len = (uint16_t)(raw_size - start < PNG_MAX_STORED_BLOCK
+                                      ? raw_size - start
+                                      : PNG_MAX_STORED_BLOCK);
+        w->raw_remaining -= len;
+        idat[n++] = w->raw_remaining == 0 ? 1 : 0; // BFINAL, BTYPE = 00 (stored)
+        idat[n++] = (uint8_t)len;
+        idat[n++] = (uint8_t)(len >> 8);
+        idat[n++] = (uint8_t)~len;
+        idat[n++] = (uint8_t)(~len >> 8);
+        memcpy(&idat[n], &raw[start], len);
+        n += len;
+    }
+
+    for (size_t i = 0; i < raw_size; i++) {
+        w->adler_a = (w->adler_a + raw[i]) % 65521;
+        w->adler_b = (w->adler_b + w->adler_a) % 65521;
+    }
+    if (w->raw_remaining == 0) {
+        put_u32_be(&idat[n], (w->adler_b << 16) | w->adler_a);
+        n += 4;
+    }
+
+    bool ok = png_write_chunk(w->file, "IDAT", idat, (uint32_t)n);
+    free(raw);
+    free(idat);
+    return ok;
+}
+
+static void png_write_func(void *context, void *data, int size) {
+    fwrite(data, 1, size, (FILE *)context);
+}
+
+static bool png_write_band(ImageWriter *w, const Framebuffer *band, uint32_t first_row) {
+    uint8_t *pixels = (uint8_t *)malloc((size_t)band->width * band->height * 3);
+    assert(pixels != NULL);
+    fb_resolve(band, pixels, w->exposure);
+
+    bool ok;
+    if (first_row == 0 && band->height == w->height) {
+        // The whole image at once, so let stb_image_write compress it. Its writes
+        // cannot report failure, and fclose() would not either, so check the stream.
+        w->png_single_band = true;
+        ok = stbi_write_png_to_func(png_write_func, w->file, w->width, w->height, 3,
+                                    pixels, w->width * 3) != 0 &&
+             ferror(w->file) == 0;
+    } else {
+        ok = (w->rows_written > 0 || png_write_header(w)) &&
+             png_stream_band(w, pixels, band->height);
+    }
+
+    free(pixels);
+    return ok;
+}
+
+//
+// Writes a band of finished rows starting at image row first_row. Bands must arrive
+// in order from the top of the image down and together cover every row exactly once.
+// Returns true on success.
+//
+bool output_write_band(ImageWriter *w, const Framebuffer *band, uint32_t first_row) {
+    static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+    pthread_once(&crc_once, crc_table_init);
+
+    assert(band->width == w->width && first_row == w->rows_written &&
+           first_row + band->height <= w->height);
+
+    bool ok = false;
+    switch (w->format) {
+    case OUTPUT_PNG:
+        ok = png_write_band(w, band, first_row);
+        break;
+    case OUTPUT_PFM:
+        ok = pfm_write_band(w, band, first_row);
+        break;
+    case OUTPUT_EXR:
+        ok = exr_write_band(w, band, first_row);
+        break;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "ERROR: Failed to write rows %u-%u of %s!\n", first_row,
+                first_row + band->height - 1, w->path);
+        return false;
+    }
+
+    w->rows_written += band->height;
+    return true;
+}
+
+//
+// Finishes and closes the image file. Returns false if the image was incomplete or
+// could not be written.
+//
+bool output_close(ImageWriter **w) {
+    if (*w == NULL) {
+        return false;
+    }
+
+    bool ok = (*w)->rows_written == (*w)->height;
+    if (ok && (*w)->format == OUTPUT_PNG && !(*w)->png_single_band) {
+        ok = png_write_chunk((*w)->file, "IEND", NULL, 0);
+    }
+    ok = (fclose((*w)->file) == 0) && ok;
+
+    free((*w)->path);
+    free(*w);
+    *w = NULL;
+    return ok;
+}
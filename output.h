@@ -0,0 +1,19 @@
+#pragma once
+
+#include "framebuffer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum { OUTPUT_PNG, OUTPUT_PFM, OUTPUT_EXR } OutputFormat;
+
+typedef struct ImageWriter ImageWriter;
+
+OutputFormat output_format_from_path(const char *path);
+
+ImageWriter *output_open(const char *path, uint32_t width, uint32_t height,
+                         double exposure);
+
+bool output_write_band(ImageWriter *w, const Framebuffer *band, uint32_t first_row);
+
+bool output_close(ImageWriter **w);
@@ -0,0 +1,96 @@
+#include "placement.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    uint32_t cpu;
+    Scene *scene;
+    BVHNode *bvh;
+    Scene *replica_scene;
+    BVHNode *replica_bvh;
+} ReplicaJob;
+
+//
+// Thread entry point that copies the scene and BVH while pinned to a CPU of the
+// node the copy is for. Linux places a page on the node of the CPU that first
+// touches it, so the copy ends up in that node's memory.
+//
+static void *build_replica(void *replica_job) {
+    ReplicaJob *job = (ReplicaJob *)replica_job;
+    if (!cpu_pin(job->cpu)) {
+        fprintf(stderr, "WARNING: Failed to pin to CPU %u, replica may be remote\n",
+                job->cpu);
+    }
+    job->replica_scene = scene_clone(job->scene);
+    job->replica_bvh = bvh_clone(job->bvh, job->scene, job->replica_scene);
+    if (job->bvh && job->bvh->storage == BVH_NODE_BLOCK) {
+        // Copies are made node by node, so lay the copy out like the original
+        bvh_pack(job->replica_scene, &job->replica_bvh);
+    }
+    return NULL;
+}
+
+//
+// Copies the scene and BVH once per NUMA node so that workers pinned to that node
+// traverse memory local to them.
+//
+Placement *placement_create(const CpuTopology *topology, Scene *scene, BVHNode *bvh) {
+    Placement *placement = (Placement *)calloc(1, sizeof(Placement));
+    assert(placement != NULL);
+    placement->topology = topology;
+
+    uint32_t node_count = topology->node_count;
+    placement->scenes = (Scene **)malloc(node_count * sizeof(Scene *));
+    placement->bvhs = (BVHNode **)malloc(node_count * sizeof(BVHNode *));
+    ReplicaJob *jobs = (ReplicaJob *)calloc(node_count, sizeof(ReplicaJob));
+    pthread_t *threads = (pthread_t *)malloc(node_count * sizeof(pthread_t));
+    assert(placement->scenes != NULL && placement->bvhs != NULL && jobs != NULL &&
+           threads != NULL);
+
+    // The copies are made in parallel, each by a thread on the first CPU of its node
+    for (uint32_t node = 0; node < node_count; node++) {
+        uint32_t cpu = 0;
+        while (topology->cpu_nodes[cpu] != node) {
+            cpu++;
+        }
+        jobs[node] = (ReplicaJob){.cpu = topology->cpus[cpu], .scene = scene, .bvh = bvh};
+        if (pthread_create(&threads[node], NULL, build_replica, &jobs[node])) {
+            fprintf(stderr, "ERROR: Failed to start replica thread\n");
+            exit(1);
+        }
+    }
+    for (uint32_t node = 0; node < node_count; node++) {
+        pthread_join(threads[node], NULL);
+        placement->scenes[node] = jobs[node].replica_scene;
+        placement->bvhs[node] = jobs[node].replica_bvh;
+    }
+
+    free(jobs);
+    free(threads);
+    return placement;
+}
+
+void placement_delete(Placement **placement) {
+    if (*placement) {
+        for (uint32_t node = 0; node < (*placement)->topology->node_count; node++) {
+            bvh_delete(&(*placement)->bvhs[node]);
+            scene_delete(&(*placement)->scenes[node]);
+        }
+        free((*placement)->scenes);
+        free((*placement)->bvhs);
+        free(*placement);
+        *placement = NULL;
+    }
+    return;
+}
+
+//
+// Returns the index of the node a worker runs on.
+//
+uint32_t placement_node(const Placement *placement, uint32_t worker) {
+    const CpuTopology *topology = placement->topology;
+    return topology->cpu_nodes[worker % topology->cpu_count];
+}
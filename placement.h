@@ -0,0 +1,23 @@
+#pragma once
+
+#include "bvh.h"
+#include "cpu.h"
+#include "scene.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Per NUMA node copies of the scene and BVH. Pool worker i, or the waiting thread
+// as worker worker_count, is pinned to topology->cpus[i % cpu_count] and reads the
+// copy of that CPU's node.
+typedef struct {
+    const CpuTopology *topology;
+    Scene **scenes; // One replica of the scene and BVH per node
+    BVHNode **bvhs;
+} Placement;
+
+Placement *placement_create(const CpuTopology *topology, Scene *scene, BVHNode *bvh);
+
+void placement_delete(Placement **placement);
+
+uint32_t placement_node(const Placement *placement, uint32_t worker);
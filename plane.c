@@ -0,0 +1,176 @@
+#include "plane.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Flat shapes have no thickness, so their boxes are padded by this much to keep the
+// slab test from missing them edge on.
+#define FLAT_BOX_PADDING 1e-4
+
+// The unit normal along an axis
+static vec3 axis_normal(uint32_t axis) {
+    return v3_init(axis == 0, axis == 1, axis == 2);
+}
+
+// The two axes other than axis, in order
+static void other_axes(uint32_t axis, uint32_t *a, uint32_t *b) {
+    *a = axis == 0 ? 1 : 0;
+    *b = axis == 2 ? 1 : 2;
+}
+
+// Constructor for a plane. The normal does not have to be of unit length.
+Plane *plane_create(vec3 point, vec3 normal, Material *material) {
+    Plane *p = (Plane *)malloc(sizeof(Plane));
+    assert(p != NULL);
+    p->point = point;
+    p->normal = v3_unit_vector(normal);
+    p->material = material;
+    return p;
+}
+
+//
+// Ray-plane intersection. Rays parallel to the plane miss it.
+//
+bool plane_intersect(Plane p, ray r, double t_min, double t_max, HitRecord *rec) {
+    double denom = v3_dot(p.normal, r.dir);
+    if (fabs(denom) < 1e-12) {
+        return false;
+    }
+    double t = v3_dot(v3_sub(p.point, r.orig), p.normal) / denom;
+    if (t < t_min || t > t_max) {
+        return false;
+    }
+
+    rec->t = t;
+    rec->p = ray_at(r, t);
+    set_face_normal(rec, r, p.normal);
+    rec->u = 0;
+    rec->v = 0;
+    rec->material = p.material;
+    return true;
+}
+
+void plane_print(Plane *p) {
+    if (p) {
+        printf("Plane: (%f, %f, %f), n = (%f, %f, %f)\n", p->point.x, p->point.y,
+               p->point.z, p->normal.x, p->normal.y, p->normal.z);
+    }
+}
+
+// Constructor for an axis aligned rectangle
+Rect *rect_create(uint32_t axis, double k, double u0, double u1, double v0, double v1,
+                  Material *material) {
+    Rect *rect = (Rect *)malloc(sizeof(Rect));
+    assert(rect != NULL && axis < 3);
+    *rect = (Rect){axis, k, fmin(u0, u1), fmax(u0, u1), fmin(v0, v1), fmax(v0, v1),
+                   material};
+    return rect;
+}
+
+//
+// Ray-rectangle intersection: hits the rectangle's plane, then checks that the hit
+// lies within its bounds.
+//
+bool rect_intersect(Rect rect, ray r, double t_min, double t_max, HitRecord *rec) {
+    double dir = v3_axis(r.dir, rect.axis);
+    if (fabs(dir) < 1e-12) {
+        return false;
+    }
+    double t = (rect.k - v3_axis(r.orig, rect.axis)) / dir;
+    if (t < t_min || t > t_max) {
+        return false;
+    }
+    uint32_t a, b;
+    other_axes(rect.axis, &a, &b);
+    vec3 p = ray_at(r, t);
+    double u = v3_axis(p, a), v = v3_axis(p, b);
+    if (u < rect.u0 || u > rect.u1 || v < rect.v0 || v > rect.v1) {
+        return false;
+    }
+
+    rec->t = t;
+    rec->p = p;
+    set_face_normal(rec, r, axis_normal(rect.axis));
+    rec->u = (u - rect.u0) / (rect.u1 - rect.u0);
+    rec->v = (v - rect.v0) / (rect.v1 - rect.v0);
+    rec->material = rect.material;
+    return true;
+}
+
+bool rect_bounding_box(Rect rect, AABB *output_box) {
+    uint32_t a, b;
+    other_axes(rect.axis, &a, &b);
+    double min[3], max[3];
+    min[rect.axis] = rect.k - FLAT_BOX_PADDING;
+    max[rect.axis] = rect.k + FLAT_BOX_PADDING;
+    min[a] = rect.u0;
+    max[a] = rect.u1;
+    min[b] = rect.v0;
+    max[b] = rect.v1;
+    output_box->min = v3_init(min[0], min[1], min[2]);
+    output_box->max = v3_init(max[0], max[1], max[2]);
+    return true;
+}
+
+void rect_print(Rect *rect) {
+    if (rect) {
+        printf("Rect: axis %u at %f, [%f, %f] x [%f, %f]\n", rect->axis, rect->k,
+               rect->u0, rect->u1, rect->v0, rect->v1);
+    }
+}
+
+// Constructor for an axis aligned disk
+Disk *disk_create(vec3 center, double radius, uint32_t axis, Material *material) {
+    Disk *d = (Disk *)malloc(sizeof(Disk));
+    assert(d != NULL && axis < 3);
+    *d = (Disk){center, radius, axis, material};
+    return d;
+}
+
+//
+// Ray-disk intersection: hits the disk's plane, then checks the distance from the
+// center.
+//
+bool disk_intersect(Disk d, ray r, double t_min, double t_max, HitRecord *rec) {
+    double dir = v3_axis(r.dir, d.axis);
+    if (fabs(dir) < 1e-12) {
+        return false;
+    }
+    double t = (v3_axis(d.center, d.axis) - v3_axis(r.orig, d.axis)) / dir;
+    if (t < t_min || t > t_max) {
+        return false;
+    }
+    vec3 p = ray_at(r, t);
+    vec3 offset = v3_sub(p, d.center);
+    if (v3_length_squared(offset) > d.radius * d.radius) {
+        return false;
+    }
+
+    uint32_t a, b;
+    other_axes(d.axis, &a, &b);
+    rec->t = t;
+    rec->p = p;
+    set_face_normal(rec, r, axis_normal(d.axis));
+    rec->u = 0.5 + v3_axis(offset, a) / (2 * d.radius);
+    rec->v = 0.5 + v3_axis(offset, b) / (2 * d.radius);
+    rec->material = d.material;
+    return true;
+}
+
+bool disk_bounding_box(Disk d, AABB *output_box) {
+    vec3 extent = v3_init(d.radius, d.radius, d.radius);
+    vec3 pad = v3_scale(axis_normal(d.axis), d.radius - FLAT_BOX_PADDING);
+    extent = v3_sub(extent, pad);
+    output_box->min = v3_sub(d.center, extent);
+    output_box->max = v3_add(d.center, extent);
+    return true;
+}
+
+void disk_print(Disk *d) {
+    if (d) {
+        printf("Disk: (%f, %f, %f), r = %f, axis %u\n", d->center.x, d->center.y,
+               d->center.z, d->radius, d->axis);
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "aabb.h"
+#include "hit.h"
+#include "material.h"
+#include "ray.h"
+#include "vec3.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct Plane Plane;
+typedef struct Rect Rect;
+typedef struct Disk Disk;
+
+// An infinite plane through point, facing along the unit vector normal. It has no
+// bounding box, so scenes keep planes out of the BVH.
+struct Plane {
+    vec3 point;
+    vec3 normal;
+    Material *material;
+};
+
+// A rectangle perpendicular to an axis (0, 1, 2 for x, y, z) at k along it. It
+// spans [u0, u1] x [v0, v1] of the other two axes, taken in order: y and z for x,
+// x and z for y, x and y for z.
+struct Rect {
+    uint32_t axis;
+    double k, u0, u1, v0, v1;
+    Material *material;
+};
+
+// A disk perpendicular to an axis
+struct Disk {
+    vec3 center;
+    double radius;
+    uint32_t axis;
+    Material *material;
+};
+
+Plane *plane_create(vec3 point, vec3 normal, Material *);
+
+bool plane_intersect(Plane p, ray r, double t_min, double t_max, HitRecord *rec);
+
+void plane_print(Plane *p);
+
+Rect *rect_create(uint32_t axis, double k, double u0, double u1, double v0, double v1,
+                  Material *);
+
+bool rect_intersect(Rect rect, ray r, double t_min, double t_max, HitRecord *rec);
+
+bool rect_bounding_box(Rect rect, AABB *output_box);
+
+void rect_print(Rect *rect);
+
+Disk *disk_create(vec3 center, double radius, uint32_t axis, Material *);
+
+bool disk_intersect(Disk d, ray r, double t_min, double t_max, HitRecord *rec);
+
+bool disk_bounding_box(Disk d, AABB *output_box);
+
+void disk_print(Disk *d);
@@ -0,0 +1,215 @@
+#include "pool.h"
+#include "trace.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct PoolJob PoolJob;
+
+struct PoolJob {
+    PoolTask task;
+    void *arg;
+    TaskGroup *group;
+    PoolJob *next;
+};
+
+typedef struct {
+    ThreadPool *pool;
+    uint32_t index;
+} PoolWorker;
+
+// Workers live as long as the pool and take jobs off a single FIFO queue. A thread
+// waiting on a group runs the group's queued jobs itself until it is done, so tasks
+// may submit and wait on tasks of their own without running out of workers. It
+// leaves other groups' jobs to the workers, as one of those, such as a background
+// write, could keep it from returning long after its own group has finished.
+struct ThreadPool {
+    pthread_mutex_t lock;
+    pthread_cond_t work_available; // Signalled when a job is queued or on shutdown
+    pthread_cond_t job_done;       // Broadcast whenever a job finishes
+    PoolJob *head, *tail;
+    bool shutdown;
+    uint32_t worker_count;
+    pthread_t *threads;
+    PoolWorker *workers;
+    const CpuTopology *pin_topology;
+};
+
+// The worker the calling thread is, or NULL on threads outside of any pool
+static _Thread_local const PoolWorker *this_worker = NULL;
+
+// Takes the next job off the queue. Must be called with the lock held.
+static PoolJob *pop_job(ThreadPool *pool) {
+    PoolJob *job = pool->head;
+    if (job) {
+        pool->head = job->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+    }
+    return job;
+}
+
+// Takes the first job of group off the queue. Must be called with the lock held.
+static PoolJob *pop_group_job(ThreadPool *pool, const TaskGroup *group) {
+    PoolJob *prev = NULL;
+    for (PoolJob *job = pool->head; job; prev = job, job = job->next) {
+        if (job->group == group) {
+            if (prev) {
+                prev->next = job->next;
+            } else {
+                pool->head = job->next;
+            }
+            if (pool->tail == job) {
+                pool->tail = prev;
+            }
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// Runs a job and marks it done. Must be called with the lock held, which is
+// released while the job runs.
+static void run_job(ThreadPool *pool, PoolJob *job, uint32_t worker) {
+    pthread_mutex_unlock(&pool->lock);
+    job->task(job->arg, worker);
+    pthread_mutex_lock(&pool->lock);
+    job->group->pending--;
+    free(job);
+    pthread_cond_broadcast(&pool->job_done);
+}
+
+static void *worker_main(void *pool_worker) {
+    PoolWorker *worker = (PoolWorker *)pool_worker;
+    ThreadPool *pool = worker->pool;
+    this_worker = worker;
+
+    if (pool->pin_topology) {
+        const CpuTopology *topology = pool->pin_topology;
+        cpu_pin(topology->cpus[worker->index % topology->cpu_count]);
+    }
+#if RENDER_TRACE
+    char name[32];
+    snprintf(name, sizeof(name), "pool worker %u", worker->index);
+    TRACE_THREAD(worker->index + 1, name);
+#endif
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        PoolJob *job = pop_job(pool);
+        if (job) {
+            run_job(pool, job, worker->index);
+        } else if (pool->shutdown) {
+            break;
+        } else {
+            pthread_cond_wait(&pool->work_available, &pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+//
+// Starts a pool of worker_count threads that live until pool_delete(). With a
+// pin_topology, worker i is pinned to the i-th CPU of it, and so is the calling
+// thread as worker worker_count, the index its tasks run under while it waits.
+//
+ThreadPool *pool_create(uint32_t worker_count, const CpuTopology *pin_topology) {
+    ThreadPool *pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+    assert(pool != NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_available, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+    pool->worker_count = worker_count;
+    pool->pin_topology = pin_topology;
+
+    pool->threads = (pthread_t *)malloc(worker_count * sizeof(pthread_t));
+    pool->workers = (PoolWorker *)malloc(worker_count * sizeof(PoolWorker));
+    assert(pool->threads != NULL && pool->workers != NULL);
+    for (uint32_t i = 0; i < worker_count; i++) {
+        pool->workers[i] = (PoolWorker){pool, i};
+        int rc = pthread_create(&pool->threads[i], NULL, worker_main, &pool->workers[i]);
+        if (rc) {
+            fprintf(stderr, "ERROR: Return code from pthread_create() is %d\n", rc);
+            exit(1);
+        }
+    }
+    if (pin_topology) {
+        cpu_pin(pin_topology->cpus[worker_count % pin_topology->cpu_count]);
+    }
+
+    return pool;
+}
+
+//
+// Finishes every queued job, then stops and frees the pool.
+//
+void pool_delete(ThreadPool **pool) {
+    if (*pool) {
+        ThreadPool *p = *pool;
+        pthread_mutex_lock(&p->lock);
+        p->shutdown = true;
+        pthread_cond_broadcast(&p->work_available);
+        pthread_mutex_unlock(&p->lock);
+
+        for (uint32_t i = 0; i < p->worker_count; i++) {
+            pthread_join(p->threads[i], NULL);
+        }
+
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->work_available);
+        pthread_cond_destroy(&p->job_done);
+        free(p->threads);
+        free(p->workers);
+        free(p);
+        *pool = NULL;
+    }
+    return;
+}
+
+uint32_t pool_worker_count(const ThreadPool *pool) { return pool->worker_count; }
+
+//
+// Queues task(arg) to run on the pool as part of group. The group must stay alive
+// until it has been waited on.
+//
+void pool_submit(ThreadPool *pool, TaskGroup *group, PoolTask task, void *arg) {
+    PoolJob *job = (PoolJob *)malloc(sizeof(PoolJob));
+    assert(job != NULL);
+    *job = (PoolJob){task, arg, group, NULL};
+
+    pthread_mutex_lock(&pool->lock);
+    group->pending++;
+    if (pool->tail) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pthread_cond_signal(&pool->work_available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+//
+// Returns once every task of group has finished. Until then, the calling thread
+// helps out by running the group's queued jobs, as the worker it is or as worker
+// worker_count if it is not one of the pool's.
+//
+void pool_wait(ThreadPool *pool, TaskGroup *group) {
+    uint32_t worker = this_worker && this_worker->pool == pool ? this_worker->index
+                                                               : pool->worker_count;
+    pthread_mutex_lock(&pool->lock);
+    while (group->pending > 0) {
+        PoolJob *job = pop_group_job(pool, group);
+        if (job) {
+            run_job(pool, job, worker);
+        } else {
+            pthread_cond_wait(&pool->job_done, &pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "cpu.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A task runs on one of the pool's workers. worker is the index of that worker, or
+// the pool's worker count when the task is run by a thread outside of the pool
+// while it waits on the task's group.
+typedef void (*PoolTask)(void *arg, uint32_t worker);
+
+typedef struct ThreadPool ThreadPool;
+
+// Tasks submitted together, so that they can be waited on together
+typedef struct {
+    uint32_t pending; // Tasks submitted but not finished, guarded by the pool's lock
+} TaskGroup;
+
+ThreadPool *pool_create(uint32_t worker_count, const CpuTopology *pin_topology);
+
+void pool_delete(ThreadPool **pool);
+
+uint32_t pool_worker_count(const ThreadPool *pool);
+
+void pool_submit(ThreadPool *pool, TaskGroup *group, PoolTask task, void *arg);
+
+void pool_wait(ThreadPool *pool, TaskGroup *group);
@@ -0,0 +1,302 @@
+#include "render.h"
+#include "checkpoint.h"
+#include "color.h"
+#include "hit.h"
+#include "material.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+
+#include <assert.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+EnvMap *skybox;
+
+// Set by render_request_stop(). Render threads stop after the pixel they are working on.
+static volatile sig_atomic_t stop_requested = 0;
+
+//
+// Asks a running render to stop as soon as possible. Safe to call from a signal
+// handler.
+//
+void render_request_stop(void) { stop_requested = 1; }
+
+//
+// Returns true once render_request_stop() has been called.
+//
+bool render_stop_requested(void) { return stop_requested != 0; }
+
+//
+// Given a unit vector, return the color of the background of the given type in that
+// direction.
+//
+color get_background_color(BackgroundType type, vec3 dir) {
+    color col; // Final bg color to return
+
+    switch (type) {
+    case BACKGROUND_GRADIENT: {
+        // Set background to a gradient between two colors
+        double t = 0.5 * (dir.y + 1.0);
+        color start_color = v3_init(1.0, 1.0, 1.0);
+        color end_color = v3_init(0.5, 0.7, 1.0);
+        col = v3_lerp(start_color, end_color, t);
+        break;
+    }
+    case BACKGROUND_SKYBOX: {
+        // Set background to a skybox image
+        col = envmap_lookup(skybox, dir);
+        break;
+    }
+    default:
+        // Just set bg to black
+        col = v3_init(0, 0, 0);
+        break;
+    }
+
+    return col;
+}
+
+//
+// Returns the color a given ray is pointing at
+//
+color ray_color(RenderArgs *args, ray r, uint32_t depth) {
+    HitRecord rec;
+    rec.t = INFINITY;
+
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    if (depth == 0) {
+        STAT_INC(terminated_depth);
+        return v3_init(0, 0, 0);
+    }
+
+    args->rays++;
+    STAT_RAY(args->max_depth - depth);
+
+    // Check if ray hits an object in our scene
+    bool hit;
+    if (args->bvh) {
+        // Unbounded objects are not in the BVH, so they are tested after it
+        hit = bvh_hit(args->bvh, r, 0.001, INFINITY, &rec);
+        hit = scene_intersect_unbounded(args->scene, r, 0.001, rec.t, &rec) || hit;
+    } else {
+        hit = scene_intersect(args->scene, r, 0.001, INFINITY, &rec);
+    }
+    if (!hit) {
+        // If ray hits nothing, return background color
+        STAT_INC(background_hits);
+        vec3 unit_direction = v3_unit_vector(r.dir);
+        return get_background_color(args->background, unit_direction);
+    }
+    STAT_INC(ray_hits);
+
+    ray scattered;
+    color attenuation;
+    color emitted_col = emitted(rec.material, rec.u, rec.v, rec.p);
+
+    if (!scatter(rec.material, r, &rec, &attenuation, &scattered)) {
+#if RENDER_STATS
+        if (emitted_col.x > 0 || emitted_col.y > 0 || emitted_col.z > 0) {
+            STAT_INC(terminated_emissive);
+        } else {
+            STAT_INC(terminated_absorbed);
+        }
+#endif
+        return emitted_col;
+    }
+
+    return v3_add(emitted_col,
+                  v3_hadamard(attenuation, ray_color(args, scattered, depth - 1)));
+}
+
+//
+// Takes count samples of the pixel at (x, y), starting at sample index first, and
+// returns their sum. Each sample draws from its own random stream seeded by
+// (seed, pixel, sample), so a pixel comes out the same no matter which thread renders
+// it, in which order, or over how many passes and restarts.
+//
+color render_pixel(RenderArgs *args, uint32_t x, uint32_t y, uint32_t first,
+                   uint32_t count) {
+    uint32_t pixel = y * args->image_width + x;
+
+    color pixel_color = v3_init(0, 0, 0);
+    for (uint32_t s = first; s < first + count; s++) {
+        random_seed(sample_seed(args->seed, pixel, s));
+
+        // Map image coordinates to normalized (u, v) coordinates,
+        // offset by random amount for antialiasing
+        double u = (double)(x + random_uniform()) / (args->image_width - 1);
+        double v = 1.0 - ((double)(y + random_uniform()) / (args->image_height - 1));
+
+        // Get view ray from camera to viewport
+        ray view_ray = get_view_ray(args->cam, u, v);
+
+        // Accumulate color of what ray is looking at
+        pixel_color = v3_add(pixel_color, ray_color(args, view_ray, args->max_depth));
+    }
+
+    return pixel_color;
+}
+
+//
+// Renders pixels first_pixel to end_pixel of args->fb up to args->target_samples
+// samples, stopping early when asked to or at the deadline.
+//
+void render(RenderArgs *args) {
+    TRACE_BEGIN("render tile");
+
+    for (uint32_t p = args->first_pixel; p < args->end_pixel; p++) {
+        if (stop_requested || (args->deadline > 0 && now_seconds() >= args->deadline)) {
+            break;
+        }
+
+        uint32_t done = args->fb->samples[p];
+        if (done >= args->target_samples) {
+            continue;
+        }
+
+        uint32_t x = p % args->image_width;
+        uint32_t y = p / args->image_width + args->row_offset;
+        uint32_t count = args->target_samples - done;
+
+        uint64_t cost_start = args->cost ? cost_now(args->cost_metric) : 0;
+
+        color pixel_color = render_pixel(args, x, y, done, count);
+
+        // Accumulate the pixel's samples into the framebuffer
+        fb_add_samples(args->fb, p, pixel_color, count);
+        STAT_ADD(samples, count);
+
+        // Each pixel is only ever rendered by one thread at a time, so no locking needed
+        if (args->cost) {
+            args->cost[y * args->image_width + x] +=
+                (float)(cost_now(args->cost_metric) - cost_start);
+        }
+    }
+
+    TRACE_END("render tile");
+}
+
+//
+// Pool task that renders one tile, a RenderArgs set up by render_pass().
+//
+static void render_task(void *tile_args, uint32_t worker) {
+    RenderArgs *args = (RenderArgs *)tile_args;
+    if (args->placement) {
+        // Traverse the copy of the scene in the memory of the worker's node
+        uint32_t node = placement_node(args->placement, worker);
+        args->scene = args->placement->scenes[node];
+        args->bvh = args->bvh ? args->placement->bvhs[node] : NULL;
+    }
+    render(args);
+}
+
+//
+// Runs one progressive pass, bringing every pixel up to args->target_samples samples.
+// The pass is split into tiles of RENDER_TILE_ROWS rows that the pool's workers take
+// on as they become free, and the number of rays traced is added to args->rays.
+//
+void render_pass(RenderArgs *args) {
+    uint32_t pixel_count = args->fb->width * args->fb->height;
+    if (args->pool == NULL) {
+        args->first_pixel = 0;
+        args->end_pixel = pixel_count;
+        render(args);
+        return;
+    }
+
+    uint32_t tile_pixels = RENDER_TILE_ROWS * args->fb->width;
+    uint32_t tile_count = (pixel_count + tile_pixels - 1) / tile_pixels;
+    RenderArgs *tiles = (RenderArgs *)malloc(tile_count * sizeof(RenderArgs));
+    assert(tiles != NULL);
+
+    TaskGroup group = {0};
+    for (uint32_t t = 0; t < tile_count; t++) {
+        tiles[t] = *args;
+        tiles[t].first_pixel = t * tile_pixels;
+        tiles[t].end_pixel = pixel_count - tiles[t].first_pixel < tile_pixels
+                                 ? pixel_count
+                                 : tiles[t].first_pixel + tile_pixels;
+        tiles[t].rays = 0;
+        pool_submit(args->pool, &group, render_task, &tiles[t]);
+    }
+    pool_wait(args->pool, &group);
+
+    for (uint32_t t = 0; t < tile_count; t++) {
+        args->rays += tiles[t].rays;
+    }
+    free(tiles);
+}
+
+//
+// Renders args->fb in progressive passes until every pixel has samples_per_pixel
+// samples, the time budget (if non-zero) runs out, or the render is interrupted.
+// If checkpoint_path is given, the accumulation state is checkpointed there
+// periodically and on interruption.
+//
+void render_progressive(RenderArgs *args, uint32_t samples_per_pixel, double time_budget,
+                        const char *checkpoint_path, uint64_t render_key, bool verbose) {
+    // Each pass adds SAMPLES_PER_PASS samples to every pixel, and the accumulated
+    // samples are checkpointed every CHECKPOINT_INTERVAL seconds.
+    // With a time budget, passes continue until the deadline instead of stopping at
+    // samples_per_pixel; the threads check the deadline after every pixel, so the
+    // last pass is cut short rather than overrunning. The first pass then takes a
+    // single sample, so that every pixel gets one before any gets more, and later
+    // passes only grow to what the measured time per sample says still fits.
+    Framebuffer *fb = args->fb;
+    if (time_budget > 0) {
+        args->deadline = now_seconds() + time_budget;
+    }
+    time_t last_checkpoint = time(NULL);
+    uint32_t samples_done = fb_min_samples(fb);
+    double seconds_per_sample = 0; // Time one sample per pixel took in the last pass
+    while (!stop_requested && (time_budget > 0 ? now_seconds() < args->deadline
+                                               : samples_done < samples_per_pixel)) {
+        uint32_t pass_samples = SAMPLES_PER_PASS;
+        if (time_budget > 0 && seconds_per_sample == 0) {
+            pass_samples = 1;
+        } else if (time_budget > 0) {
+            // Shrink the final pass to what still fits, so that it covers the whole
+            // image instead of being cut off partway through.
+            double fits = (args->deadline - now_seconds()) / seconds_per_sample;
+            pass_samples = fits < pass_samples ? (uint32_t)fmax(fits, 1.0) : pass_samples;
+        }
+        args->target_samples = samples_done + pass_samples;
+        if (time_budget <= 0 && args->target_samples > samples_per_pixel) {
+            args->target_samples = samples_per_pixel;
+        }
+
+        double pass_start = now_seconds();
+        TRACE_BEGIN("pass");
+        render_pass(args);
+        TRACE_END("pass");
+        seconds_per_sample = (now_seconds() - pass_start) / pass_samples;
+
+        samples_done = fb_min_samples(fb);
+        if (verbose && time_budget > 0) {
+            printf("Samples per pixel: %u (%.1f s left)\n", samples_done,
+                   fmax(args->deadline - now_seconds(), 0.0));
+        } else if (verbose) {
+            printf("Samples per pixel: %u / %u\n", samples_done, samples_per_pixel);
+        }
+
+        if (checkpoint_path && !stop_requested &&
+            time(NULL) - last_checkpoint >= CHECKPOINT_INTERVAL) {
+            TRACE_BEGIN("checkpoint");
+            checkpoint_write(checkpoint_path, fb, args->seed, render_key);
+            TRACE_END("checkpoint");
+            last_checkpoint = time(NULL);
+        }
+    }
+
+    if (checkpoint_path && stop_requested) {
+        // Keep the samples taken so far so the next run can pick up from here.
+        printf("Render interrupted, writing checkpoint %s\n", checkpoint_path);
+        checkpoint_write(checkpoint_path, fb, args->seed, render_key);
+    } else if (checkpoint_path) {
+        remove(checkpoint_path);
+    }
+}
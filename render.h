@@ -0,0 +1,63 @@
+#pragma once
+
+#include "bvh.h"
+#include "camera.h"
+#include "cost.h"
+#include "envmap.h"
+#include "framebuffer.h"
+#include "placement.h"
+#include "pool.h"
+#include "ray.h"
+#include "scene.h"
+#include "vec3.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SAMPLES_PER_PASS 10
+#define RENDER_TILE_ROWS 4 // Rows of the framebuffer rendered by each pool task
+#define CHECKPOINT_INTERVAL 60 // Seconds between checkpoints
+
+// Skybox image used for the image based background
+extern EnvMap *skybox;
+
+// The gradient comes first so that zero initialized RenderArgs get the default background
+typedef enum { BACKGROUND_GRADIENT, BACKGROUND_SKYBOX, BACKGROUND_BLACK } BackgroundType;
+
+typedef struct {
+    Scene *scene;
+    Camera *cam;
+    BVHNode *bvh; // NULL to intersect every object in the scene instead
+    BackgroundType background;
+    uint32_t image_width, image_height, max_depth;
+    uint32_t target_samples; // Every pixel is brought up to this many samples
+    double deadline;         // now_seconds() at which to stop, 0 for no deadline
+    Framebuffer *fb;         // Rows row_offset to row_offset + fb->height of the image
+    uint32_t row_offset;
+    uint64_t seed;
+    ThreadPool *pool;        // Runs the passes, NULL to render on the calling thread
+    uint32_t first_pixel;    // Pixels of fb render() works on, set by render_pass()
+    uint32_t end_pixel;
+    Placement *placement;    // Per NUMA node replicas of scene and bvh, NULL for none
+    CostMetric cost_metric;
+    float *cost;   // Accumulated cost of each pixel of the whole image, NULL for none
+    uint64_t rays; // Number of rays traced
+} RenderArgs;
+
+void render_request_stop(void);
+
+bool render_stop_requested(void);
+
+color get_background_color(BackgroundType type, vec3 dir);
+
+color ray_color(RenderArgs *args, ray r, uint32_t depth);
+
+color render_pixel(RenderArgs *args, uint32_t x, uint32_t y, uint32_t first,
+                   uint32_t count);
+
+void render(RenderArgs *args);
+
+void render_pass(RenderArgs *args);
+
+void render_progressive(RenderArgs *args, uint32_t samples_per_pixel, double time_budget,
+                        const char *checkpoint_path, uint64_t render_key, bool verbose);
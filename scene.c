@@ -1,7 +1,11 @@
 #include "scene.h"
 #include "aabb.h"
+#include "bvh.h"
 #include "hittable.h"
+#include "instance.h"
 #include "material.h"
+#include "mesh.h"
+#include "plane.h"
 #include "sphere.h"
 #include "util.h"
 #include "vec3.h"
@@ -10,10 +14,11 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 // Constructor for a scene
 Scene *scene_create(void) {
-    Scene *scene = (Scene *)malloc(sizeof(Scene));
+    Scene *scene = (Scene *)calloc(1, sizeof(Scene));
     assert(scene != NULL);
 
     scene->object_count = 0;
@@ -25,6 +30,27 @@ Scene *scene_create(void) {
     return scene;
 }
 
+//
+// Deep copies a scene's objects, in the same order. Materials are shared.
+//
+Scene *scene_clone(Scene *scene) {
+    Scene *copy = (Scene *)calloc(1, sizeof(Scene));
+    assert(copy != NULL);
+
+    copy->object_count = scene->object_count;
+    copy->max_count = scene->max_count;
+    copy->objects = (Hittable **)calloc(copy->max_count, sizeof(Hittable *));
+    assert(copy->objects != NULL);
+    for (uint32_t i = 0; i < scene->object_count; i++) {
+        copy->objects[i] = hittable_clone(scene->objects[i]);
+    }
+    for (uint32_t i = 0; i < scene->unbounded_count; i++) {
+        scene_insert_hittable(copy, hittable_clone(scene->unbounded[i]));
+    }
+
+    return copy;
+}
+
 //
 // Destructor for a scene - deletes every object in the scene.
 // TODO: Need to delete materials accociated w/ scene objects
@@ -32,10 +58,29 @@ Scene *scene_create(void) {
 void scene_delete(Scene **scene) {
     if (*scene) {
 
-        // Free every object in our object array
-        for (uint32_t i = 0; i < (*scene)->object_count; i++) {
-            hittable_delete(&((*scene)->objects[i]));
+        // Free every object in our object array, apart from those in the arena
+        Scene *sc = *scene;
+        for (uint32_t i = 0; i < sc->object_count; i++) {
+            Hittable *h = sc->objects[i];
+            if (h < sc->hittable_arena || h >= sc->hittable_arena + sc->arena_count) {
+                hittable_delete(&sc->objects[i]);
+            }
+        }
+        if (sc->mapping) {
+            munmap(sc->mapping, sc->mapping_size);
+        } else {
+            free(sc->sphere_arena);
+        }
+        free(sc->hittable_arena);
+        for (uint32_t i = 0; i < sc->unbounded_count; i++) {
+            hittable_delete(&sc->unbounded[i]);
+        }
+        free(sc->unbounded);
+
+        for (uint32_t i = 0; i < sc->material_count; i++) {
+            mat_delete(&sc->materials[i]);
         }
+        free(sc->materials);
 
         free((*scene)->objects);
         free(*scene);
@@ -44,11 +89,62 @@ void scene_delete(Scene **scene) {
     return;
 }
 
+//
+// Makes room for sphere_count more spheres, so that adding them does not grow the
+// object array again and does not allocate each sphere and hittable on its own.
+//
+void scene_reserve(Scene *scene, uint32_t sphere_count) {
+    if (scene->arena_count > 0 || sphere_count == 0) {
+        return; // Only one arena per scene
+    }
+
+    // The object array grows once it is full, so leave one spare slot
+    uint32_t capacity = scene->object_count + sphere_count + 1;
+    if (capacity > scene->max_count) {
+        Hittable **temp = (Hittable **)realloc(scene->objects, capacity * sizeof(Hittable *));
+        if (temp == NULL) {
+            fprintf(stderr, "ERROR: Hittable array reallocate failed!\n");
+            exit(1);
+        }
+        scene->objects = temp;
+        scene->max_count = capacity;
+    }
+
+    scene->sphere_arena = (Sphere *)malloc(sphere_count * sizeof(Sphere));
+    scene->hittable_arena = (Hittable *)malloc(sphere_count * sizeof(Hittable));
+    assert(scene->sphere_arena != NULL && scene->hittable_arena != NULL);
+    scene->arena_count = sphere_count;
+    scene->arena_used = 0;
+}
+
+//
+// Hands a material over to the scene, which frees it in scene_delete().
+//
+void scene_own_material(Scene *scene, Material *material) {
+    if (scene->material_count == scene->material_max) {
+        scene->material_max = scene->material_max ? scene->material_max * 2 : 16;
+        scene->materials = (Material **)realloc(scene->materials,
+                                                scene->material_max * sizeof(Material *));
+        assert(scene->materials != NULL);
+    }
+    scene->materials[scene->material_count++] = material;
+}
+
 //
 // Adds a sphere to the scene.
 //
 void scene_add_sphere(Scene *scene, double x, double y, double z, double r,
                       Material *material) {
+    if (scene->arena_used < scene->arena_count) {
+        // Take the next sphere and hittable of the arena
+        Sphere *s = &scene->sphere_arena[scene->arena_used];
+        Hittable *hittable = &scene->hittable_arena[scene->arena_used++];
+        *s = (Sphere){v3_init(x, y, z), r, material};
+        *hittable = (Hittable){(void *)s, SPHERE};
+        scene_insert_hittable(scene, hittable);
+        return;
+    }
+
     // Create sphere
     Sphere *s = sphere_create(v3_init(x, y, z), r, material);
 
@@ -59,13 +155,126 @@ void scene_add_sphere(Scene *scene, double x, double y, double z, double r,
     scene_insert_hittable(scene, hittable);
 }
 
+//
+// Adds an infinite plane through point, facing along normal, to the scene.
+//
+void scene_add_plane(Scene *scene, vec3 point, vec3 normal, Material *material) {
+    scene_insert_hittable(scene,
+                          hittable_create(plane_create(point, normal, material), PLANE));
+}
+
+//
+// Adds an axis aligned rectangle to the scene, see Rect for the parameters.
+//
+void scene_add_rect(Scene *scene, uint32_t axis, double k, double u0, double u1, double v0,
+                    double v1, Material *material) {
+    Rect *rect = rect_create(axis, k, u0, u1, v0, v1, material);
+    scene_insert_hittable(scene, hittable_create(rect, RECT));
+}
 
+//
+// Adds a disk perpendicular to an axis to the scene.
+//
+void scene_add_disk(Scene *scene, vec3 center, double radius, uint32_t axis,
+                    Material *material) {
+    scene_insert_hittable(scene,
+                          hittable_create(disk_create(center, radius, axis, material), DISK));
+}
+
+//
+// Adds a triangle mesh to the scene, which takes ownership of it. The mesh's own BVH
+// makes it a single object to the scene's.
+//
+void scene_add_mesh(Scene *scene, Mesh *mesh) {
+    scene_insert_hittable(scene, hittable_create(mesh, MESH));
+}
+
+//
+// Adds an instance of a group to the scene, which takes ownership of it.
+//
+void scene_add_instance(Scene *scene, Instance *instance) {
+    scene_insert_hittable(scene, hittable_create(instance, INSTANCE));
+}
+
+//
+// Moves and resizes the sphere at index in the scene's object array, in place. Building
+// a BVH reorders the array, but a sphere stays at its index from then on; refit or
+// update the BVH with bvh_update() once done moving objects. Returns false if the
+// object there is not a sphere.
+//
+bool scene_update_sphere(Scene *scene, uint32_t index, vec3 center, double radius) {
+    assert(index < scene->object_count);
+    Hittable *h = scene->objects[index];
+    if (h->type != SPHERE) {
+        return false;
+    }
+    Sphere *s = (Sphere *)h->object;
+    s->center = center;
+    s->radius = radius;
+    return true;
+}
+
+//
+// Moves the object at index in the scene's object array by offset, in place, like
+// scene_update_sphere(). Meshes cannot move, as their vertices may be mapped from a
+// cache; place a mesh into a group and move its instance instead. Returns false for
+// them.
+//
+bool scene_move_object(Scene *scene, uint32_t index, vec3 offset) {
+    assert(index < scene->object_count);
+    Hittable *h = scene->objects[index];
+    switch (h->type) {
+    case SPHERE: {
+        Sphere *s = (Sphere *)h->object;
+        s->center = v3_add(s->center, offset);
+        return true;
+    }
+    case RECT: {
+        Rect *rect = (Rect *)h->object;
+        // u and v run along the other two axes, in order
+        double d[3] = {offset.x, offset.y, offset.z};
+        double du = d[rect->axis == 0 ? 1 : 0], dv = d[rect->axis == 2 ? 1 : 2];
+        rect->k += d[rect->axis];
+        rect->u0 += du, rect->u1 += du;
+        rect->v0 += dv, rect->v1 += dv;
+        return true;
+    }
+    case DISK: {
+        Disk *d = (Disk *)h->object;
+        d->center = v3_add(d->center, offset);
+        return true;
+    }
+    case INSTANCE: {
+        Instance *instance = (Instance *)h->object;
+        instance->to_world =
+            transform_compose(transform_translate(offset), instance->to_world);
+        transform_invert(instance->to_world, &instance->to_object);
+        instance->box = transform_box(&instance->to_world, instance->group->box);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
 
 //
 // Inserts a hittable object into the scene. If the scene hittable array is full,
-// expands memory needed.
+// expands memory needed. Objects without a bounding box go into a list of their own
+// instead, which is kept out of the BVH and tested on its own.
 //
 void scene_insert_hittable(Scene *scene, Hittable *hittable) {
+    AABB box;
+    if (!hittable_bounding_box(*hittable, &box)) {
+        if (scene->unbounded_count == scene->unbounded_max) {
+            scene->unbounded_max = scene->unbounded_max ? scene->unbounded_max * 2 : 4;
+            scene->unbounded = (Hittable **)realloc(
+                scene->unbounded, scene->unbounded_max * sizeof(Hittable *));
+            assert(scene->unbounded != NULL);
+        }
+        scene->unbounded[scene->unbounded_count++] = hittable;
+        return;
+    }
+
     // Insert into next empty spot
     scene->objects[scene->object_count] = hittable;
     scene->object_count += 1; // Increment our counter
@@ -93,17 +302,10 @@ void scene_insert_hittable(Scene *scene, Hittable *hittable) {
 // Create and initialize a randomized scene
 //
 Scene *random_scene(void) {
-    Scene *scene = (Scene *)malloc(sizeof(Scene));
-    assert(scene != NULL);
-
-    scene->object_count = 0;
-    scene->max_count = 16;
-
-    // Create an initial array to store our objects. Start off w/ a size of 16.
-    scene->objects = (Hittable **)calloc(scene->max_count, sizeof(Hittable *));
+    Scene *scene = scene_create();
 
     Material *ground_material = create_lambertian(v3_init(0.5, 0.5, 0.5));
-    scene_add_sphere(scene, 0, -1000, 0, 1000, ground_material);
+    scene_add_plane(scene, v3_init(0, 0, 0), v3_init(0, 1, 0), ground_material);
 
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
@@ -149,6 +351,168 @@ Scene *random_scene(void) {
     return scene;
 }
 
+//
+// A metal sphere resting on a diffuse ground plane.
+//
+Scene *two_sphere_scene(void) {
+    Scene *scene = scene_create();
+
+    Material *red_metal = create_metal(v3_init(8.0, 0.1, 0.1), 0.1);
+    Material *white_diffuse = create_lambertian(v3_init(0.73, 0.73, 0.73));
+
+    scene_add_sphere(scene, 0, 0, 0, 1, red_metal);
+    scene_add_plane(scene, v3_init(0, -1, 0), v3_init(0, 1, 0), white_diffuse);
+
+    return scene;
+}
+
+//
+// A dense field of count small spheres w/ random diffuse and metal materials
+// scattered over a 40 x 40 patch of ground.
+//
+Scene *sphere_field_scene(uint32_t count) {
+    Scene *scene = scene_create();
+
+    Material *ground_material = create_lambertian(v3_init(0.5, 0.5, 0.5));
+    scene_add_plane(scene, v3_init(0, 0, 0), v3_init(0, 1, 0), ground_material);
+
+    for (uint32_t i = 0; i < count; i++) {
+        double radius = random_double(0.05, 0.2);
+        vec3 center = v3_init(random_double(-20, 20), radius + random_double(0, 2),
+                              random_double(-20, 20));
+
+        Material *sphere_material;
+        if (random_uniform() < 0.8) {
+            sphere_material =
+                create_lambertian(v3_hadamard(v3_random_uniform(), v3_random_uniform()));
+        } else {
+            sphere_material = create_metal(v3_random_range(0.5, 1.0), random_double(0, 0.5));
+        }
+        scene_add_sphere(scene, center.x, center.y, center.z, radius, sphere_material);
+    }
+
+    return scene;
+}
+
+//
+// A grid of glass spheres, some w/ hollow glass shells inside, in front of a few
+// diffuse ones, so most paths go through several refractions.
+//
+Scene *glass_scene(void) {
+    Scene *scene = scene_create();
+
+    Material *ground_material = create_lambertian(v3_init(0.5, 0.5, 0.5));
+    scene_add_plane(scene, v3_init(0, 0, 0), v3_init(0, 1, 0), ground_material);
+
+    Material *glass = create_dielectric(1.5);
+    Material *air = create_dielectric(1.0 / 1.5);
+    for (int a = -5; a <= 5; a++) {
+        for (int b = -5; b <= 5; b++) {
+            double x = a * 0.9;
+            double z = b * 0.9;
+            scene_add_sphere(scene, x, 0.4, z, 0.4, glass);
+            if ((a + b) % 2 == 0) {
+                // Hollow sphere: a smaller sphere of "air" inside the glass one
+                scene_add_sphere(scene, x, 0.4, z, 0.3, air);
+            }
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        Material *diffuse = create_lambertian(v3_random_uniform());
+        scene_add_sphere(scene, -3 + 3 * i, 1, -6, 1.0, diffuse);
+    }
+
+    return scene;
+}
+
+//
+// A tree of about 200 spheres: a trunk and a canopy of leaves around its top. It is
+// built once into a group with a BVH of its own, which forest_scene() instances.
+//
+static Group *tree_group(void) {
+    Scene *tree = scene_create();
+    Material *bark = create_lambertian(v3_init(0.35, 0.22, 0.12));
+    Material *leaves = create_lambertian(v3_init(0.15, 0.45, 0.1));
+    for (int i = 0; i < 16; i++) {
+        scene_add_sphere(tree, 0, i * 0.1, 0, 0.08 - i * 0.002, bark);
+    }
+    for (int i = 0; i < 184; i++) {
+        vec3 p = v3_add(v3_init(0, 2, 0), v3_scale(random_in_unit_sphere(), 0.8));
+        scene_add_sphere(tree, p.x, p.y, p.z, random_double(0.08, 0.2), leaves);
+    }
+    return group_create(tree, bvh_create(tree, 0, tree->object_count - 1, 1));
+}
+
+//
+// A forest of count instances of one tree over a 40 x 40 patch of ground, each turned,
+// scaled and placed at random, some w/ autumn leaves. The scene's BVH only holds the
+// instances, and every tree shares the group's spheres and BVH.
+//
+Scene *forest_scene(uint32_t count) {
+    Scene *scene = scene_create();
+
+    Material *ground_material = create_lambertian(v3_init(0.5, 0.5, 0.5));
+    scene_add_plane(scene, v3_init(0, 0, 0), v3_init(0, 1, 0), ground_material);
+
+    Material *autumn[3] = {create_lambertian(v3_init(0.7, 0.3, 0.05)),
+                           create_lambertian(v3_init(0.6, 0.1, 0.05)),
+                           create_lambertian(v3_init(0.8, 0.6, 0.1))};
+    Group *tree = tree_group();
+    for (uint32_t i = 0; i < count; i++) {
+        Transform to_world = transform_scale(v3_scale(v3_init(1, 1, 1),
+                                                      random_double(0.5, 1.5)));
+        Transform rotation = transform_rotate(1, random_double(0, 360));
+        to_world = transform_compose(rotation, to_world);
+        vec3 position = v3_init(random_double(-20, 20), 0, random_double(-20, 20));
+        to_world = transform_compose(transform_translate(position), to_world);
+        Material *material = random_uniform() < 0.2 ? autumn[random_int(0, 2)] : NULL;
+        scene_add_instance(scene, instance_create(tree, to_world, material));
+    }
+    group_release(&tree); // The instances keep it
+
+    return scene;
+}
+
+//
+// Intersects a ray with every object in the scene, without any acceleration
+// structure, and stores the closest hit in rec. Slow, but simple enough to serve as
+// the ground truth the accelerated traversals are checked against.
+//
+bool scene_intersect(Scene *scene, ray r, double t_min, double t_max, HitRecord *rec) {
+    HitRecord temp_rec;
+    bool hit_anything = false;
+    double closest = t_max;
+
+    for (uint32_t i = 0; i < scene->object_count; i++) {
+        if (hittable_intersect(*scene->objects[i], r, t_min, closest, &temp_rec)) {
+            hit_anything = true;
+            closest = temp_rec.t;
+            *rec = temp_rec;
+        }
+    }
+
+    return scene_intersect_unbounded(scene, r, t_min, closest, rec) || hit_anything;
+}
+
+//
+// Intersects a ray with the scene's unbounded objects, the ones outside the BVH, and
+// stores the hit in rec if it is the closest yet. Pass the distance of the closest
+// hit so far as t_max.
+//
+bool scene_intersect_unbounded(Scene *scene, ray r, double t_min, double t_max,
+                               HitRecord *rec) {
+    HitRecord temp_rec;
+    bool hit_anything = false;
+    for (uint32_t i = 0; i < scene->unbounded_count; i++) {
+        if (hittable_intersect(*scene->unbounded[i], r, t_min, t_max, &temp_rec)) {
+            hit_anything = true;
+            t_max = temp_rec.t;
+            *rec = temp_rec;
+        }
+    }
+    return hit_anything;
+}
 
 // Print the objects in our scene
 void scene_print(Scene *scene) {
@@ -156,10 +520,87 @@ void scene_print(Scene *scene) {
         for (uint32_t i = 0; i < scene->object_count; i++) {
             hittable_print(scene->objects[i]);
         }
+        for (uint32_t i = 0; i < scene->unbounded_count; i++) {
+            hittable_print(scene->unbounded[i]);
+        }
     }
     return;
 }
 
+//
+// Returns a hash of the scene's contents: the geometry of every object and the
+// parameters of its material.
+//
+uint64_t scene_hash(Scene *scene) {
+    uint64_t hash = hash_bytes(&scene->object_count, sizeof(scene->object_count), 0);
+    hash = hash_bytes(&scene->unbounded_count, sizeof(scene->unbounded_count), hash);
+    uint32_t count = scene->object_count + scene->unbounded_count;
+    for (uint32_t i = 0; i < count; i++) {
+        Hittable *h = i < scene->object_count ? scene->objects[i]
+                                               : scene->unbounded[i - scene->object_count];
+        hash = hash_bytes(&h->type, sizeof(h->type), hash);
+        Material *material = NULL;
+        switch (h->type) {
+        case SPHERE: {
+            Sphere *s = (Sphere *)h->object;
+            hash = hash_bytes(&s->center, sizeof(s->center), hash);
+            hash = hash_bytes(&s->radius, sizeof(s->radius), hash);
+            material = s->material;
+            break;
+        }
+        case PLANE: {
+            Plane *p = (Plane *)h->object;
+            hash = hash_bytes(&p->point, sizeof(p->point), hash);
+            hash = hash_bytes(&p->normal, sizeof(p->normal), hash);
+            material = p->material;
+            break;
+        }
+        case RECT: {
+            Rect *rect = (Rect *)h->object;
+            hash = hash_bytes(&rect->axis, sizeof(rect->axis), hash);
+            double bounds[5] = {rect->k, rect->u0, rect->u1, rect->v0, rect->v1};
+            hash = hash_bytes(bounds, sizeof(bounds), hash);
+            material = rect->material;
+            break;
+        }
+        case DISK: {
+            Disk *d = (Disk *)h->object;
+            hash = hash_bytes(&d->center, sizeof(d->center), hash);
+            hash = hash_bytes(&d->radius, sizeof(d->radius), hash);
+            hash = hash_bytes(&d->axis, sizeof(d->axis), hash);
+            material = d->material;
+            break;
+        }
+        case MESH: {
+            Mesh *mesh = (Mesh *)h->object;
+            size_t positions = (size_t)mesh->vertex_count * 3 * sizeof(float);
+            size_t triangles = (size_t)mesh->triangle_count * sizeof(MeshTriangle);
+            hash = hash_bytes(mesh->positions, positions, hash);
+            hash = hash_bytes(mesh->triangles, triangles, hash);
+            material = mesh->material;
+            break;
+        }
+        case INSTANCE: {
+            Instance *instance = (Instance *)h->object;
+            hash = hash_bytes(&instance->to_world, sizeof(instance->to_world), hash);
+            uint64_t group_hash = instance->group->hash;
+            hash = hash_bytes(&group_hash, sizeof(group_hash), hash);
+            material = instance->material;
+            break;
+        }
+        default:
+            fprintf(stderr, "ERROR: Unknown object type encountered in scene_hash()!\n");
+            exit(1);
+            break;
+        }
+        // Instances without a material of their own keep their group's
+        if (material) {
+            hash = mat_hash(material, hash);
+        }
+    }
+    return hash;
+}
+
 // ---------------------------------------------------------------------------------
 // Quick Sort functions used for sorting scene objects and BVH construction.
 // ---------------------------------------------------------------------------------
@@ -167,8 +608,8 @@ void scene_print(Scene *scene) {
 //
 // Swap two hittable pointers
 //
-void swap(Hittable *a, Hittable *b) {
-    Hittable t = *a;
+void swap(Hittable **a, Hittable **b) {
+    Hittable *t = *a;
     *a = *b;
     *b = t;
 }
@@ -176,19 +617,27 @@ void swap(Hittable *a, Hittable *b) {
 //
 // Partition hittables array along the specified axis.
 // We are sorting by the min field of the object's bounding box.
+// The pivot is the median of the first, middle and last objects, so that ranges which
+// are already sorted, as they are when bvh_update() rebuilds a subtree, do not take
+// quadratic time.
 //
 uint32_t partition(Hittable **objects, int64_t low, int64_t high, uint8_t axis) {
+    int64_t mid = low + (high - low) / 2;
+    AABB a, b, c;
+    hittable_bounding_box(*objects[low], &a);
+    hittable_bounding_box(*objects[mid], &b);
+    hittable_bounding_box(*objects[high], &c);
+    bool ab = v3_compare(a.min, b.min, axis), bc = v3_compare(b.min, c.min, axis),
+         ac = v3_compare(a.min, c.min, axis);
+    if (ab == bc) {
+        swap(&objects[mid], &objects[high]); // b is the median
+    } else if (ab != ac) {
+        swap(&objects[low], &objects[high]); // a is the median
+    }
+
     // Pivot
     AABB pivot;
-    switch (objects[high]->type) {
-        case SPHERE:
-            sphere_bounding_box(*((Sphere *)(objects[high]->object)), &pivot);
-            break;
-        default:
-            fprintf(stderr, "ERROR: Unknown object type encountered in partition()!\n");
-            exit(1);
-            break;
-    }
+    hittable_bounding_box(*objects[high], &pivot);
 
     // Index of smaller element and indicates the right position of pivot found so far
     int64_t i = (low - 1);
@@ -196,21 +645,13 @@ uint32_t partition(Hittable **objects, int64_t low, int64_t high, uint8_t axis)
     for (int64_t j = low; j <= high; j++) {
         // If current element is smaller than pivot
         AABB element;
-        switch (objects[j]->type) {
-        case SPHERE:
-            sphere_bounding_box(*((Sphere *)(objects[j]->object)), &element);
-            break;
-        default:
-            fprintf(stderr, "ERROR: Unknown object type encountered in partition()!\n");
-            exit(1);
-            break;
-        }
+        hittable_bounding_box(*objects[j], &element);
         if (v3_compare(element.min, pivot.min, axis)) {
             i++; // increment index of smaller element
-            swap(objects[i], objects[j]);
+            swap(&objects[i], &objects[j]);
         }
     }
-    swap(objects[i + 1], objects[high]);
+    swap(&objects[i + 1], &objects[high]);
     return (i + 1);
 }
 
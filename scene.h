@@ -4,29 +4,82 @@
 #include "hit.h"
 #include "hittable.h"
 #include "material.h"
+#include "mesh.h"
 #include "ray.h"
+#include "sphere.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
+typedef struct Instance Instance;
+
 typedef struct {
     Hittable **objects;
     uint32_t object_count;
     uint32_t max_count;
+    // Spheres and their hittables allocated in one block by scene_reserve()
+    Sphere *sphere_arena;
+    Hittable *hittable_arena;
+    uint32_t arena_used, arena_count;
+    // Objects without a bounding box, like planes, kept out of the BVH
+    Hittable **unbounded;
+    uint32_t unbounded_count, unbounded_max;
+    // Materials the scene frees along with itself
+    Material **materials;
+    uint32_t material_count, material_max;
+    // Scene cache the sphere arena points into, NULL if the scene was not read from one
+    void *mapping;
+    size_t mapping_size;
 } Scene;
 
 Scene *scene_create(void);
 
 Scene *random_scene(void);
 
+Scene *two_sphere_scene(void);
+
+Scene *sphere_field_scene(uint32_t count);
+
+Scene *glass_scene(void);
+
+Scene *forest_scene(uint32_t count);
+
+Scene *scene_clone(Scene *);
+
 void scene_delete(Scene **);
 
+void scene_reserve(Scene *, uint32_t sphere_count);
+
+void scene_own_material(Scene *, Material *material);
+
 void scene_add_sphere(Scene *, double x, double y, double z, double r,
                       Material *material);
 
+void scene_add_plane(Scene *, vec3 point, vec3 normal, Material *material);
+
+void scene_add_rect(Scene *, uint32_t axis, double k, double u0, double u1, double v0,
+                    double v1, Material *material);
+
+void scene_add_disk(Scene *, vec3 center, double radius, uint32_t axis,
+                    Material *material);
+
+void scene_add_mesh(Scene *, Mesh *mesh);
+
+void scene_add_instance(Scene *, Instance *instance);
+
+bool scene_update_sphere(Scene *, uint32_t index, vec3 center, double radius);
+
+bool scene_move_object(Scene *, uint32_t index, vec3 offset);
+
 bool scene_intersect(Scene *, ray r, double t_min, double t_max, HitRecord *rec);
 
+bool scene_intersect_unbounded(Scene *, ray r, double t_min, double t_max,
+                               HitRecord *rec);
+
 void scene_print(Scene *);
 
+uint64_t scene_hash(Scene *);
+
 void scene_sort(Scene *, int64_t start, int64_t end, uint8_t axis);
 
 void scene_insert_hittable(Scene *, Hittable *);
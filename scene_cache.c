@@ -0,0 +1,513 @@
+#include "scene_cache.h"
+#include "hittable.h"
+#include "plane.h"
+#include "sphere.h"
+#include "util.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A scene cache holds a loaded scene file together with the BVH built over it, so
+// that rendering the same file again skips both parsing and building. Reading it maps
+// the file and keeps the mapping for as long as the scene lives: the scene's spheres
+// and the BVH's nodes are the ones in the file, stored as they are in memory, with
+// indices in place of pointers. One pass over each array turns the indices back into
+// pointers, in the mapping's private copy of the pages. Only the materials and the
+// few other shapes are made anew, along with the scene's object arrays.
+//
+// The key is a hash of the scene file's contents, the leaf size and the seed the BVH
+// was built with, so editing the file or changing either setting misses the cache.
+//
+// Layout (native endianness and struct layout, every array 8 byte aligned):
+//      SceneCacheHeader
+//      MaterialRecord materials[material_count]
+//      BVHNode        nodes[node_count], children after their parent
+//      Sphere         spheres[sphere_count]
+//      ShapeRecord    shapes[shape_count]
+// A node's left and right hold the indices of its children and its objects the index
+// of its first object; a sphere's material holds the index of its material. The nodes
+// are in the order bvh_pack() left them in if the tree was packed, in pre-order if not.
+//
+// The scene's objects, then its unbounded ones, are the shapes at their positions and
+// the spheres, in order, everywhere else.
+
+#define SCENE_CACHE_MAGIC "PTSCENE"
+#define SCENE_CACHE_VERSION 3
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t sphere_size, node_size; // sizeof(Sphere) and sizeof(BVHNode) when written
+    uint32_t material_count, node_count, sphere_count, shape_count;
+    uint32_t object_count, unbounded_count;
+    uint64_t key;
+    uint64_t size; // Of the whole file, so a truncated cache is caught
+    SceneDesc desc;
+} SceneCacheHeader;
+
+typedef struct {
+    uint32_t type, reserved;
+    double params[MAT_PARAM_COUNT];
+} MaterialRecord;
+
+// A plane, rectangle or disk at position in the scene's objects followed by its
+// unbounded ones. The params of each type, in order:
+//      PLANE   point, normal
+//      RECT    k, u0, u1, v0, v1
+//      DISK    center, radius
+// Rectangles and disks also use axis.
+typedef struct {
+    uint32_t type, material;
+    uint32_t axis, position;
+    double params[6];
+} ShapeRecord;
+
+// Materials by address, so objects can be written out with the index of theirs
+typedef struct {
+    Material **keys;
+    uint32_t *values;
+    uint32_t capacity; // A power of two
+} MaterialIndex;
+
+// What scene_cache_write() puts into the file besides the header and materials
+typedef struct {
+    Scene *scene;
+    const BVHNode *block; // The tree's block from bvh_pack(), NULL if it is not packed
+    BVHNode *nodes;
+    uint32_t node_count;
+    Sphere *spheres;
+    uint32_t sphere_count;
+    ShapeRecord *shapes;
+    uint32_t shape_count;
+} SceneCacheArrays;
+
+//
+// Computes the cache key for a scene file loaded and built with the given leaf size,
+// BVH builder and seed, and optimized or not. Returns false if the file cannot be read.
+//
+bool scene_cache_key(const char *scene_path, uint32_t leaf_size, BVHBuilder builder,
+                     bool optimized, uint64_t seed, uint64_t *key) {
+    uint64_t hash = hash_bytes(&leaf_size, sizeof(leaf_size), 0);
+    hash = hash_bytes(&builder, sizeof(builder), hash);
+    hash = hash_bytes(&optimized, sizeof(optimized), hash);
+    hash = hash_bytes(&seed, sizeof(seed), hash);
+    return hash_file(scene_path, hash, key);
+}
+
+static uint32_t material_index_slot(MaterialIndex *index, Material *material) {
+    uint64_t h = hash_bytes(&material, sizeof(material), 0);
+    uint32_t i = (uint32_t)h & (index->capacity - 1);
+    while (index->keys[i] && index->keys[i] != material) {
+        i = (i + 1) & (index->capacity - 1);
+    }
+    return i;
+}
+
+// Finds the index of a material. Returns false if it is not one of the scene's.
+static bool material_number(MaterialIndex *index, Material *material, uint32_t *number) {
+    uint32_t slot = material_index_slot(index, material);
+    *number = index->values[slot];
+    return index->keys[slot] != NULL;
+}
+
+static uint32_t count_nodes(const BVHNode *node) {
+    return node->is_leaf ? 1 : 1 + count_nodes(node->left) + count_nodes(node->right);
+}
+
+// Returns true if every node below node lies in a block of count nodes
+static bool nodes_in_block(const BVHNode *node, const BVHNode *block, uint32_t count) {
+    if (node < block || node >= block + count) {
+        return false;
+    }
+    return node->is_leaf || (nodes_in_block(node->left, block, count) &&
+                             nodes_in_block(node->right, block, count));
+}
+
+//
+// Copies node and those below it into the arrays' nodes, with indices in place of
+// pointers, at their place in the block if there is one and in pre-order if not.
+// Returns the index of node.
+//
+static uint32_t flatten_node(const BVHNode *node, SceneCacheArrays *a, uint32_t *next) {
+    uint32_t i = a->block ? (uint32_t)(node - a->block) : (*next)++;
+    BVHNode *copy = &a->nodes[i];
+    *copy = *node;
+    copy->storage = BVH_NODE_IN_BLOCK;
+    if (node->is_leaf) {
+        copy->left = copy->right = NULL;
+        copy->objects = (Hittable **)(uintptr_t)(node->objects - a->scene->objects);
+    } else {
+        copy->left = (BVHNode *)(uintptr_t)flatten_node(node->left, a, next);
+        copy->right = (BVHNode *)(uintptr_t)flatten_node(node->right, a, next);
+    }
+    return i;
+}
+
+//
+// Adds an object at position to the arrays' spheres or shapes. Returns false if its
+// material is not one of the scene's.
+//
+static bool flatten_object(Hittable *h, uint32_t position, MaterialIndex *index,
+                           SceneCacheArrays *a) {
+    if (h->type == SPHERE) {
+        Sphere *s = &a->spheres[a->sphere_count++];
+        *s = *(Sphere *)h->object;
+        uint32_t material;
+        bool ok = material_number(index, s->material, &material);
+        s->material = (Material *)(uintptr_t)material;
+        return ok;
+    }
+
+    ShapeRecord *record = &a->shapes[a->shape_count++];
+    Material *material = NULL;
+    double *p = record->params;
+    record->type = h->type;
+    record->position = position;
+    switch (h->type) {
+    case PLANE: {
+        Plane *plane = (Plane *)h->object;
+        p[0] = plane->point.x, p[1] = plane->point.y, p[2] = plane->point.z;
+        p[3] = plane->normal.x, p[4] = plane->normal.y, p[5] = plane->normal.z;
+        material = plane->material;
+        break;
+    }
+    case RECT: {
+        Rect *rect = (Rect *)h->object;
+        record->axis = rect->axis;
+        p[0] = rect->k, p[1] = rect->u0, p[2] = rect->u1;
+        p[3] = rect->v0, p[4] = rect->v1;
+        material = rect->material;
+        break;
+    }
+    case DISK: {
+        Disk *d = (Disk *)h->object;
+        record->axis = d->axis;
+        p[0] = d->center.x, p[1] = d->center.y, p[2] = d->center.z, p[3] = d->radius;
+        material = d->material;
+        break;
+    }
+    default:
+        return false;
+    }
+    return material_number(index, material, &record->material);
+}
+
+// Makes the shape of a record
+static Hittable *shape_create(const ShapeRecord *record, Material *material) {
+    const double *p = record->params;
+    switch (record->type) {
+    case PLANE:
+        return hittable_create(
+            plane_create(v3_init(p[0], p[1], p[2]), v3_init(p[3], p[4], p[5]), material),
+            PLANE);
+    case RECT:
+        return hittable_create(
+            rect_create(record->axis, p[0], p[1], p[2], p[3], p[4], material), RECT);
+    default:
+        return hittable_create(
+            disk_create(v3_init(p[0], p[1], p[2]), p[3], record->axis, material), DISK);
+    }
+}
+
+//
+// Writes a loaded scene file and its BVH out to a cache file. Like checkpoints, the
+// cache is written to a temporary file and renamed into place. Only scenes whose
+// materials the scene owns, i.e. those loaded from a scene file, and that hold no
+// meshes or instances can be cached.
+// Returns true on success.
+//
+bool scene_cache_write(const char *path, uint64_t key, const SceneDesc *desc, Scene *scene,
+                       BVHNode *bvh) {
+    if (bvh == NULL) {
+        return false;
+    }
+    // Meshes come from files of their own, which the key does not cover, and have
+    // caches of their own instead. Instances share groups, which records cannot.
+    for (uint32_t i = 0; i < scene->object_count; i++) {
+        if (scene->objects[i]->type == MESH || scene->objects[i]->type == INSTANCE) {
+            return false;
+        }
+    }
+
+    // Number the materials
+    MaterialIndex index = {NULL, NULL, 16};
+    while (index.capacity < 2 * scene->material_count) {
+        index.capacity *= 2;
+    }
+    index.keys = (Material **)calloc(index.capacity, sizeof(Material *));
+    index.values = (uint32_t *)malloc(index.capacity * sizeof(uint32_t));
+    assert(index.keys != NULL && index.values != NULL);
+    MaterialRecord *materials =
+        (MaterialRecord *)calloc(scene->material_count + 1, sizeof(MaterialRecord));
+    assert(materials != NULL);
+    for (uint32_t i = 0; i < scene->material_count; i++) {
+        uint32_t slot = material_index_slot(&index, scene->materials[i]);
+        index.keys[slot] = scene->materials[i];
+        index.values[slot] = i;
+        materials[i].type = mat_params(scene->materials[i], materials[i].params);
+    }
+
+    // Keep the layout of a packed tree, which is what traversal wants
+    SceneCacheArrays a;
+    memset(&a, 0, sizeof(a));
+    a.scene = scene;
+    a.node_count = count_nodes(bvh);
+    if (bvh->storage == BVH_NODE_BLOCK && nodes_in_block(bvh, bvh, a.node_count)) {
+        a.block = bvh;
+    }
+    uint32_t total = scene->object_count + scene->unbounded_count;
+    a.nodes = (BVHNode *)calloc(a.node_count, sizeof(BVHNode));
+    a.spheres = (Sphere *)calloc((size_t)total + 1, sizeof(Sphere));
+    a.shapes = (ShapeRecord *)calloc((size_t)total + 1, sizeof(ShapeRecord));
+    assert(a.nodes != NULL && a.spheres != NULL && a.shapes != NULL);
+    uint32_t next = 0;
+    flatten_node(bvh, &a, &next);
+    bool ok = true;
+    for (uint32_t i = 0; i < total && ok; i++) {
+        Hittable *h = i < scene->object_count ? scene->objects[i]
+                                              : scene->unbounded[i - scene->object_count];
+        ok = flatten_object(h, i, &index, &a);
+    }
+
+    SceneCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC));
+    header.version = SCENE_CACHE_VERSION;
+    header.sphere_size = sizeof(Sphere);
+    header.node_size = sizeof(BVHNode);
+    header.material_count = scene->material_count;
+    header.node_count = a.node_count;
+    header.sphere_count = a.sphere_count;
+    header.shape_count = a.shape_count;
+    header.object_count = scene->object_count;
+    header.unbounded_count = scene->unbounded_count;
+    header.key = key;
+    header.size = sizeof(header) + scene->material_count * sizeof(MaterialRecord) +
+                  (uint64_t)a.node_count * sizeof(BVHNode) +
+                  (uint64_t)a.sphere_count * sizeof(Sphere) +
+                  (uint64_t)a.shape_count * sizeof(ShapeRecord);
+    header.desc = *desc;
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *file = ok ? fopen(tmp_path, "wb") : NULL;
+    if (file) {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(materials, sizeof(MaterialRecord), header.material_count, file) ==
+                 header.material_count &&
+             fwrite(a.nodes, sizeof(BVHNode), a.node_count, file) == a.node_count &&
+             fwrite(a.spheres, sizeof(Sphere), a.sphere_count, file) == a.sphere_count &&
+             fwrite(a.shapes, sizeof(ShapeRecord), a.shape_count, file) == a.shape_count;
+        ok = (fclose(file) == 0) && ok;
+    } else {
+        ok = false;
+    }
+
+    free(index.keys);
+    free(index.values);
+    free(materials);
+    free(a.nodes);
+    free(a.spheres);
+    free(a.shapes);
+
+    if (!ok || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "ERROR: Failed to write scene cache %s!\n", path);
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+//
+// Checks that every index in a mapped cache points inside of it, and that the shapes
+// and spheres fill the scene's objects as the header says. Returns false if not.
+//
+static bool cache_valid(const SceneCacheHeader *header, const BVHNode *nodes,
+                        const Sphere *spheres, const ShapeRecord *shapes) {
+    uint64_t total = (uint64_t)header->object_count + header->unbounded_count;
+    uint32_t n = header->node_count;
+    if (n == 0 || (uint64_t)header->sphere_count + header->shape_count != total) {
+        return false;
+    }
+    // Children come after their parent and have only the one, so the nodes form a tree
+    bool *has_parent = (bool *)calloc(n, sizeof(bool));
+    assert(has_parent != NULL);
+    bool ok = true;
+    for (uint32_t i = 0; i < n && ok; i++) {
+        const BVHNode *node = &nodes[i];
+        // bvh_delete() follows storage, and a bool that is neither 0 nor 1 is undefined
+        uint8_t is_leaf;
+        memcpy(&is_leaf, &node->is_leaf, sizeof(is_leaf));
+        if (is_leaf > 1 || node->storage != BVH_NODE_IN_BLOCK) {
+            ok = false;
+        } else if (node->is_leaf) {
+            uintptr_t index = (uintptr_t)node->objects;
+            ok = node->left == NULL && node->right == NULL && node->object_count > 0 &&
+                 index <= header->object_count &&
+                 node->object_count <= header->object_count - index;
+        } else {
+            uintptr_t left = (uintptr_t)node->left, right = (uintptr_t)node->right;
+            ok = left > i && left < n && right > i && right < n && left != right &&
+                 !has_parent[left] && !has_parent[right];
+            if (ok) {
+                has_parent[left] = has_parent[right] = true;
+            }
+        }
+    }
+    free(has_parent);
+    if (!ok) {
+        return false;
+    }
+    for (uint32_t i = 0; i < header->sphere_count; i++) {
+        if ((uintptr_t)spheres[i].material >= header->material_count) {
+            return false;
+        }
+    }
+    // Planes are the only objects without a box, and spheres fill the rest
+    uint64_t next = 0;
+    uint32_t unbounded = 0;
+    for (uint32_t i = 0; i < header->shape_count; i++) {
+        const ShapeRecord *r = &shapes[i];
+        bool is_unbounded = r->position >= header->object_count;
+        if ((r->type != PLANE && r->type != RECT && r->type != DISK) ||
+            (r->type != PLANE && r->axis > 2) || r->material >= header->material_count ||
+            r->position < next || r->position >= total ||
+            (r->type == PLANE) != is_unbounded) {
+            return false;
+        }
+        next = (uint64_t)r->position + 1;
+        unbounded += is_unbounded;
+    }
+    return unbounded == header->unbounded_count;
+}
+
+//
+// Points the scene and its BVH into a mapped cache, which cache_valid() passed.
+// Returns false if a material cannot be made.
+//
+static bool relink(const SceneCacheHeader *header, const MaterialRecord *materials,
+                   BVHNode *nodes, Sphere *spheres, const ShapeRecord *shapes,
+                   Scene *scene) {
+    for (uint32_t i = 0; i < header->material_count; i++) {
+        Material *material = mat_from_params(materials[i].type, materials[i].params);
+        if (material == NULL) {
+            return false;
+        }
+        scene_own_material(scene, material);
+    }
+
+    // The spheres are the scene's arena, with their hittables in a block beside it
+    uint32_t sphere_count = header->sphere_count;
+    for (uint32_t i = 0; i < sphere_count; i++) {
+        spheres[i].material = scene->materials[(uintptr_t)spheres[i].material];
+    }
+    scene->sphere_arena = spheres;
+    scene->hittable_arena =
+        (Hittable *)malloc(((size_t)sphere_count + 1) * sizeof(Hittable));
+    assert(scene->hittable_arena != NULL);
+    scene->arena_count = scene->arena_used = sphere_count;
+
+    // Leave a spare slot in the object array, as scene_reserve() does
+    scene->max_count = header->object_count + 1;
+    scene->objects =
+        (Hittable **)realloc(scene->objects, scene->max_count * sizeof(Hittable *));
+    scene->unbounded_max = header->unbounded_count + 1;
+    scene->unbounded = (Hittable **)malloc(scene->unbounded_max * sizeof(Hittable *));
+    assert(scene->objects != NULL && scene->unbounded != NULL);
+    uint32_t total = header->object_count + header->unbounded_count;
+    for (uint32_t i = 0, shape = 0, sphere = 0; i < total; i++) {
+        Hittable *h;
+        if (shape < header->shape_count && shapes[shape].position == i) {
+            h = shape_create(&shapes[shape], scene->materials[shapes[shape].material]);
+            shape++;
+        } else {
+            h = &scene->hittable_arena[sphere];
+            *h = (Hittable){(void *)&spheres[sphere++], SPHERE};
+        }
+        if (i < header->object_count) {
+            scene->objects[scene->object_count++] = h;
+        } else {
+            scene->unbounded[scene->unbounded_count++] = h;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->node_count; i++) {
+        BVHNode *node = &nodes[i];
+        if (node->is_leaf) {
+            node->objects = scene->objects + (uintptr_t)node->objects;
+        } else {
+            node->left = nodes + (uintptr_t)node->left;
+            node->right = nodes + (uintptr_t)node->right;
+        }
+    }
+    return true;
+}
+
+//
+// Loads a scene, its description and its BVH from a cache file. Returns NULL if
+// there is no cache, or it was written for another key, version or struct layout.
+// The BVH's nodes are in the scene's mapping of the file, so delete the BVH before
+// the scene; bvh_delete() leaves them to it.
+//
+Scene *scene_cache_read(const char *path, uint64_t key, SceneDesc *desc, BVHNode **bvh) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(SceneCacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    // Private and writable, so relinking copies only the pages it writes to
+    unsigned char *data =
+        (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    const SceneCacheHeader *header = (const SceneCacheHeader *)data;
+    if (memcmp(header->magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC)) != 0 ||
+        header->version != SCENE_CACHE_VERSION || header->sphere_size != sizeof(Sphere) ||
+        header->node_size != sizeof(BVHNode) || header->key != key ||
+        header->size != size ||
+        header->size != sizeof(SceneCacheHeader) +
+                            header->material_count * sizeof(MaterialRecord) +
+                            (uint64_t)header->node_count * sizeof(BVHNode) +
+                            (uint64_t)header->sphere_count * sizeof(Sphere) +
+                            (uint64_t)header->shape_count * sizeof(ShapeRecord)) {
+        munmap(data, size);
+        return NULL;
+    }
+    // Relinking reads every page
+    madvise(data, size, MADV_WILLNEED);
+
+    const MaterialRecord *materials = (const MaterialRecord *)(header + 1);
+    BVHNode *nodes = (BVHNode *)(materials + header->material_count);
+    Sphere *spheres = (Sphere *)(nodes + header->node_count);
+    const ShapeRecord *shapes = (const ShapeRecord *)(spheres + header->sphere_count);
+
+    Scene *scene = scene_create();
+    scene->mapping = data;
+    scene->mapping_size = size;
+    if (cache_valid(header, nodes, spheres, shapes) &&
+        relink(header, materials, nodes, spheres, shapes, scene)) {
+        *desc = header->desc;
+        *bvh = nodes;
+    } else {
+        fprintf(stderr, "ERROR: Scene cache %s is corrupt, ignoring it!\n", path);
+        scene_delete(&scene);
+    }
+    return scene;
+}
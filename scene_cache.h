@@ -0,0 +1,16 @@
+#pragma once
+
+#include "bvh.h"
+#include "scene.h"
+#include "scene_file.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool scene_cache_key(const char *scene_path, uint32_t leaf_size, BVHBuilder builder,
+                     bool optimized, uint64_t seed, uint64_t *key);
+
+bool scene_cache_write(const char *path, uint64_t key, const SceneDesc *desc, Scene *scene,
+                       BVHNode *bvh);
+
+Scene *scene_cache_read(const char *path, uint64_t key, SceneDesc *desc, BVHNode **bvh);
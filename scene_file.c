@@ -0,0 +1,703 @@
+//
+// Loader for text scene files. A scene file is a list of lines, each starting with a
+// keyword; '#' starts a comment. For example:
+//
+//      camera look_from 13 2 3 look_at 0 0 0 vup 0 1 0 vfov 20 aperture 0.1
+//      settings width 800 height 600 spp 64 max_depth 50 background gradient
+//      environment assets/parched_canal_4k.hdr
+//      material ground lambertian 0.5 0.5 0.5
+//      material chrome metal 0.8 0.8 0.8 0.05
+//      material glass dielectric 1.5
+//      material lamp light 4 4 4
+//      plane 0 0 0 0 1 0 ground
+//      sphere 0 1 0 1 glass
+//      rect y 5 -1 1 -1 1 lamp
+//      disk 4 0.01 0 1 y chrome
+//      mesh assets/bunny.obj chrome
+//      object tree
+//          sphere 0 1 0 0.5 ground
+//          sphere 0 2 0 0.3 ground
+//      end
+//      instance tree translate 2 0 0 rotate_y 45 scale 1.5 material chrome
+//
+// camera and settings take any of their key/value pairs, in any order. camera also
+// takes focus_dist, and settings also takes exposure. environment sets the skybox
+// image and makes it the background. Materials have to be defined before the
+// objects that use them.
+//
+// plane takes a point and a normal. rect takes the axis it is perpendicular to, its
+// position along that axis and its extent along the other two axes, see Rect. disk
+// takes a center, a radius and the axis it is perpendicular to. mesh loads the
+// triangles of an OBJ file, see obj.c. With cache_meshes, each mesh and its BVH are
+// cached next to its file, like the skybox.
+//
+// object starts the definition of a group of objects, which end finishes; the lines
+// in between add to the group instead of the scene, and may not add planes. Each
+// group gets a BVH of its own. instance places a group defined earlier into the
+// scene, see instance.c. It takes any number of translate x y z, scale s or
+// scale x y z, and rotate_x, rotate_y or rotate_z by degrees, applied in the order
+// given, and optionally a material that replaces those of the group.
+//
+// The file is memory mapped and parsed in one pass, without copying lines. Before
+// that, a scan for newlines bounds the number of spheres, so the scene reserves its
+// arrays once and takes every sphere out of one block instead of a malloc each.
+// Numbers go through a fast path that is exact whenever the digits fit in a double.
+//
+
+#include "scene_file.h"
+#include "bvh.h"
+#include "instance.h"
+#include "material.h"
+#include "mesh.h"
+#include "util.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NAME_MAX_LENGTH 64
+#define GROUP_LEAF_SIZE 1 // Leaf size of the BVH of each group
+
+typedef struct {
+    char name[NAME_MAX_LENGTH];
+    Material *material;
+} NamedMaterial;
+
+// Materials by name, an open addressing hash table
+typedef struct {
+    NamedMaterial *slots;
+    uint32_t capacity, count; // capacity is a power of two
+} MaterialTable;
+
+typedef struct {
+    char name[NAME_MAX_LENGTH];
+    Group *group;
+} NamedGroup;
+
+// Groups by name. Scenes define few, so they are simply searched in order.
+typedef struct {
+    NamedGroup *groups;
+    uint32_t count, capacity;
+} GroupTable;
+
+typedef struct {
+    const char *p, *end; // Current position and end of the file
+    const char *path;
+    uint32_t line;
+} Parser;
+
+static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+static bool at_line_end(Parser *parser) {
+    return parser->p == parser->end || *parser->p == '\n' || *parser->p == '#';
+}
+
+static void skip_space(Parser *parser) {
+    while (parser->p < parser->end && is_space(*parser->p)) {
+        parser->p++;
+    }
+}
+
+static void parse_error(Parser *parser, const char *message) {
+    fprintf(stderr, "ERROR: %s:%u: %s\n", parser->path, parser->line, message);
+}
+
+//
+// Reads the next whitespace separated word. Returns its length, 0 at the end of a line.
+//
+static size_t next_word(Parser *parser, const char **word) {
+    skip_space(parser);
+    *word = parser->p;
+    while (parser->p < parser->end && !is_space(*parser->p) && *parser->p != '\n' &&
+           *parser->p != '#') {
+        parser->p++;
+    }
+    return (size_t)(parser->p - *word);
+}
+
+static bool word_is(const char *word, size_t length, const char *keyword) {
+    return strlen(keyword) == length && memcmp(word, keyword, length) == 0;
+}
+
+static bool next_number(Parser *parser, double *value) {
+    const char *start;
+    size_t length = next_word(parser, &start);
+    if (length == 0) {
+        parse_error(parser, "expected a number");
+        return false;
+    }
+    if (!parse_double(start, length, value)) {
+        parse_error(parser, "invalid number");
+        return false;
+    }
+    return true;
+}
+
+static bool next_vec3(Parser *parser, vec3 *v) {
+    return next_number(parser, &v->x) && next_number(parser, &v->y) &&
+           next_number(parser, &v->z);
+}
+
+static bool next_uint(Parser *parser, uint32_t *value) {
+    double v;
+    if (!next_number(parser, &v)) {
+        return false;
+    }
+    if (v < 1 || v > UINT32_MAX || v != (uint32_t)v) {
+        parse_error(parser, "expected a positive integer");
+        return false;
+    }
+    *value = (uint32_t)v;
+    return true;
+}
+
+static NamedMaterial *material_slot(MaterialTable *table, const char *name, size_t length) {
+    uint32_t i = (uint32_t)hash_bytes(name, length, 0) & (table->capacity - 1);
+    while (table->slots[i].material &&
+           !word_is(name, length, table->slots[i].name)) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return &table->slots[i];
+}
+
+static void material_table_grow(MaterialTable *table) {
+    MaterialTable grown = {NULL, table->capacity ? table->capacity * 2 : 64, 0};
+    grown.slots = (NamedMaterial *)calloc(grown.capacity, sizeof(NamedMaterial));
+    assert(grown.slots != NULL);
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].material) {
+            const char *name = table->slots[i].name;
+            *material_slot(&grown, name, strlen(name)) = table->slots[i];
+            grown.count++;
+        }
+    }
+    free(table->slots);
+    *table = grown;
+}
+
+static bool parse_material(Parser *parser, Scene *scene, MaterialTable *table) {
+    const char *name, *type;
+    size_t name_length = next_word(parser, &name);
+    size_t type_length = next_word(parser, &type);
+    if (name_length == 0 || type_length == 0) {
+        parse_error(parser, "expected a material name and type");
+        return false;
+    }
+    if (name_length >= NAME_MAX_LENGTH) {
+        parse_error(parser, "material name too long");
+        return false;
+    }
+
+    Material *material = NULL;
+    vec3 albedo;
+    double x;
+    if (word_is(type, type_length, "lambertian")) {
+        if (!next_vec3(parser, &albedo)) {
+            return false;
+        }
+        material = create_lambertian(albedo);
+    } else if (word_is(type, type_length, "metal")) {
+        if (!next_vec3(parser, &albedo) || !next_number(parser, &x)) {
+            return false;
+        }
+        material = create_metal(albedo, x);
+    } else if (word_is(type, type_length, "dielectric")) {
+        if (!next_number(parser, &x)) {
+            return false;
+        }
+        material = create_dielectric(x);
+    } else if (word_is(type, type_length, "light")) {
+        if (!next_vec3(parser, &albedo)) {
+            return false;
+        }
+        material = create_diffuse_light(albedo);
+    } else {
+        parse_error(parser, "unknown material type");
+        return false;
+    }
+    scene_own_material(scene, material);
+
+    // Keep the table at most half full
+    if (2 * (table->count + 1) > table->capacity) {
+        material_table_grow(table);
+    }
+    NamedMaterial *slot = material_slot(table, name, name_length);
+    if (slot->material == NULL) {
+        table->count++;
+    }
+    memcpy(slot->name, name, name_length);
+    slot->name[name_length] = '\0';
+    slot->material = material; // A later definition replaces an earlier one
+    return true;
+}
+
+// Reads the name of a material defined earlier
+static Material *next_material(Parser *parser, MaterialTable *table) {
+    const char *name;
+    size_t length = next_word(parser, &name);
+    NamedMaterial *slot = table->count ? material_slot(table, name, length) : NULL;
+    if (slot == NULL || slot->material == NULL) {
+        parse_error(parser, "undefined material");
+        return NULL;
+    }
+    return slot->material;
+}
+
+// Reads an axis, one of x, y or z
+static bool next_axis(Parser *parser, uint32_t *axis) {
+    const char *word;
+    size_t length = next_word(parser, &word);
+    if (length != 1 || word[0] < 'x' || word[0] > 'z') {
+        parse_error(parser, "expected an axis, x, y or z");
+        return false;
+    }
+    *axis = (uint32_t)(word[0] - 'x');
+    return true;
+}
+
+static bool parse_sphere(Parser *parser, Scene *scene, MaterialTable *table) {
+    vec3 center;
+    double radius;
+    if (!next_vec3(parser, &center) || !next_number(parser, &radius)) {
+        return false;
+    }
+    Material *material = next_material(parser, table);
+    if (material == NULL) {
+        return false;
+    }
+    scene_add_sphere(scene, center.x, center.y, center.z, radius, material);
+    return true;
+}
+
+static bool parse_plane(Parser *parser, Scene *scene, MaterialTable *table) {
+    vec3 point, normal;
+    if (!next_vec3(parser, &point) || !next_vec3(parser, &normal)) {
+        return false;
+    }
+    if (v3_length_squared(normal) == 0) {
+        parse_error(parser, "plane normal is zero");
+        return false;
+    }
+    Material *material = next_material(parser, table);
+    if (material == NULL) {
+        return false;
+    }
+    scene_add_plane(scene, point, normal, material);
+    return true;
+}
+
+static bool parse_rect(Parser *parser, Scene *scene, MaterialTable *table) {
+    uint32_t axis;
+    double k, u0, u1, v0, v1;
+    if (!next_axis(parser, &axis) || !next_number(parser, &k) ||
+        !next_number(parser, &u0) || !next_number(parser, &u1) ||
+        !next_number(parser, &v0) || !next_number(parser, &v1)) {
+        return false;
+    }
+    Material *material = next_material(parser, table);
+    if (material == NULL) {
+        return false;
+    }
+    scene_add_rect(scene, axis, k, u0, u1, v0, v1, material);
+    return true;
+}
+
+static bool parse_disk(Parser *parser, Scene *scene, MaterialTable *table) {
+    vec3 center;
+    double radius;
+    uint32_t axis;
+    if (!next_vec3(parser, &center) || !next_number(parser, &radius) ||
+        !next_axis(parser, &axis)) {
+        return false;
+    }
+    Material *material = next_material(parser, table);
+    if (material == NULL) {
+        return false;
+    }
+    scene_add_disk(scene, center, radius, axis, material);
+    return true;
+}
+
+static bool parse_mesh(Parser *parser, Scene *scene, MaterialTable *table,
+                       bool cache_meshes) {
+    const char *word;
+    size_t length = next_word(parser, &word);
+    char path[PATH_MAX], cache_path[PATH_MAX + 8];
+    if (length == 0 || length >= sizeof(path)) {
+        parse_error(parser, "expected a mesh path");
+        return false;
+    }
+    memcpy(path, word, length);
+    path[length] = '\0';
+    Material *material = next_material(parser, table);
+    if (material == NULL) {
+        return false;
+    }
+
+    double start = now_seconds();
+    snprintf(cache_path, sizeof(cache_path), "%s.cache", path);
+    Mesh *mesh = mesh_load(path, cache_meshes ? cache_path : NULL, material);
+    if (mesh == NULL) {
+        parse_error(parser, "failed to load mesh");
+        return false;
+    }
+    printf("Mesh %s: %u triangles, %u vertices, %.1f bytes per triangle, in %.3fs\n",
+           path, mesh->triangle_count, mesh->vertex_count,
+           (double)mesh_memory(mesh) / mesh->triangle_count, now_seconds() - start);
+    scene_add_mesh(scene, mesh);
+    return true;
+}
+
+// Reads a name of at most NAME_MAX_LENGTH - 1 characters into name
+static bool next_name(Parser *parser, char *name, const char *what) {
+    const char *word;
+    size_t length = next_word(parser, &word);
+    if (length == 0 || length >= NAME_MAX_LENGTH) {
+        parse_error(parser, what);
+        return false;
+    }
+    memcpy(name, word, length);
+    name[length] = '\0';
+    return true;
+}
+
+static NamedGroup *find_group(GroupTable *table, const char *name) {
+    for (uint32_t i = 0; i < table->count; i++) {
+        if (strcmp(table->groups[i].name, name) == 0) {
+            return &table->groups[i];
+        }
+    }
+    return NULL;
+}
+
+//
+// Finishes the definition of a group: builds the BVH over its objects and adds it
+// to the table. Takes ownership of the group's scene.
+//
+static bool finish_group(Parser *parser, GroupTable *table, const char *name,
+                         Scene *scene) {
+    if (scene->object_count == 0) {
+        parse_error(parser, "object has to hold at least one object");
+        scene_delete(&scene);
+        return false;
+    }
+    BVHNode *bvh = bvh_create(scene, 0, scene->object_count - 1, GROUP_LEAF_SIZE);
+    Group *group = group_create(scene, bvh);
+
+    NamedGroup *slot = find_group(table, name);
+    if (slot) {
+        group_release(&slot->group); // A later definition replaces an earlier one
+    } else {
+        if (table->count == table->capacity) {
+            table->capacity = table->capacity ? table->capacity * 2 : 8;
+            table->groups = (NamedGroup *)realloc(table->groups,
+                                                  table->capacity * sizeof(NamedGroup));
+            assert(table->groups != NULL);
+        }
+        slot = &table->groups[table->count++];
+        strcpy(slot->name, name);
+    }
+    slot->group = group;
+    return true;
+}
+
+//
+// Reads the factors of a scale, either one for all three axes or one for each.
+//
+static bool next_scale(Parser *parser, vec3 *factors) {
+    if (!next_number(parser, &factors->x)) {
+        return false;
+    }
+    const char *start = parser->p, *word;
+    size_t length = next_word(parser, &word);
+    if (length > 0 && parse_double(word, length, &factors->y)) {
+        return next_number(parser, &factors->z);
+    }
+    parser->p = start;
+    factors->y = factors->z = factors->x;
+    return true;
+}
+
+static bool parse_instance(Parser *parser, Scene *scene, MaterialTable *materials,
+                           GroupTable *groups) {
+    char name[NAME_MAX_LENGTH];
+    if (!next_name(parser, name, "expected an object name")) {
+        return false;
+    }
+    NamedGroup *named = find_group(groups, name);
+    if (named == NULL) {
+        parse_error(parser, "undefined object");
+        return false;
+    }
+
+    Transform to_world = transform_identity();
+    Material *material = NULL;
+    skip_space(parser);
+    while (!at_line_end(parser)) {
+        const char *key;
+        size_t length = next_word(parser, &key);
+        Transform step;
+        vec3 v;
+        double degrees;
+        if (word_is(key, length, "material")) {
+            if ((material = next_material(parser, materials)) == NULL) {
+                return false;
+            }
+            skip_space(parser);
+            continue;
+        } else if (word_is(key, length, "translate")) {
+            if (!next_vec3(parser, &v)) {
+                return false;
+            }
+            step = transform_translate(v);
+        } else if (word_is(key, length, "scale")) {
+            if (!next_scale(parser, &v)) {
+                return false;
+            }
+            step = transform_scale(v);
+        } else if (length == 8 && memcmp(key, "rotate_", 7) == 0 && key[7] >= 'x' &&
+                   key[7] <= 'z') {
+            if (!next_number(parser, &degrees)) {
+                return false;
+            }
+            step = transform_rotate((uint32_t)(key[7] - 'x'), degrees);
+        } else {
+            parse_error(parser, "unknown instance setting");
+            return false;
+        }
+        to_world = transform_compose(step, to_world);
+        skip_space(parser);
+    }
+
+    Instance *instance = instance_create(named->group, to_world, material);
+    if (instance == NULL) {
+        parse_error(parser, "instance transform is not invertible");
+        return false;
+    }
+    scene_add_instance(scene, instance);
+    return true;
+}
+
+static bool parse_camera(Parser *parser, SceneDesc *desc) {
+    desc->has_camera = true;
+    while (!at_line_end(parser)) {
+        const char *key;
+        size_t length = next_word(parser, &key);
+        bool ok;
+        if (word_is(key, length, "look_from")) {
+            ok = next_vec3(parser, &desc->look_from);
+        } else if (word_is(key, length, "look_at")) {
+            ok = next_vec3(parser, &desc->look_at);
+        } else if (word_is(key, length, "vup")) {
+            ok = next_vec3(parser, &desc->vup);
+        } else if (word_is(key, length, "vfov")) {
+            ok = next_number(parser, &desc->vfov);
+        } else if (word_is(key, length, "aperture")) {
+            ok = next_number(parser, &desc->aperture);
+        } else if (word_is(key, length, "focus_dist")) {
+            ok = next_number(parser, &desc->focus_dist);
+        } else {
+            parse_error(parser, "unknown camera setting");
+            ok = false;
+        }
+        if (!ok) {
+            return false;
+        }
+        skip_space(parser);
+    }
+    return true;
+}
+
+static bool parse_settings(Parser *parser, SceneDesc *desc) {
+    while (!at_line_end(parser)) {
+        const char *key;
+        size_t length = next_word(parser, &key);
+        bool ok = true;
+        if (word_is(key, length, "width")) {
+            ok = next_uint(parser, &desc->width);
+        } else if (word_is(key, length, "height")) {
+            ok = next_uint(parser, &desc->height);
+        } else if (word_is(key, length, "spp")) {
+            ok = next_uint(parser, &desc->samples_per_pixel);
+        } else if (word_is(key, length, "max_depth")) {
+            ok = next_uint(parser, &desc->max_depth);
+        } else if (word_is(key, length, "exposure")) {
+            ok = next_number(parser, &desc->exposure);
+        } else if (word_is(key, length, "background")) {
+            const char *name;
+            size_t name_length = next_word(parser, &name);
+            if (word_is(name, name_length, "gradient")) {
+                desc->background = BACKGROUND_GRADIENT;
+            } else if (word_is(name, name_length, "skybox")) {
+                desc->background = BACKGROUND_SKYBOX;
+            } else if (word_is(name, name_length, "black")) {
+                desc->background = BACKGROUND_BLACK;
+            } else {
+                parse_error(parser, "unknown background");
+                ok = false;
+            }
+        } else {
+            parse_error(parser, "unknown setting");
+            ok = false;
+        }
+        if (!ok) {
+            return false;
+        }
+        skip_space(parser);
+    }
+    return true;
+}
+
+static bool parse_environment(Parser *parser, SceneDesc *desc) {
+    const char *path;
+    size_t length = next_word(parser, &path);
+    if (length == 0 || length >= sizeof(desc->environment)) {
+        parse_error(parser, "expected an environment image path");
+        return false;
+    }
+    memcpy(desc->environment, path, length);
+    desc->environment[length] = '\0';
+    desc->background = BACKGROUND_SKYBOX;
+    return true;
+}
+
+//
+// Loads a scene file, filling in desc with its camera and settings. Returns NULL,
+// after printing why, if the file cannot be read or has an error in it. With
+// cache_meshes, meshes are cached next to their files.
+//
+Scene *scene_load(const char *path, SceneDesc *desc, bool cache_meshes) {
+    memset(desc, 0, sizeof(SceneDesc));
+    desc->vup = v3_init(0, 1, 0);
+    desc->vfov = 40;
+    desc->background = -1;
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "ERROR: Failed to open scene %s!\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *data = "";
+    if (size > 0) {
+        data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "ERROR: Failed to map scene %s!\n", path);
+            close(fd);
+            return NULL;
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    // Every sphere takes a line of its own, so the line count bounds their number
+    uint32_t lines = 1;
+    for (const char *p = data; (p = memchr(p, '\n', data + size - p)) != NULL; p++) {
+        lines++;
+    }
+
+    Scene *scene = scene_create();
+    scene_reserve(scene, lines);
+    MaterialTable materials = {0};
+    material_table_grow(&materials);
+    GroupTable groups = {0};
+    Scene *group_scene = NULL; // Scene of the group being defined, if any
+    char group_name[NAME_MAX_LENGTH];
+    uint32_t group_line = 0;
+
+    Parser parser = {data, data + size, path, 1};
+    bool ok = true;
+    while (ok && parser.p < parser.end) {
+        const char *keyword;
+        size_t length = next_word(&parser, &keyword);
+        // Objects go into the group being defined, if any
+        Scene *target = group_scene ? group_scene : scene;
+        if (length == 0) {
+            // Empty or comment line
+        } else if (word_is(keyword, length, "sphere")) {
+            ok = parse_sphere(&parser, target, &materials);
+        } else if (word_is(keyword, length, "plane")) {
+            if (group_scene) {
+                parse_error(&parser, "an object cannot hold planes");
+                ok = false;
+            } else {
+                ok = parse_plane(&parser, scene, &materials);
+            }
+        } else if (word_is(keyword, length, "rect")) {
+            ok = parse_rect(&parser, target, &materials);
+        } else if (word_is(keyword, length, "disk")) {
+            ok = parse_disk(&parser, target, &materials);
+        } else if (word_is(keyword, length, "mesh")) {
+            ok = parse_mesh(&parser, target, &materials, cache_meshes);
+        } else if (word_is(keyword, length, "instance")) {
+            ok = parse_instance(&parser, target, &materials, &groups);
+        } else if (word_is(keyword, length, "object")) {
+            if (group_scene) {
+                parse_error(&parser, "object definitions cannot be nested");
+                ok = false;
+            } else if ((ok = next_name(&parser, group_name, "expected an object name"))) {
+                group_scene = scene_create();
+                group_line = parser.line;
+            }
+        } else if (word_is(keyword, length, "end")) {
+            if (group_scene == NULL) {
+                parse_error(&parser, "end without object");
+                ok = false;
+            } else {
+                ok = finish_group(&parser, &groups, group_name, group_scene);
+                group_scene = NULL;
+            }
+        } else if (word_is(keyword, length, "material")) {
+            ok = parse_material(&parser, scene, &materials);
+        } else if (word_is(keyword, length, "camera")) {
+            ok = parse_camera(&parser, desc);
+        } else if (word_is(keyword, length, "settings")) {
+            ok = parse_settings(&parser, desc);
+        } else if (word_is(keyword, length, "environment")) {
+            ok = parse_environment(&parser, desc);
+        } else {
+            parse_error(&parser, "unknown keyword");
+            ok = false;
+        }
+
+        // Anything but a comment after the line's arguments is an error
+        skip_space(&parser);
+        if (ok && !at_line_end(&parser)) {
+            parse_error(&parser, "unexpected text at end of line");
+            ok = false;
+        }
+        const char *newline = memchr(parser.p, '\n', parser.end - parser.p);
+        parser.p = newline ? newline + 1 : parser.end;
+        parser.line++;
+    }
+    if (ok && group_scene) {
+        parser.line = group_line;
+        parse_error(&parser, "object without end");
+        ok = false;
+    }
+
+    // Instances hold references to the groups they use, the rest go now
+    scene_delete(&group_scene);
+    for (uint32_t i = 0; i < groups.count; i++) {
+        group_release(&groups.groups[i].group);
+    }
+    free(groups.groups);
+    free(materials.slots);
+    if (size > 0) {
+        munmap((void *)data, size);
+    }
+    if (!ok) {
+        scene_delete(&scene);
+        return NULL;
+    }
+    return scene;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "render.h"
+#include "scene.h"
+#include "vec3.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Everything in a scene file besides the objects. Settings the file leaves out are
+// 0, -1 for the background, or an empty string for the environment.
+typedef struct {
+    bool has_camera;
+    vec3 look_from, look_at, vup;
+    double vfov, aperture, focus_dist; // focus_dist 0 focuses on look_at
+    uint32_t width, height, samples_per_pixel, max_depth;
+    double exposure;
+    int background; // A BackgroundType
+    char environment[PATH_MAX];
+} SceneDesc;
+
+Scene *scene_load(const char *path, SceneDesc *desc, bool cache_meshes);
@@ -0,0 +1,176 @@
+#include "stats.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every thread counts into its own block, so no counter is ever shared between
+// threads while rendering. Blocks live in a global list and are never freed: when a
+// thread exits, its block is released and the next new thread adopts it, carrying on
+// from the counts already in it. Summing all blocks therefore gives the totals for
+// every thread that ever ran, and the list stays as long as the largest number of
+// threads alive at once.
+typedef struct StatsBlock StatsBlock;
+
+struct StatsBlock {
+    RenderStats stats;
+    bool in_use;
+    StatsBlock *next;
+};
+
+static StatsBlock *blocks = NULL;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local StatsBlock *thread_block = NULL;
+
+static void release_block(void *block) {
+    pthread_mutex_lock(&blocks_lock);
+    ((StatsBlock *)block)->in_use = false;
+    pthread_mutex_unlock(&blocks_lock);
+}
+
+static void create_block_key(void) { pthread_key_create(&block_key, release_block); }
+
+//
+// Returns the calling thread's statistics block, claiming one on first use.
+//
+RenderStats *stats_thread_local(void) {
+    if (thread_block == NULL) {
+        pthread_once(&block_key_once, create_block_key);
+
+        pthread_mutex_lock(&blocks_lock);
+        StatsBlock *block = blocks;
+        while (block && block->in_use) {
+            block = block->next;
+        }
+        if (block == NULL) {
+            block = (StatsBlock *)calloc(1, sizeof(StatsBlock));
+            assert(block != NULL);
+            block->next = blocks;
+            blocks = block;
+        }
+        block->in_use = true;
+        pthread_mutex_unlock(&blocks_lock);
+
+        pthread_setspecific(block_key, block);
+        thread_block = block;
+    }
+    return &thread_block->stats;
+}
+
+//
+// Zeroes the counters of every thread. Must not be called while rendering.
+//
+void stats_reset(void) {
+    pthread_mutex_lock(&blocks_lock);
+    for (StatsBlock *block = blocks; block; block = block->next) {
+        memset(&block->stats, 0, sizeof(RenderStats));
+    }
+    pthread_mutex_unlock(&blocks_lock);
+}
+
+//
+// Sums the counters of all threads into total. Call once the render threads are done.
+//
+void stats_collect(RenderStats *total) {
+    memset(total, 0, sizeof(RenderStats));
+
+    pthread_mutex_lock(&blocks_lock);
+    for (StatsBlock *block = blocks; block; block = block->next) {
+        // RenderStats is nothing but uint64_t counters, so it can be summed as an array
+        const uint64_t *src = (const uint64_t *)&block->stats;
+        uint64_t *dst = (uint64_t *)total;
+        for (size_t i = 0; i < sizeof(RenderStats) / sizeof(uint64_t); i++) {
+            dst[i] += src[i];
+        }
+    }
+    pthread_mutex_unlock(&blocks_lock);
+}
+
+//
+// Returns the number of rays traced at any depth.
+//
+uint64_t stats_total_rays(const RenderStats *stats) {
+    uint64_t rays = 0;
+    for (int i = 0; i < STATS_MAX_DEPTH; i++) {
+        rays += stats->rays_by_depth[i];
+    }
+    return rays;
+}
+
+static double per(uint64_t n, uint64_t d) { return d ? (double)n / (double)d : 0.0; }
+
+//
+// Prints a summary of the statistics.
+//
+void stats_print(const RenderStats *stats) {
+    uint64_t rays = stats_total_rays(stats);
+
+    printf("Render statistics:\n");
+    printf("  Samples:              %llu\n", (unsigned long long)stats->samples);
+    printf("  Rays traced:          %llu\n", (unsigned long long)rays);
+    for (int i = 0; i < STATS_MAX_DEPTH; i++) {
+        if (stats->rays_by_depth[i]) {
+            printf("    depth %2d%s          %llu\n", i, i == STATS_MAX_DEPTH - 1 ? "+" : ":",
+                   (unsigned long long)stats->rays_by_depth[i]);
+        }
+    }
+    printf("  BVH nodes visited:    %llu (%.2f per ray)\n",
+           (unsigned long long)stats->bvh_nodes_visited, per(stats->bvh_nodes_visited, rays));
+    printf("  Box tests:            %llu (%.2f per ray)\n",
+           (unsigned long long)stats->box_tests, per(stats->box_tests, rays));
+    printf("  Primitive tests:      %llu (%.2f per ray, %.1f%% hit)\n",
+           (unsigned long long)stats->primitive_tests, per(stats->primitive_tests, rays),
+           100.0 * per(stats->primitive_hits, stats->primitive_tests));
+    printf("  Ray hits:             %llu\n", (unsigned long long)stats->ray_hits);
+    printf("  Background hits:      %llu\n", (unsigned long long)stats->background_hits);
+    printf("  Paths terminated by:\n");
+    printf("    depth limit:        %llu\n", (unsigned long long)stats->terminated_depth);
+    printf("    absorption:         %llu\n", (unsigned long long)stats->terminated_absorbed);
+    printf("    emission:           %llu\n", (unsigned long long)stats->terminated_emissive);
+    printf("    background:         %llu\n", (unsigned long long)stats->background_hits);
+}
+
+//
+// Writes the statistics out as JSON. Returns true on success.
+//
+bool stats_write_json(const char *path, const RenderStats *stats) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Failed to open %s!\n", path);
+        return false;
+    }
+
+    fprintf(file, "{\n  \"samples\": %llu,\n  \"rays\": %llu,\n  \"rays_by_depth\": [",
+            (unsigned long long)stats->samples,
+            (unsigned long long)stats_total_rays(stats));
+    int last = STATS_MAX_DEPTH - 1;
+    while (last > 0 && stats->rays_by_depth[last] == 0) {
+        last--;
+    }
+    for (int i = 0; i <= last; i++) {
+        fprintf(file, "%s%llu", i ? ", " : "", (unsigned long long)stats->rays_by_depth[i]);
+    }
+    fprintf(file,
+            "],\n  \"bvh_nodes_visited\": %llu,\n  \"box_tests\": %llu,\n"
+            "  \"primitive_tests\": %llu,\n  \"primitive_hits\": %llu,\n"
+            "  \"ray_hits\": %llu,\n  \"background_hits\": %llu,\n"
+            "  \"terminated\": {\"depth\": %llu, \"absorbed\": %llu, \"emissive\": %llu, "
+            "\"background\": %llu}\n}\n",
+            (unsigned long long)stats->bvh_nodes_visited,
+            (unsigned long long)stats->box_tests,
+            (unsigned long long)stats->primitive_tests,
+            (unsigned long long)stats->primitive_hits, (unsigned long long)stats->ray_hits,
+            (unsigned long long)stats->background_hits,
+            (unsigned long long)stats->terminated_depth,
+            (unsigned long long)stats->terminated_absorbed,
+            (unsigned long long)stats->terminated_emissive,
+            (unsigned long long)stats->background_hits);
+
+    bool ok = ferror(file) == 0;
+    ok = (fclose(file) == 0) && ok;
+    return ok;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Render statistics are compiled in only when RENDER_STATS is non-zero (build w/
+// `make STATS=1`). Otherwise every STAT_* macro expands to nothing, so the counters
+// cost nothing on the hot path.
+#ifndef RENDER_STATS
+#define RENDER_STATS 0
+#endif
+
+#define STATS_MAX_DEPTH 64 // Rays bounced more often than this are counted in the last bucket
+
+typedef struct {
+    uint64_t samples;                         // Camera samples taken
+    uint64_t rays_by_depth[STATS_MAX_DEPTH]; // Rays traced, by number of bounces
+    uint64_t bvh_nodes_visited;
+    uint64_t box_tests;
+    uint64_t primitive_tests;
+    uint64_t primitive_hits;
+    uint64_t ray_hits;        // Rays that hit an object
+    uint64_t background_hits; // Rays that missed everything and hit the background
+    uint64_t terminated_depth;
+    uint64_t terminated_absorbed;
+    uint64_t terminated_emissive;
+} RenderStats;
+
+RenderStats *stats_thread_local(void);
+
+void stats_reset(void);
+
+void stats_collect(RenderStats *total);
+
+uint64_t stats_total_rays(const RenderStats *stats);
+
+void stats_print(const RenderStats *stats);
+
+bool stats_write_json(const char *path, const RenderStats *stats);
+
+#if RENDER_STATS
+#define STAT_INC(field) (stats_thread_local()->field++)
+#define STAT_ADD(field, n) (stats_thread_local()->field += (n))
+#define STAT_RAY(bounce)                                                                  \
+    (stats_thread_local()->rays_by_depth[(bounce) < STATS_MAX_DEPTH ? (bounce)          \
+                                                                    : STATS_MAX_DEPTH - 1]++)
+#else
+#define STAT_INC(field) ((void)0)
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_RAY(bounce) ((void)0)
+#endif
@@ -0,0 +1,132 @@
+#include "sweep.h"
+#include "bvh.h"
+#include "framebuffer.h"
+#include "render.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Applies one value of a swept setting to config.
+//
+static void apply(Config *config, SweepParam param, uint32_t value) {
+    switch (param) {
+    case SWEEP_THREADS:
+        config->thread_count = value;
+        break;
+    case SWEEP_SPP:
+        config->samples_per_pixel = value;
+        break;
+    case SWEEP_DEPTH:
+        config->max_depth = value;
+        break;
+    case SWEEP_LEAF_SIZE:
+        config->leaf_size = value;
+        break;
+    case SWEEP_WIDTH:
+        config->image_width = value;
+        break;
+    case SWEEP_BVH:
+        config->use_bvh = value != 0;
+        break;
+    case SWEEP_BUILDER:
+        config->builder = (BVHBuilder)value;
+        break;
+    case SWEEP_OPTIMIZE:
+        config->optimize_bvh = value != 0;
+        break;
+    default:
+        break;
+    }
+}
+
+//
+// Renders the scene once for every combination of the swept settings, keeping all
+// other settings from config, and prints how long the BVH build, along with its
+// optimization if asked for, and the render took. Nothing is written out. The BVH is
+// rebuilt for every run, from the same object order and random seed, so runs only
+// differ in the swept settings.
+//
+void sweep_run(const Config *config, Scene *scene, Camera *cam,
+               const CpuTopology *topology) {
+    double aspect_ratio = (double)config->image_width / config->image_height;
+
+    // Building a BVH sorts the scene objects, so every build starts from this order
+    Hittable **order = (Hittable **)malloc(scene->object_count * sizeof(Hittable *));
+    assert(order != NULL);
+    memcpy(order, scene->objects, scene->object_count * sizeof(Hittable *));
+
+    uint32_t run_count = 1;
+    for (uint32_t a = 0; a < config->sweep_count; a++) {
+        printf("%8s ", sweep_param_names[config->sweep[a].param]);
+        run_count *= config->sweep[a].value_count;
+    }
+    printf("%10s %10s %10s\n", "build_ms", "render_s", "Mrays/s");
+
+    // Odometer over the sweep axes, the last axis changing fastest
+    uint32_t index[SWEEP_MAX_PARAMS] = {0};
+    for (uint32_t run = 0; run < run_count && !render_stop_requested(); run++) {
+        Config c = *config;
+        for (uint32_t a = 0; a < config->sweep_count; a++) {
+            apply(&c, config->sweep[a].param, config->sweep[a].values[index[a]]);
+            uint32_t value = config->sweep[a].values[index[a]];
+            if (config->sweep[a].param == SWEEP_BUILDER) {
+                printf("%8s ", bvh_builder_names[value]);
+            } else {
+                printf("%8u ", value);
+            }
+        }
+        c.image_height = (uint32_t)(c.image_width / aspect_ratio);
+        fflush(stdout);
+
+        memcpy(scene->objects, order, scene->object_count * sizeof(Hittable *));
+        bool pin = c.pin_threads || c.numa_replicas;
+        ThreadPool *pool = pool_create(c.thread_count - 1, pin ? topology : NULL);
+
+        random_seed(c.seed);
+        double start = now_seconds();
+        BVHNode *bvh =
+            c.use_bvh ? bvh_build_with(scene, c.builder, c.leaf_size, pool) : NULL;
+        if (c.optimize_bvh) {
+            bvh_optimize(scene, &bvh, pool);
+        }
+        double build_seconds = now_seconds() - start;
+        Placement *placement = c.numa_replicas ? placement_create(topology, scene, bvh) : NULL;
+
+        Framebuffer *fb = fb_create(c.image_width, c.image_height);
+        RenderArgs args = {.scene = scene,
+                           .cam = cam,
+                           .bvh = bvh,
+                           .background = c.background,
+                           .image_width = c.image_width,
+                           .image_height = c.image_height,
+                           .max_depth = c.max_depth,
+                           .fb = fb,
+                           .seed = c.seed,
+                           .pool = pool,
+                           .placement = placement};
+        start = now_seconds();
+        render_progressive(&args, c.samples_per_pixel, 0, NULL, 0, false);
+        double render_seconds = now_seconds() - start;
+
+        printf("%10.2f %10.3f %10.3f\n", build_seconds * 1e3, render_seconds,
+               args.rays / render_seconds / 1e6);
+
+        fb_delete(&fb);
+        placement_delete(&placement);
+        pool_delete(&pool);
+        bvh_delete(&bvh);
+
+        for (int32_t a = (int32_t)config->sweep_count - 1; a >= 0; a--) {
+            if (++index[a] < config->sweep[a].value_count) {
+                break;
+            }
+            index[a] = 0;
+        }
+    }
+
+    free(order);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "camera.h"
+#include "config.h"
+#include "cpu.h"
+#include "scene.h"
+
+void sweep_run(const Config *config, Scene *scene, Camera *cam,
+               const CpuTopology *topology);
@@ -0,0 +1,116 @@
+#include "trace.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    const char *name;
+    uint64_t time; // Nanoseconds since the trace started
+    char phase;    // 'B'egin or 'E'nd
+} TraceEvent;
+
+// Every thread records into its own buffer, which only that thread ever writes to, so
+// recording an event takes no locks. Buffers are pushed onto a global list with a
+// compare-and-swap when a thread records its first event, and are kept until exit.
+typedef struct TraceBuffer TraceBuffer;
+
+struct TraceBuffer {
+    uint32_t tid;
+    char thread_name[32];
+    TraceEvent *events;
+    size_t count, capacity;
+    TraceBuffer *next;
+};
+
+static _Atomic(TraceBuffer *) buffers = NULL;
+static _Thread_local TraceBuffer *thread_buffer = NULL;
+static _Atomic uint32_t next_tid = 1000; // For threads that never call trace_thread()
+
+static uint64_t trace_clock(void) {
+    static _Atomic uint64_t start = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+    uint64_t expected = 0;
+    atomic_compare_exchange_strong(&start, &expected, now);
+    return now - atomic_load(&start);
+}
+
+static TraceBuffer *get_buffer(void) {
+    if (thread_buffer == NULL) {
+        TraceBuffer *buffer = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+        assert(buffer != NULL);
+        buffer->tid = atomic_fetch_add(&next_tid, 1);
+        snprintf(buffer->thread_name, sizeof(buffer->thread_name), "thread %u",
+                 buffer->tid);
+
+        buffer->next = atomic_load(&buffers);
+        while (!atomic_compare_exchange_weak(&buffers, &buffer->next, buffer)) {
+        }
+        thread_buffer = buffer;
+    }
+    return thread_buffer;
+}
+
+//
+// Sets the row the calling thread's events show up in.
+//
+void trace_thread(uint32_t tid, const char *name) {
+    TraceBuffer *buffer = get_buffer();
+    buffer->tid = tid;
+    snprintf(buffer->thread_name, sizeof(buffer->thread_name), "%s", name);
+}
+
+//
+// Records the beginning ('B') or end ('E') of a span on the calling thread.
+//
+void trace_event(const char *name, char phase) {
+    uint64_t time = trace_clock();
+    TraceBuffer *buffer = get_buffer();
+    if (buffer->count == buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        buffer->events =
+            (TraceEvent *)realloc(buffer->events, buffer->capacity * sizeof(TraceEvent));
+        assert(buffer->events != NULL);
+    }
+    buffer->events[buffer->count++] = (TraceEvent){name, time, phase};
+}
+
+//
+// Writes every recorded event out in the Chrome trace event format, which can be
+// opened in Perfetto (ui.perfetto.dev) or chrome://tracing. Call once the traced
+// threads are done. Returns true on success.
+//
+bool trace_write(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Failed to open %s!\n", path);
+        return false;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for (TraceBuffer *buffer = atomic_load(&buffers); buffer; buffer = buffer->next) {
+        fprintf(file,
+                "%s{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": %u, "
+                "\"args\": {\"name\": \"%s\"}}",
+                first ? "" : ",\n", buffer->tid, buffer->thread_name);
+        first = false;
+        for (size_t i = 0; i < buffer->count; i++) {
+            TraceEvent *e = &buffer->events[i];
+            fprintf(file,
+                    ",\n{\"ph\": \"%c\", \"name\": \"%s\", \"pid\": 1, \"tid\": %u, "
+                    "\"ts\": %.3f}",
+                    e->phase, e->name, buffer->tid, e->time / 1000.0);
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    bool ok = ferror(file) == 0;
+    ok = (fclose(file) == 0) && ok;
+    return ok;
+}
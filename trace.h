@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timeline tracing is compiled in only when RENDER_TRACE is non-zero (build w/
+// `make TRACE=1`). Otherwise every TRACE_* macro expands to nothing.
+#ifndef RENDER_TRACE
+#define RENDER_TRACE 0
+#endif
+
+void trace_thread(uint32_t tid, const char *name);
+
+void trace_event(const char *name, char phase);
+
+bool trace_write(const char *path);
+
+#if RENDER_TRACE
+// Names the calling thread's row in the timeline. Threads given the same tid share a
+// row, so workers respawned for every pass still show up as one row each.
+#define TRACE_THREAD(tid, name) trace_thread(tid, name)
+// Begin and end a span on the calling thread. Spans must nest. name must be a string
+// literal, or otherwise outlive the trace.
+#define TRACE_BEGIN(name) trace_event(name, 'B')
+#define TRACE_END(name) trace_event(name, 'E')
+#else
+#define TRACE_THREAD(tid, name) ((void)0)
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name) ((void)0)
+#endif
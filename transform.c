@@ -0,0 +1,141 @@
+#include "transform.h"
+#include "util.h"
+
+#include <math.h>
+
+Transform transform_identity(void) {
+    Transform t = {{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}};
+    return t;
+}
+
+Transform transform_translate(vec3 offset) {
+    Transform t = transform_identity();
+    t.m[0][3] = offset.x;
+    t.m[1][3] = offset.y;
+    t.m[2][3] = offset.z;
+    return t;
+}
+
+Transform transform_scale(vec3 factors) {
+    Transform t = transform_identity();
+    t.m[0][0] = factors.x;
+    t.m[1][1] = factors.y;
+    t.m[2][2] = factors.z;
+    return t;
+}
+
+//
+// Rotation about an axis (0, 1, 2 for x, y, z) through the origin, counterclockwise
+// when looking down the axis towards the origin.
+//
+Transform transform_rotate(uint32_t axis, double degrees) {
+    double radians = degrees_to_radians(degrees);
+    double c = cos(radians), s = sin(radians);
+    uint32_t a = (axis + 1) % 3, b = (axis + 2) % 3;
+    Transform t = transform_identity();
+    t.m[a][a] = c;
+    t.m[a][b] = -s;
+    t.m[b][a] = s;
+    t.m[b][b] = c;
+    return t;
+}
+
+//
+// Returns the transform that applies inner and then outer.
+//
+Transform transform_compose(Transform outer, Transform inner) {
+    Transform t;
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 4; c++) {
+            t.m[r][c] = outer.m[r][0] * inner.m[0][c] + outer.m[r][1] * inner.m[1][c] +
+                        outer.m[r][2] * inner.m[2][c] + (c == 3 ? outer.m[r][3] : 0);
+        }
+    }
+    return t;
+}
+
+//
+// Inverts a transform. Returns false if it is singular, e.g. scales by 0.
+//
+bool transform_invert(Transform t, Transform *inverse) {
+    double (*m)[4] = t.m;
+    // Cofactors of the linear part, which make up its adjugate
+    double c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    double c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    double c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    double det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+    if (det == 0 || !isfinite(det)) {
+        return false;
+    }
+    double inv_det = 1.0 / det;
+    double (*i)[4] = inverse->m;
+    i[0][0] = c00 * inv_det;
+    i[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    i[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    i[1][0] = c01 * inv_det;
+    i[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    i[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    i[2][0] = c02 * inv_det;
+    i[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    i[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+    // The translation undoes the original one, in the inverted space
+    for (int r = 0; r < 3; r++) {
+        i[r][3] = -(i[r][0] * m[0][3] + i[r][1] * m[1][3] + i[r][2] * m[2][3]);
+    }
+    return true;
+}
+
+vec3 transform_point(const Transform *t, vec3 p) {
+    const double (*m)[4] = t->m;
+    return v3_init(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                   m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                   m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+}
+
+vec3 transform_vector(const Transform *t, vec3 v) {
+    const double (*m)[4] = t->m;
+    return v3_init(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                   m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                   m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+}
+
+//
+// Transforms a surface normal, given the inverse of the transform applied to the
+// surface. Normals go through the transpose of the inverse, which keeps them
+// perpendicular to the surface under non-uniform scaling. The result is not of unit
+// length.
+//
+vec3 transform_normal(const Transform *inverse, vec3 n) {
+    const double (*m)[4] = inverse->m;
+    return v3_init(m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+                   m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+                   m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z);
+}
+
+//
+// Transforms a ray. The direction is not normalized, so distances along the ray stay
+// the same in both spaces.
+//
+ray transform_ray(const Transform *t, ray r) {
+    ray out = {transform_point(t, r.orig), transform_vector(t, r.dir)};
+    return out;
+}
+
+//
+// Returns the bounding box of a transformed box (Arvo's method): each row of the
+// transform adds its smaller and larger product with the box to the new bounds.
+//
+AABB transform_box(const Transform *t, AABB box) {
+    double min[3], max[3];
+    double lo[3] = {box.min.x, box.min.y, box.min.z};
+    double hi[3] = {box.max.x, box.max.y, box.max.z};
+    for (int r = 0; r < 3; r++) {
+        min[r] = max[r] = t->m[r][3];
+        for (int c = 0; c < 3; c++) {
+            double a = t->m[r][c] * lo[c], b = t->m[r][c] * hi[c];
+            min[r] += a < b ? a : b;
+            max[r] += a < b ? b : a;
+        }
+    }
+    return aabb_init(v3_init(min[0], min[1], min[2]), v3_init(max[0], max[1], max[2]));
+}
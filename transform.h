@@ -0,0 +1,36 @@
+#pragma once
+
+#include "aabb.h"
+#include "ray.h"
+#include "vec3.h"
+
+#include <stdbool.h>
+
+// An affine transform, the top three rows of a 4x4 matrix whose bottom row is 0 0 0 1.
+// Points are column vectors, so a transform applies m[r][0..2] to x, y and z and adds
+// m[r][3].
+typedef struct {
+    double m[3][4];
+} Transform;
+
+Transform transform_identity(void);
+
+Transform transform_translate(vec3 offset);
+
+Transform transform_scale(vec3 factors);
+
+Transform transform_rotate(uint32_t axis, double degrees);
+
+Transform transform_compose(Transform outer, Transform inner);
+
+bool transform_invert(Transform t, Transform *inverse);
+
+vec3 transform_point(const Transform *t, vec3 p);
+
+vec3 transform_vector(const Transform *t, vec3 v);
+
+vec3 transform_normal(const Transform *inverse, vec3 n);
+
+ray transform_ray(const Transform *t, ray r);
+
+AABB transform_box(const Transform *t, AABB box);
@@ -1,12 +1,56 @@
 #include "util.h"
 
+#include <fcntl.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 double degrees_to_radians(double degrees) { return degrees * M_PI / 180.0; }
 
+// Random number generator state. Every thread owns its own stream so that the numbers
+// a thread draws never depend on what the other threads are doing.
+static _Thread_local uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+//
+// SplitMix64 finalizer - scrambles the bits of a 64 bit integer.
+//
+static uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+//
+// Resets the calling thread's random stream to the given seed.
+//
+void random_seed(uint64_t seed) { rng_state = mix64(seed); }
+
+//
+// Derives the seed of a single sample's random stream from the render seed, the
+// index of the pixel and the index of the sample within that pixel. Seeding each
+// sample this way makes the image independent of which thread renders which pixel.
+//
+uint64_t sample_seed(uint64_t seed, uint32_t pixel, uint32_t sample) {
+    return mix64(seed ^ mix64(((uint64_t)pixel << 32) | sample));
+}
+
 // Returns a random real in [0, 1)
-double random_uniform() { return (double)random() / (double)((long int)RAND_MAX + 1); }
+double random_uniform() {
+    rng_state += 0x9e3779b97f4a7c15ULL;
+    return (double)(mix64(rng_state) >> 11) * 0x1.0p-53;
+}
+
+//
+// Returns 64 random bits from the calling thread's random stream.
+//
+uint64_t random_u64(void) {
+    rng_state += 0x9e3779b97f4a7c15ULL;
+    return mix64(rng_state);
+}
 
 // Returns a random real in [min, max)
 double random_double(double min, double max) {
@@ -35,3 +79,151 @@ void swap_double(double *x, double *y) {
 // Returns a random integer in [min, max].
 //
 int random_int(int min, int max) { return (int)(random_double(min, max + 1)); }
+
+//
+// Folds a block of bytes into a running 64-bit FNV-1a hash. Pass 0 to start a new
+// hash.
+//
+uint64_t hash_bytes(const void *data, size_t size, uint64_t hash) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    if (hash == 0) {
+        hash = 0xcbf29ce484222325ULL;
+    }
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+//
+// Hashes size bytes eight at a time over four independent lanes, which keeps up
+// with reading a file where hash_bytes() would not.
+//
+static uint64_t hash_words(const unsigned char *data, size_t size, uint64_t hash) {
+    const uint64_t prime = 0x9e3779b97f4a7c15ULL;
+    uint64_t lanes[4] = {hash, hash + prime, hash ^ prime, hash - prime};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t word;
+            memcpy(&word, data + i + 8 * l, sizeof(word));
+            lanes[l] = (lanes[l] ^ word) * prime;
+            lanes[l] ^= lanes[l] >> 29;
+        }
+    }
+    hash = hash_bytes(lanes, sizeof(lanes), hash);
+    return hash_bytes(data + i, size - i, hash);
+}
+
+//
+// Hashes the contents of a file on top of a running hash, for keying caches of
+// what was loaded from it. Returns false if the file cannot be read.
+//
+bool hash_file(const char *path, uint64_t hash, uint64_t *result) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size > 0) {
+        void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        hash = hash_words((const unsigned char *)data, size, hash);
+        munmap(data, size);
+    }
+    close(fd);
+    *result = hash;
+    return true;
+}
+
+static const double powers_of_ten[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                       1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                       1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+//
+// Parses the decimal number in the length characters at start, all of which have to
+// belong to it. Returns false if they do not form one. The mantissa is accumulated as
+// an integer; when it and the power of ten are both exactly representable as doubles,
+// one multiplication or division rounds correctly, which gives the same result as
+// strtod(). Anything else falls back to strtod().
+//
+bool parse_double(const char *start, size_t length, double *value) {
+    const char *p = start, *end = start + length;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any_digits = false, exact = true;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, any_digits = true) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            digits += mantissa > 0;
+        } else {
+            exponent++;
+            exact = false;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, any_digits = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                digits += mantissa > 0;
+                exponent--;
+            } else {
+                exact = false;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool exponent_negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exponent_negative = *p++ == '-';
+        }
+        int e = 0;
+        bool any_exponent_digits = false;
+        for (; p < end && *p >= '0' && *p <= '9'; p++, any_exponent_digits = true) {
+            e = e < 10000 ? e * 10 + (*p - '0') : e;
+        }
+        any_digits = any_digits && any_exponent_digits;
+        exponent += exponent_negative ? -e : e;
+    }
+    if (!any_digits || p != end) {
+        return false;
+    }
+
+    if (exact && mantissa < (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        double v = (double)mantissa;
+        v = exponent < 0 ? v / powers_of_ten[-exponent] : v * powers_of_ten[exponent];
+        *value = negative ? -v : v;
+    } else {
+        char buffer[128];
+        if (length >= sizeof(buffer)) {
+            return false;
+        }
+        memcpy(buffer, start, length);
+        buffer[length] = '\0';
+        *value = strtod(buffer, NULL);
+    }
+    return true;
+}
+
+//
+// Returns the time in seconds on a monotonic clock. Only differences between two
+// calls are meaningful.
+//
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
@@ -1,9 +1,19 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 double degrees_to_radians(double degrees);
 
+void random_seed(uint64_t seed);
+
+uint64_t sample_seed(uint64_t seed, uint32_t pixel, uint32_t sample);
+
 double random_uniform(void);
 
+uint64_t random_u64(void);
+
 double random_double(double min, double max);
 
 double clamp(double x, double min, double max);
@@ -11,3 +21,11 @@ double clamp(double x, double min, double max);
 void swap_double(double *x, double *y);
 
 int random_int(int min, int max);
+
+uint64_t hash_bytes(const void *data, size_t size, uint64_t hash);
+
+bool hash_file(const char *path, uint64_t hash, uint64_t *result);
+
+bool parse_double(const char *start, size_t length, double *value);
+
+double now_seconds(void);
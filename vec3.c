@@ -229,10 +229,17 @@ bool v3_compare(vec3 a, vec3 b, uint8_t axis) {
     }
 }
 
+//
+// Returns the component of v along the axis, numbered as for v3_compare().
+//
+double v3_axis(vec3 v, uint8_t axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
 // Returns new vector containing component-wise minimums of two vectors
 vec3 v3_min(vec3 u, vec3 v) {
     double x = u.x < v.x ? u.x : v.x;
-    double y = u.y < v.y ? u.x : v.y;
+    double y = u.y < v.y ? u.y : v.y;
     double z = u.z < v.z ? u.z : v.z;
     return v3_init(x, y, z);
 }
@@ -240,7 +247,7 @@ vec3 v3_min(vec3 u, vec3 v) {
 // Returns new vector containing component-wise maximums of two vectors
 vec3 v3_max(vec3 u, vec3 v) {
     double x = u.x > v.x ? u.x : v.x;
-    double y = u.y > v.y ? u.x : v.y;
+    double y = u.y > v.y ? u.y : v.y;
     double z = u.z > v.z ? u.z : v.z;
     return v3_init(x, y, z);
 }